@@ -133,6 +133,7 @@ NSMutableAttributedString* Fileinfo2EXIFString(NSString *origPath, DYImageCache
 	if (self != [CreeveyController class]) return;
 
 	dcraw_init();
+	SetRawArena(1, 30); // a thumbnail thread working through a folder of raws reuses its decoder buffers
 
     NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
 	NSString *s = CREEVEY_DEFAULT_PATH;
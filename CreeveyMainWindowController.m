@@ -90,8 +90,9 @@ static time_t ExifDateFromFile(NSString *s) {
 	BOOL w = [seen containsObject:s];
 	[seen addObject:s];
 #endif
-	if (IsRaw(x) &&
-		(t = ExifDateFromRawFile(c)) != -1) {
+	struct dcraw_info info;
+	if (IsRaw(x) && RawInfoForFile(s, DCRAW_TIMESTAMP, &info) &&
+		(t = info.timestamp) != -1) {
 #ifdef LOGSORT
 		if (!w) NSLog(@"raw %@:%@", [NSDate dateWithTimeIntervalSince1970:t], s.lastPathComponent);
 #endif
@@ -1208,10 +1209,12 @@ NSComparator ComparatorForSortOrder(short sortOrder) {
 			if (_background)
 				[NSThread sleepForTimeInterval:0.1];
 		}
-		if (!workToDo)
+		if (!workToDo) {
+			TrimRawArena(); // we'll be waiting for a while, so don't sit on the decoder buffers
 			[self performSelectorOnMainThread:@selector(updateStatusFld)
 								   withObject:nil
 								waitUntilDone:NO];
+		}
 	}
 }
 
@@ -9,6 +9,7 @@
 
 #import "DYImageCache.h"
 #import "DYCarbonGoodies.h"
+#import "DYExiftags.h"
 #import <sys/stat.h>
 
 #define N_StringFromFileSize_UNITS 3
@@ -408,16 +409,72 @@ static void ScaleCGImage(CGImageSourceRef orig, CGSize boundingSize, DYImageInfo
 	}
 }
 
+static void FreeRawPixels(void *info, const void *data, size_t size) {
+	free((void *)data);
+}
+
+// wraps dcraw's dc_rgb output in a CGImage without copying it, then scales it down like ScaleCGImage would
+static void ScaleRawPixels(char *data, size_t len, size_t stride, unsigned short w, unsigned short h, CGSize boundingSize, DYImageInfo *imgInfo) {
+	CGDataProviderRef provider = CGDataProviderCreateWithData(NULL, data, len, FreeRawPixels);
+	if (!provider) {
+		free(data);
+		return;
+	}
+	CGColorSpaceRef space = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
+	CGImageRef ref = CGImageCreate(w, h, 8, 32, stride, space, kCGImageAlphaNoneSkipLast|kCGBitmapByteOrder32Big, provider, NULL, false, kCGRenderingIntentDefault);
+	CGColorSpaceRelease(space);
+	CGDataProviderRelease(provider);
+	if (ref) {
+		CGFloat maxLen = MAX(boundingSize.width, boundingSize.height);
+		CGImageRef scaled = (w > maxLen || h > maxLen) ? CreateScaledNicer(ref, NSMakeSize(maxLen, maxLen)) : NULL;
+		imgInfo.image = [[NSImage alloc] initWithCGImage:scaled ?: ref size:NSZeroSize];
+		if (scaled) CFRelease(scaled);
+		CFRelease(ref);
+	}
+}
+
 - (void)createScaledImage:(DYImageInfo *)imgInfo {
 	if (imgInfo->fileSize == 0)
 		return;  // nsimage crashes on zero-length files
 	NSString *path = imgInfo.path;
 	NSString *ext = path.pathExtension.lowercaseString;
+	NSData *thumbData = nil;
 	char *data;
-	size_t len;
+	size_t len, stride;
 	unsigned short thumbW, thumbH, rawW, rawH, orientation;
 	enum dcraw_type thumbType;
-	if (_fastThumbnails && IsRaw(ext) && (data = ExtractThumbnailFromRawFile(path.fileSystemRepresentation, &len, &thumbW, &thumbH, &thumbType, &rawW, &rawH, &orientation))) {
+	struct dcraw_info rawInfo;
+	if (_fastThumbnails && IsRaw(ext) && RawInfoForFile(path, DCRAW_ALL, &rawInfo)) {
+		// files without a preview still go to dcraw, which bins the sensor data down to about targetSize
+		unsigned short targetSize = MAX(boundingSize.width, boundingSize.height);
+		int i = SelectRawPreview(&rawInfo, targetSize);
+		struct dcraw_preview preview = i < 0 ? (struct dcraw_preview){0} : rawInfo.previews[i];
+		const void *bytes;
+		int mapped;
+		if (i >= 0 && preview.type == dc_jpeg && (bytes = MapRawPreview(path.fileSystemRepresentation, &preview, &mapped))) {
+			// we already know where the preview is, so hand it to Image I/O without parsing or copying anything
+			thumbData = [[NSData alloc] initWithBytesNoCopy:(void *)bytes length:preview.length deallocator:^(void *b, NSUInteger n) {
+				UnmapRawPreview(b, &preview, mapped);
+			}];
+			thumbW = preview.width;
+			thumbH = preview.height;
+			thumbType = dc_jpeg;
+			rawW = rawInfo.raw_width;
+			rawH = rawInfo.raw_height;
+			orientation = rawInfo.orientation;
+		} else if ((data = DecodeThumbnailFromRawFile(path.fileSystemRepresentation, targetSize, 4, &len, &stride, &thumbW, &thumbH, &thumbType, &rawW, &rawH, &orientation))) {
+			if (thumbType == dc_rgb) {
+				// decoded pixels need no Image I/O round trip
+				ScaleRawPixels(data, len, stride, thumbW, thumbH, boundingSize, imgInfo);
+				imgInfo->exifOrientation = orientation;
+				imgInfo->pixelSize.width = rawW;
+				imgInfo->pixelSize.height = rawH;
+			} else {
+				thumbData = [[NSData alloc] initWithBytesNoCopy:data length:len freeWhenDone:YES];
+			}
+		}
+	}
+	if (thumbData) {
 		imgInfo->exifOrientation = orientation; // this needs to be set before
 		NSString *hint;
 		switch (thumbType) {
@@ -426,14 +483,15 @@ static void ScaleCGImage(CGImageSourceRef orig, CGSize boundingSize, DYImageInfo
 			default:      hint = @"public.pbm"; break;
 		}
 		NSDictionary *opts = @{(__bridge NSString *)kCGImageSourceTypeIdentifierHint: hint};
-		CGImageSourceRef orig = CGImageSourceCreateWithData((__bridge CFDataRef)[NSData dataWithBytesNoCopy:data length:len freeWhenDone:NO], (__bridge CFDictionaryRef)opts);
+		CGImageSourceRef orig = CGImageSourceCreateWithData((__bridge CFDataRef)thumbData, (__bridge CFDictionaryRef)opts);
 		if (orig) {
 			ScaleCGImage(orig, boundingSize, imgInfo, YES);
 			CFRelease(orig);
 		}
+		if (imgInfo->exifOrientation == 0 && thumbType == dc_jpeg)
+			imgInfo->exifOrientation = orientation; // embedded JPEG previews don't always have their own EXIF
 		imgInfo->pixelSize.width = rawW; // these need to be set after (otherwise the width/height are for the thumb)
 		imgInfo->pixelSize.height = rawH;
-		free(data);
 #if 0
 		if (imgInfo.image) NSLog(@"got orientation %i, size %ix%i, thumb %ix%i for %@", orientation, rawW, rawH,thumbW,thumbH, path.lastPathComponent);
 	}
@@ -1,4 +1,3 @@
-#include "dcraw.h"
 #define DCRAW_VERSION "9.28"
 
 #define NODEPS
@@ -6,6 +5,7 @@
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
+#include "dcraw.h"
 #define _USE_MATH_DEFINES
 #include <ctype.h>
 #include <errno.h>
@@ -19,6 +19,23 @@
 #include <string.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __APPLE__
+#include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+#include <sys/mount.h>
+#elif defined(__linux__)
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define fgetc getc_unlocked
 #include <unistd.h>
@@ -29,14 +46,13 @@ typedef unsigned long long UINT64;
 
 #ifdef NODEPS
 #define NO_JASPER
-#define NO_JPEG
 #define NO_LCMS
 #endif
 #ifndef NO_JASPER
 #include <jasper/jasper.h>        /* Decode Red camera movies */
 #endif
 #ifndef NO_JPEG
-#include <jpeglib.h>                /* Decode compressed Kodak DC120 photos */
+#include "jpeglib.h"                /* Decode compressed Kodak DC120 photos */
 #endif                                /* and Adobe Lossy DNGs */
 #ifndef NO_LCMS
 #include <lcms2.h>                /* Support color profiles */
@@ -55,67 +71,76 @@ typedef unsigned long long UINT64;
 #define ushort unsigned short
 #endif
 
-#include <pthread.h>
-static pthread_mutex_t mutex;
+#ifndef thread_local
+#define thread_local _Thread_local
+#endif
 /*
    All global variables are defined here, and all functions that
-   access them are prefixed with "CLASS".  For thread-safety, all
-   non-const static local variables except cbrt[] must be declared
-   "thread_local".
+   access them are prefixed with "CLASS".  For thread-safety, every
+   global and every non-const static local variable is declared
+   "thread_local", so each thread gets its own decoder state
+   (including its own "failure" jmp_buf) and the public entry points
+   below can run on any number of threads at once.
  */
-FILE *ifp, *ofp;
-short order;
-const char *ifname;
-char *meta_data, xtrans[6][6], xtrans_abs[6][6];
-char cdesc[5], desc[512], make[64], model[64], model2[64], artist[64];
-float flash_used, canon_ev, iso_speed, shutter, aperture, focal_len;
-time_t timestamp;
-off_t strip_offset, data_offset;
-off_t thumb_offset, meta_offset, profile_offset;
-unsigned shot_order, kodak_cbpp, exif_cfa, unique_id;
-unsigned thumb_length, meta_length, profile_length;
-unsigned thumb_misc, *oprof, fuji_layout, shot_select=0, multi_out=0;
-unsigned tiff_nifds, tiff_samples, tiff_bps, tiff_compress;
-unsigned black, maximum, mix_green, raw_color, zero_is_bad;
-unsigned zero_after_ff, is_raw, dng_version, is_foveon, data_error;
-unsigned tile_width, tile_length, gpsdata[32], load_flags;
-unsigned flip, tiff_flip, filters, colors;
-ushort raw_height, raw_width, height, width, top_margin, left_margin;
-ushort shrink, iheight, iwidth, fuji_width, thumb_width, thumb_height;
-ushort *raw_image, (*image)[4], cblack[4102];
-ushort white[8][8], curve[0x10000], cr2_slice[3], sraw_mul[4];
-double pixel_aspect, aber[4]={1,1,1,1}, gamm[6]={ 0.45,4.5,0,0,0,0 };
-float bright=1, user_mul[4]={0,0,0,0}, threshold=0;
-int mask[8][4];
-int half_size=0, four_color_rgb=0, document_mode=0, highlight=0;
-int verbose=0, use_auto_wb=0, use_camera_wb=0, use_camera_matrix=1;
-int output_color=1, output_bps=8, output_tiff=0, med_passes=0;
-int no_auto_bright=0;
-unsigned greybox[4] = { 0, 0, UINT_MAX, UINT_MAX };
-float cam_mul[4], pre_mul[4], cmatrix[3][4], rgb_cam[3][4];
+thread_local FILE *ifp, *ofp;
+thread_local struct dcraw_io_stats io_stats;
+thread_local short order;
+thread_local const char *ifname;
+thread_local char *meta_data, xtrans[6][6], xtrans_abs[6][6];
+thread_local char cdesc[5], desc[512], make[64], model[64], model2[64], artist[64];
+thread_local float flash_used, canon_ev, iso_speed, shutter, aperture, focal_len;
+thread_local time_t timestamp;
+thread_local off_t strip_offset, data_offset;
+thread_local off_t thumb_offset, meta_offset, profile_offset;
+thread_local unsigned shot_order, kodak_cbpp, exif_cfa, unique_id;
+thread_local unsigned thumb_length, meta_length, profile_length;
+thread_local unsigned thumb_misc, *oprof, fuji_layout, shot_select=0, multi_out=0;
+thread_local unsigned tiff_nifds, tiff_samples, tiff_bps, tiff_compress;
+thread_local unsigned black, maximum, mix_green, raw_color, zero_is_bad;
+thread_local unsigned zero_after_ff, is_raw, dng_version, is_foveon, data_error;
+thread_local unsigned tile_width, tile_length, gpsdata[32], load_flags;
+thread_local unsigned flip, tiff_flip, filters, colors;
+thread_local ushort raw_height, raw_width, height, width, top_margin, left_margin;
+thread_local ushort shrink, iheight, iwidth, fuji_width, thumb_width, thumb_height;
+thread_local ushort *raw_image, (*image)[4], cblack[4102];
+thread_local ushort white[8][8], curve[0x10000], cr2_slice[3], sraw_mul[4];
+thread_local double pixel_aspect, aber[4]={1,1,1,1}, gamm[6]={ 0.45,4.5,0,0,0,0 };
+thread_local float bright=1, user_mul[4]={0,0,0,0}, threshold=0;
+thread_local int mask[8][4];
+thread_local int half_size=0, four_color_rgb=0, document_mode=0, highlight=0;
+thread_local int verbose=0, use_auto_wb=0, use_camera_wb=0, use_camera_matrix=1;
+thread_local int output_color=1, output_bps=8, output_tiff=0, med_passes=0;
+thread_local int no_auto_bright=0, output_pixels=0, no_strips=0;
+thread_local uchar *rgb_data;
+thread_local size_t rgb_stride;
+thread_local unsigned greybox[4] = { 0, 0, UINT_MAX, UINT_MAX };
+thread_local float cam_mul[4], pre_mul[4], cmatrix[3][4], rgb_cam[3][4];
 const double xyz_rgb[3][3] = {                        /* XYZ from RGB */
   { 0.412453, 0.357580, 0.180423 },
   { 0.212671, 0.715160, 0.072169 },
   { 0.019334, 0.119193, 0.950227 } };
 const float d65_white[3] = { 0.950456, 1, 1.088754 };
-int histogram[4][0x2000];
-void (*write_thumb)(), (*write_fun)();
-void (*load_raw)(), (*thumb_load_raw)();
-jmp_buf failure;
-int exifBase, exifSize;
-
-struct decode {
+thread_local int histogram[4][0x2000];
+thread_local void (*write_thumb)(), (*write_fun)();
+thread_local void (*load_raw)(), (*thumb_load_raw)();
+thread_local jmp_buf failure;
+thread_local int exifBase, exifSize;
+thread_local unsigned wanted_fields = DCRAW_ALL;
+thread_local struct dcraw_preview previews[DCRAW_MAX_PREVIEWS];
+thread_local unsigned npreviews;
+
+thread_local struct decode {
   struct decode *branch[2];
   int leaf;
 } first_decode[2048], *second_decode, *free_decode;
 
-struct tiff_ifd {
+thread_local struct tiff_ifd {
   int width, height, bps, comp, phint, offset, flip, samples, bytes;
   int tile_width, tile_length;
   float shutter;
 } tiff_ifd[10];
 
-struct ph1 {
+thread_local struct ph1 {
   int format, key_off, tag_21a;
   int black, split_col, black_col, split_row, black_row;
   float tag_210;
@@ -555,22 +580,30 @@ int CLASS canon_s2is()
   return 0;
 }
 
-unsigned CLASS getbithuff (int nbits, ushort *huff)
+thread_local UINT64 bitbuf=0;
+thread_local int vbits=0, reset=0;
+
+void CLASS fill_bits (int nbits)
 {
-  static unsigned bitbuf=0;
-  static int vbits=0, reset=0;
   unsigned c;
 
-  if (nbits > 25) return 0;
-  if (nbits < 0)
-    return bitbuf = vbits = reset = 0;
-  if (nbits == 0 || vbits < 0) return 0;
   while (!reset && vbits < nbits && (c = fgetc(ifp)) != EOF &&
     !(reset = zero_after_ff && c == 0xff && fgetc(ifp))) {
     bitbuf = (bitbuf << 8) + (uchar) c;
     vbits += 8;
   }
-  c = bitbuf << (32-vbits) >> (32-nbits);
+}
+
+unsigned CLASS getbithuff (int nbits, ushort *huff)
+{
+  unsigned c;
+
+  if (nbits > 25) return 0;
+  if (nbits < 0)
+    return bitbuf = vbits = reset = 0;
+  if (nbits == 0 || vbits < 0) return 0;
+  fill_bits (nbits);
+  c = bitbuf << (64-vbits) >> (64-nbits);
   if (huff) {
     vbits -= huff[c] >> 8;
     c = (uchar) huff[c];
@@ -581,7 +614,56 @@ unsigned CLASS getbithuff (int nbits, ushort *huff)
 }
 
 #define getbits(n) getbithuff(n,0)
-#define gethuff(h) getbithuff(*h,h+1)
+#define gethuff(h) getbithuff(*h & 0xff,h+1)
+
+/*
+   Decoders built by make_decoder() also carry a lookup table, indexed
+   by the next HUFF_LUT_BITS bits, that resolves a code together with
+   the difference bits after it.  Plain gethuff() ignores it.
+ */
+#define HUFF_LUT_BITS 14
+#define HUFF_LUT 0x100                /* flag in huff[0] */
+
+void CLASS make_huff_lut (ushort *huff)
+{
+  int max = huff[0], *lut = (int *) (huff + 2 + (1 << max));
+  int x, h, len, bits, diff;
+
+  for (x=0; x < 1 << HUFF_LUT_BITS; x++) {
+    h = huff[1 + (max > HUFF_LUT_BITS ?
+        x << (max-HUFF_LUT_BITS) : x >> (HUFF_LUT_BITS-max))];
+    len = h & 0xff;
+    bits = (h >> 8) + len;
+    if (len > 15 || !(h >> 8) || bits > HUFF_LUT_BITS) continue;
+    diff = x >> (HUFF_LUT_BITS-bits) & ((1 << len) - 1);
+    if (len && (diff & (1 << (len-1))) == 0)
+      diff -= (1 << len) - 1;
+    lut[x] = diff * 256 + bits;
+  }
+  huff[0] |= HUFF_LUT;
+}
+
+/*
+   Decode the next difference with a single table lookup, topping
+   the bit buffer up a whole word at a time.  Returns 0 if the code
+   or its difference is too long, so the caller must do it the slow way.
+ */
+int CLASS huff_lut_diff (ushort *huff, int *diff)
+{
+  int e;
+
+  if (!(huff[0] & HUFF_LUT) || vbits < 0) return 0;
+  if (vbits < HUFF_LUT_BITS) {
+    fill_bits (57);
+    if (vbits < HUFF_LUT_BITS) return 0;
+  }
+  e = ((int *) (huff + 2 + (1 << (huff[0] & 0xff))))
+        [bitbuf << (64-vbits) >> (64-HUFF_LUT_BITS)];
+  if (!e) return 0;
+  vbits -= e & 0xff;
+  *diff = e >> 8;
+  return 1;
+}
 
 /*
    Construct a decode tree according the specification in *source.
@@ -617,7 +699,7 @@ ushort * CLASS make_decoder_ref (const uchar **source)
 
   count = (*source += 16) - 17;
   for (max=16; max && !count[max]; max--);
-  huff = (ushort *) calloc (1 + (1 << max), sizeof *huff);
+  huff = (ushort *) calloc (2 + (1 << max) + (2 << HUFF_LUT_BITS), sizeof *huff);
   merror (huff, "make_decoder()");
   huff[0] = max;
   for (h=len=1; len <= max; len++)
@@ -625,6 +707,7 @@ ushort * CLASS make_decoder_ref (const uchar **source)
       for (j=0; j < 1 << (max-len); j++)
         if (h <= 1 << max)
           huff[h++] = len << 8 | **source;
+  make_huff_lut (huff);
   return huff;
 }
 
@@ -771,6 +854,578 @@ void CLASS canon_load_raw()
   FORC(2) free (huff[c]);
 }
 
+/*
+   The raw loaders and demosaicing kernels split their work into
+   tiles or row bands ("jobs") and hand them to a bounded pool of
+   worker threads.  Each worker first adopts the calling thread's
+   decoder and image state, so a job can use the usual globals.  Jobs
+   must not allocate (merror() would longjmp on the wrong thread), and
+   the split must leave the output bit-identical to a single-threaded
+   run.
+ */
+#define BAND 64                /* rows per job */
+
+static int max_workers = 1;        /* set by dcraw_init() */
+
+void CLASS cielab (ushort rgb[3], short lab[3]);
+
+struct worker_pool {
+  void (CLASS *run)(void *arg, int job);
+  void *arg;
+  int njobs, next;
+  pthread_mutex_t lock;
+  const char *ifname;
+  short order;
+  unsigned dng_version, tiff_samples, shot_select, is_raw, zero_after_ff;
+  unsigned tile_width, tile_length, load_flags;
+  ushort raw_height, raw_width, *raw_image, *curve, cr2_slice[3];
+  ushort (*image)[4], height, width, iheight, iwidth, shrink;
+  ushort top_margin, left_margin;
+  unsigned filters;
+  int colors;
+  char xtrans[6][6];
+  float rgb_cam[3][4];
+};
+
+void CLASS run_worker_job (void *ctx, size_t job)
+{
+  struct worker_pool *wp = (struct worker_pool *) ctx;
+
+  ifname = wp->ifname;
+  order = wp->order;
+  dng_version = wp->dng_version;
+  tiff_samples = wp->tiff_samples;
+  shot_select = wp->shot_select;
+  is_raw = wp->is_raw;
+  zero_after_ff = wp->zero_after_ff;
+  tile_width = wp->tile_width;
+  tile_length = wp->tile_length;
+  load_flags = wp->load_flags;
+  raw_height = wp->raw_height;
+  raw_width = wp->raw_width;
+  raw_image = wp->raw_image;
+  if (curve != wp->curve)
+    memcpy (curve, wp->curve, sizeof curve);
+  memcpy (cr2_slice, wp->cr2_slice, sizeof cr2_slice);
+  image = wp->image;
+  height = wp->height;
+  width = wp->width;
+  iheight = wp->iheight;
+  iwidth = wp->iwidth;
+  shrink = wp->shrink;
+  top_margin = wp->top_margin;
+  left_margin = wp->left_margin;
+  filters = wp->filters;
+  colors = wp->colors;
+  memcpy (xtrans, wp->xtrans, sizeof xtrans);
+  memcpy (rgb_cam, wp->rgb_cam, sizeof rgb_cam);
+  cielab (0,0);
+  (*wp->run)(wp->arg, job);
+}
+
+#ifndef __APPLE__
+void * CLASS worker_thread (void *ctx)
+{
+  struct worker_pool *wp = (struct worker_pool *) ctx;
+  int job;
+
+  for (;;) {
+    pthread_mutex_lock (&wp->lock);
+    job = wp->next++;
+    pthread_mutex_unlock (&wp->lock);
+    if (job >= wp->njobs) return 0;
+    run_worker_job (wp, job);
+  }
+}
+#endif
+
+void CLASS run_jobs (int njobs, void (CLASS *run)(void *arg, int job), void *arg)
+{
+  struct worker_pool wp;
+  int i;
+
+  if (MIN(njobs, max_workers) < 2) {
+    for (i=0; i < njobs; i++) (*run)(arg, i);
+    return;
+  }
+  wp.run = run;
+  wp.arg = arg;
+  wp.njobs = njobs;
+  wp.next = 0;
+  wp.ifname = ifname;
+  wp.order = order;
+  wp.dng_version = dng_version;
+  wp.tiff_samples = tiff_samples;
+  wp.shot_select = shot_select;
+  wp.is_raw = is_raw;
+  wp.zero_after_ff = zero_after_ff;
+  wp.tile_width = tile_width;
+  wp.tile_length = tile_length;
+  wp.load_flags = load_flags;
+  wp.raw_height = raw_height;
+  wp.raw_width = raw_width;
+  wp.raw_image = raw_image;
+  wp.curve = curve;
+  memcpy (wp.cr2_slice, cr2_slice, sizeof cr2_slice);
+  wp.image = image;
+  wp.height = height;
+  wp.width = width;
+  wp.iheight = iheight;
+  wp.iwidth = iwidth;
+  wp.shrink = shrink;
+  wp.top_margin = top_margin;
+  wp.left_margin = left_margin;
+  wp.filters = filters;
+  wp.colors = colors;
+  memcpy (wp.xtrans, xtrans, sizeof xtrans);
+  memcpy (wp.rgb_cam, rgb_cam, sizeof rgb_cam);
+#ifdef __APPLE__
+  dispatch_apply_f (njobs, dispatch_get_global_queue
+        (DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), &wp, run_worker_job);
+#else
+  pthread_t tid[max_workers];
+  pthread_mutex_init (&wp.lock, 0);
+  for (i=1; i < MIN(njobs, max_workers); i++)
+    if (pthread_create (tid+i, 0, worker_thread, &wp)) break;
+  worker_thread (&wp);
+  while (--i > 0) pthread_join (tid[i], 0);
+  pthread_mutex_destroy (&wp.lock);
+#endif
+}
+
+/*
+   With the arena on (SetRawArena), DecodeThumbnailFromRawFile keeps
+   the raw, image, metadata and profile buffers between calls on the
+   same thread, so a batch of files from one camera allocates them
+   once.  arena_calloc() hands back a slot's buffer zeroed, growing it
+   only when it is too small; arena_free() leaves arena buffers alone
+   and frees anything else.  Each thread's buffers hang off a block on
+   the heap, linked into a list so other threads can drop them: every
+   decode drops those of threads idle for more than arena_idle seconds,
+   and TrimRawArena drops those of every thread not decoding.  The
+   block itself goes when its thread exits.
+ */
+enum { ARENA_RAW, ARENA_IMAGE, ARENA_META, ARENA_PROFILE, ARENA_SLOTS };
+
+struct arena {
+  struct arena_buf {
+    void *ptr;
+    size_t size;
+  } buf[ARENA_SLOTS];
+  time_t used;
+  int busy;                        /* only its own thread touches buf */
+  struct arena *next, **prev;
+};
+
+thread_local struct arena *arena;
+thread_local struct dcraw_alloc_stats alloc_stats;
+static atomic_int arena_on = 0;
+static atomic_uint arena_idle = 0;
+static pthread_key_t arena_key;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena *arenas;        /* guarded by arena_lock */
+
+void CLASS arena_release (struct arena *ar)
+{
+  int i;
+
+  for (i=0; i < ARENA_SLOTS; i++) {
+    free (ar->buf[i].ptr);
+    ar->buf[i].ptr = 0;
+    ar->buf[i].size = 0;
+  }
+}
+
+void CLASS arena_exit (void *arg)
+{
+  struct arena *ar = (struct arena *) arg;
+
+  pthread_mutex_lock (&arena_lock);
+  if ((*ar->prev = ar->next)) ar->next->prev = ar->prev;
+  pthread_mutex_unlock (&arena_lock);
+  arena_release (ar);
+  free (ar);
+}
+
+/* take this thread's arena for a decode, and trim the idle ones */
+void CLASS arena_begin()
+{
+  struct arena *ar;
+  time_t now = time(0);
+
+  if (!arena && arena_on && (arena = (struct arena *) calloc (1, sizeof *arena))) {
+    pthread_setspecific (arena_key, arena);
+    pthread_mutex_lock (&arena_lock);
+    if ((arena->next = arenas)) arenas->prev = &arena->next;
+    arena->prev = &arenas;
+    arenas = arena;
+    pthread_mutex_unlock (&arena_lock);
+  }
+  pthread_mutex_lock (&arena_lock);
+  for (ar=arenas; ar; ar=ar->next)
+    if (!ar->busy && (!arena_on || now - ar->used > arena_idle))
+      arena_release (ar);
+  if (arena) arena->busy = 1;
+  pthread_mutex_unlock (&arena_lock);
+}
+
+void CLASS arena_end()
+{
+  if (!arena) return;
+  pthread_mutex_lock (&arena_lock);
+  arena->used = time(0);
+  arena->busy = 0;
+  pthread_mutex_unlock (&arena_lock);
+}
+
+void * CLASS arena_calloc (int slot, size_t nmemb, size_t size)
+{
+  struct arena_buf *ab = arena && arena->busy && arena_on ? arena->buf + slot : 0;
+  size_t bytes = nmemb * size;
+  void *ptr;
+
+  if (ab && ab->ptr && ab->size >= bytes) {
+    alloc_stats.reuses++;
+    return memset (ab->ptr, 0, bytes);
+  }
+  if (!(ptr = calloc (nmemb, size))) return 0;
+  alloc_stats.allocs++;
+  alloc_stats.alloc_bytes += bytes;
+  if (ab) {
+    free (ab->ptr);
+    ab->ptr = ptr;
+    ab->size = bytes;
+  }
+  return ptr;
+}
+
+void CLASS arena_free (void *ptr)
+{
+  int i;
+
+  if (ptr && arena && arena->busy)
+    for (i=0; i < ARENA_SLOTS; i++)
+      if (arena->buf[i].ptr == ptr) return;
+  free (ptr);
+}
+
+/*
+   All input files are opened with open_input().  Files on internal disks
+   are mapped, so seeks and reads cost a memcpy at most.  Anything else
+   (SMB, NFS, FUSE, USB drives, cards) is read in large blocks through a small cache with
+   readahead, so the hundreds of short seeks made while parsing the
+   headers come down to a few big reads.  Either way the caller gets an
+   ordinary FILE, so get2(), get4(), fread() and fseek() work unchanged.
+ */
+#define INPUT_BLOCK 0x40000
+#define INPUT_SLOTS 16
+
+struct input {
+  int fd;
+  off_t size, pos, next;
+  uchar *map;
+  struct {
+    off_t offset;
+    unsigned length, used;
+    uchar *data;
+  } slot[INPUT_SLOTS];
+  unsigned clock;
+  struct dcraw_io_stats stats, *out;
+};
+
+/*
+   A mapped file is only safe to read while its pages can't go away: if
+   a card is pulled or a server drops mid-decode, the next page fault is
+   a SIGBUS that kills the browser, where a read would have come up
+   short for derror() to catch.  So, like NSDataReadingMappedIfSafe,
+   only internal, fixed disks are mapped.  Asking CoreFoundation is slow,
+   so the answer is kept for each mounted volume.
+ */
+#ifdef __APPLE__
+#define MAP_VOLUMES 16
+
+static struct {
+  fsid_t fsid;
+  char from[sizeof ((struct statfs *) 0)->f_mntfromname];
+  int ok;
+} map_volumes[MAP_VOLUMES];
+static unsigned map_next;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int CLASS volume_is_fixed (const char *root)
+{
+  const CFStringRef keys[] = { kCFURLVolumeIsInternalKey,
+	kCFURLVolumeIsRemovableKey, kCFURLVolumeIsEjectableKey };
+  CFURLRef url;
+  CFBooleanRef val;
+  int i, ok=1;
+
+  if (!(url = CFURLCreateFromFileSystemRepresentation
+	(0, (const UInt8 *) root, strlen (root), 1))) return 0;
+  for (i=0; ok && i < 3; i++) {
+    val = 0;
+    /* internal must be known true, the others known false */
+    ok = CFURLCopyResourcePropertyForKey (url, keys[i], &val, 0) && val &&
+	CFBooleanGetValue (val) == !i;
+    if (val) CFRelease (val);
+  }
+  CFRelease (url);
+  return ok;
+}
+#else
+int CLASS sysfs_flag (const char *dir, const char *name)
+{
+  char path[PATH_MAX+32];
+  FILE *fp;
+  int c;
+
+  snprintf (path, sizeof path, "%s/%s", dir, name);
+  if (!(fp = fopen (path, "r"))) return 0;
+  c = fgetc (fp);
+  fclose (fp);
+  return c == '1';
+}
+#endif
+
+int CLASS input_can_map (int fd)
+{
+  struct statfs sf;
+#ifdef __APPLE__
+  unsigned i, n;
+  int ok;
+
+  if (fstatfs (fd, &sf) || !(sf.f_flags & MNT_LOCAL)) return 0;
+  pthread_mutex_lock (&map_lock);
+  n = MIN (map_next, MAP_VOLUMES);
+  for (i=0; i < n; i++)
+    if (!memcmp (&map_volumes[i].fsid, &sf.f_fsid, sizeof sf.f_fsid) &&
+	!strcmp (map_volumes[i].from, sf.f_mntfromname)) break;
+  ok = i < n ? map_volumes[i].ok : -1;
+  pthread_mutex_unlock (&map_lock);
+  if (ok >= 0) return ok;
+  ok = volume_is_fixed (sf.f_mntonname);
+  pthread_mutex_lock (&map_lock);
+  i = map_next++ % MAP_VOLUMES;
+  map_volumes[i].fsid = sf.f_fsid;
+  strcpy (map_volumes[i].from, sf.f_mntfromname);
+  map_volumes[i].ok = ok;
+  pthread_mutex_unlock (&map_lock);
+  return ok;
+#else
+  struct stat st;
+  char link[64], dir[PATH_MAX];
+
+  if (fstatfs (fd, &sf) || fstat (fd, &st)) return 0;
+  switch ((unsigned) sf.f_type) {
+    case 0x6969:			/* NFS */
+    case 0x517b:			/* SMB */
+    case 0xff534d42:			/* CIFS */
+    case 0xfe534d42:			/* SMB2 */
+    case 0x65735546:			/* FUSE */
+      return 0;
+  }
+  /* a block device flagged removable (it or the disk it's part of), or on USB */
+  snprintf (link, sizeof link, "/sys/dev/block/%u:%u", major (st.st_dev), minor (st.st_dev));
+  if (!realpath (link, dir)) return 1;	/* tmpfs, or no sysfs */
+  if (strstr (dir, "/usb") || sysfs_flag (dir, "removable") ||
+	sysfs_flag (dir, "../removable")) return 0;
+  return 1;
+#endif
+}
+
+uchar * CLASS input_block (struct input *in, off_t offset, unsigned *length)
+{
+  int i, lru=0;
+  ssize_t got;
+
+  for (i=0; i < INPUT_SLOTS; i++) {
+    if (in->slot[i].offset == offset) {
+      in->slot[i].used = ++in->clock;
+      *length = in->slot[i].length;
+      return in->slot[i].data;
+    }
+    if (in->slot[i].used < in->slot[lru].used) lru = i;
+  }
+  if (offset == in->next) {		/* reading straight on, so ask for more */
+#ifdef __APPLE__
+    struct radvisory ra = { offset + INPUT_BLOCK, 4*INPUT_BLOCK };
+    fcntl (in->fd, F_RDADVISE, &ra);
+#else
+    posix_fadvise (in->fd, offset + INPUT_BLOCK, 4*INPUT_BLOCK, POSIX_FADV_WILLNEED);
+#endif
+  }
+  in->next = offset + INPUT_BLOCK;
+  if (!in->slot[lru].data &&
+      !(in->slot[lru].data = (uchar *) malloc (INPUT_BLOCK))) return 0;
+  in->slot[lru].offset = -1;
+  if ((got = pread (in->fd, in->slot[lru].data, INPUT_BLOCK, offset)) < 0) return 0;
+  in->stats.reads++;
+  in->stats.read_bytes += got;
+  in->slot[lru].offset = offset;
+  in->slot[lru].length = *length = got;
+  in->slot[lru].used = ++in->clock;
+  return in->slot[lru].data;
+}
+
+ssize_t CLASS input_read (void *cookie, char *buf, size_t size)
+{
+  struct input *in = (struct input *) cookie;
+  size_t done=0, len;
+  unsigned length, skip;
+  off_t base;
+  uchar *data;
+
+  if (in->pos >= in->size) return 0;
+  if (size > (UINT64) (in->size - in->pos)) size = in->size - in->pos;
+  if (in->map) {
+    memcpy (buf, in->map + in->pos, done = size);
+  } else while (done < size) {
+    base = (in->pos + done) / INPUT_BLOCK * INPUT_BLOCK;
+    if (!(data = input_block (in, base, &length))) {
+      if (!done) return -1;
+      break;
+    }
+    if ((skip = in->pos + done - base) >= length) break;
+    len = MIN (length - skip, size - done);
+    memcpy (buf + done, data + skip, len);
+    done += len;
+  }
+  in->pos += done;
+  in->stats.bytes += done;
+  return done;
+}
+
+off_t CLASS input_seek (void *cookie, off_t offset, int whence)
+{
+  struct input *in = (struct input *) cookie;
+
+  if (whence == SEEK_CUR) offset += in->pos;
+  if (whence == SEEK_END) offset += in->size;
+  if (offset < 0) return -1;
+  if (offset != in->pos) in->stats.seeks++;
+  return in->pos = offset;
+}
+
+int CLASS input_close (void *cookie)
+{
+  struct input *in = (struct input *) cookie;
+  int i;
+
+  if (in->out) *in->out = in->stats;
+  if (in->map) munmap (in->map, in->size);
+  for (i=0; i < INPUT_SLOTS; i++)
+    free (in->slot[i].data);
+  close (in->fd);
+  free (in);
+  return 0;
+}
+
+#ifdef __APPLE__
+int CLASS input_read_fn (void *cookie, char *buf, int size)
+{
+  return input_read (cookie, buf, size);
+}
+
+fpos_t CLASS input_seek_fn (void *cookie, fpos_t offset, int whence)
+{
+  return input_seek (cookie, offset, whence);
+}
+#elif defined(__GLIBC__)
+int CLASS input_seek_fn (void *cookie, off64_t *offset, int whence)
+{
+  off_t pos = input_seek (cookie, *offset, whence);
+
+  if (pos < 0) return -1;
+  *offset = pos;
+  return 0;
+}
+#endif
+
+/* stats, if given, receives the file's dcraw_io_stats when it is closed */
+FILE * CLASS open_input (const char *name, struct dcraw_io_stats *stats)
+{
+  struct input *in;
+  struct stat st;
+  FILE *fp=0;
+  int fd, i;
+
+  if (stats) memset (stats, 0, sizeof *stats);
+  if ((fd = open (name, O_RDONLY)) < 0) return 0;
+  if (fstat (fd, &st) || !(in = (struct input *) calloc (1, sizeof *in))) {
+    close (fd);
+    return 0;
+  }
+  in->fd = fd;
+  in->size = st.st_size;
+  in->next = -1;
+  in->out = stats;
+  for (i=0; i < INPUT_SLOTS; i++)
+    in->slot[i].offset = -1;
+  if (in->size > 0 && input_can_map (fd)) {
+    in->map = (uchar *) mmap (0, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (in->map == MAP_FAILED) in->map = 0;
+    in->stats.mapped = !!in->map;
+  }
+#ifdef __APPLE__
+  fp = funopen (in, input_read_fn, 0, input_seek_fn, input_close);
+#elif defined(__GLIBC__)
+  cookie_io_functions_t io = { input_read, 0, input_seek_fn, input_close };
+  fp = fopencookie (in, "rb", io);
+#endif
+  if (fp) return fp;
+  input_close (in);
+  return fopen (name, "rb");
+}
+
+/*
+   Loaders run their jobs as "lanes": each lane reads the file through
+   its own FILE and bit buffer and catches its own errors.  The calling
+   thread may run a lane itself, so its file and jmp_buf are put back
+   afterwards.  run_raw_lanes() returns nonzero if any lane failed.
+ */
+struct raw_lanes {
+  void (CLASS *run)(void *arg, int lane);
+  void *arg;
+  unsigned *errors;
+};
+
+void CLASS raw_lane (void *arg, int lane)
+{
+  struct raw_lanes *rl = (struct raw_lanes *) arg;
+  FILE *sfp = ifp;
+  unsigned serr = data_error;
+  jmp_buf sfail;
+
+  memcpy (sfail, failure, sizeof failure);
+  data_error = 0;
+  if ((ifp = open_input (ifname, 0))) {
+    if (setjmp (failure)) data_error = UINT_MAX;
+    else (*rl->run)(rl->arg, lane);
+    fclose (ifp);
+  } else data_error = UINT_MAX;
+  rl->errors[lane] = data_error;
+  ifp = sfp;
+  data_error = serr;
+  memcpy (failure, sfail, sizeof failure);
+}
+
+int CLASS run_raw_lanes (int nlanes, void (CLASS *run)(void *arg, int lane), void *arg)
+{
+  struct raw_lanes rl;
+  int i, failed=0;
+
+  rl.run = run;
+  rl.arg = arg;
+  rl.errors = (unsigned *) calloc (nlanes, sizeof *rl.errors);
+  merror (rl.errors, "run_raw_lanes()");
+  run_jobs (nlanes, raw_lane, &rl);
+  for (i=0; i < nlanes; i++)
+    if (rl.errors[i] == UINT_MAX) failed = 1;
+    else data_error += rl.errors[i];
+  free (rl.errors);
+  return failed;
+}
+
 struct jhead {
   int algo, bits, high, wide, clrs, sraw, psv, restart, vpred[6];
   ushort quant[64], idct[64], *huff[20], *free[20], *row;
@@ -847,6 +1502,7 @@ int CLASS ljpeg_diff (ushort *huff)
   if (!huff)
 	longjmp(failure, 2);
 
+  if (huff_lut_diff (huff, &diff)) return diff;
   len = gethuff(huff);
   if (len == 16 && (!dng_version || dng_version >= 0x1010000))
     return -32768;
@@ -895,19 +1551,16 @@ ushort * CLASS ljpeg_row (int jrow, struct jhead *jh)
   return row[2];
 }
 
-void CLASS lossless_jpeg_load_raw()
+void CLASS lossless_jpeg_rows (struct jhead *jh, int jrow, int jend)
 {
-  int jwide, jrow, jcol, val, jidx, i, j, row=0, col=0;
-  struct jhead jh;
+  int jwide, jcol, val, jidx, i, j, row, col;
   ushort *rp;
 
-  if (!ljpeg_start (&jh, 0)) return;
-  if (jh.wide<1 || jh.high<1 || jh.clrs<1 || jh.bits<1)
-	longjmp(failure, 2);
-  jwide = jh.wide * jh.clrs;
-
-  for (jrow=0; jrow < jh.high; jrow++) {
-    rp = ljpeg_row (jrow, &jh);
+  jwide = jh->wide * jh->clrs;
+  row = (INT64) jrow * jwide / raw_width;
+  col = (INT64) jrow * jwide % raw_width;
+  for ( ; jrow < jend; jrow++) {
+    rp = ljpeg_row (jrow, jh);
     if (load_flags & 1)
       row = jrow & 1 ? height-1-jrow/2 : jrow/2;
     for (jcol=0; jcol < jwide; jcol++) {
@@ -930,6 +1583,78 @@ void CLASS lossless_jpeg_load_raw()
         col = (row++,0);
     }
   }
+}
+
+/*
+   When every restart interval starts a new row and only the left
+   neighbour is used for prediction, the intervals decode on their
+   own.  Find the RSTn markers up front and give each lane a share.
+ */
+struct ljpeg_lanes {
+  struct jhead *jh;
+  off_t *start;
+  int nseg, rows, nlanes;
+  ushort *row;
+};
+
+void CLASS lossless_jpeg_lane (void *arg, int lane)
+{
+  struct ljpeg_lanes *ll = (struct ljpeg_lanes *) arg;
+  struct jhead jh = *ll->jh;
+  int seg;
+
+  jh.row = ll->row + (size_t) lane * jh.wide * jh.clrs * 2;
+  for (seg=lane; seg < ll->nseg; seg += ll->nlanes) {
+    fseeko (ifp, ll->start[seg], SEEK_SET);
+    lossless_jpeg_rows (&jh, seg * ll->rows, MIN((seg+1) * ll->rows, jh.high));
+  }
+}
+
+int CLASS lossless_jpeg_restarts (struct jhead *jh)
+{
+  struct ljpeg_lanes ll;
+  uchar buf[0x4000];
+  off_t pos;
+  int n, len, i, prev=0;
+
+  if (max_workers < 2 || jh->restart < 1 || jh->restart == INT_MAX ||
+	jh->psv != 1 || jh->restart % jh->wide ||
+	(raw_width == 3984 && !cr2_slice[0])) return 0;
+  ll.jh = jh;
+  ll.rows = jh->restart / jh->wide;
+  ll.nseg = (jh->high + ll.rows - 1) / ll.rows;
+  if (ll.nseg < 2) return 0;
+  ll.start = (off_t *) calloc (ll.nseg, sizeof *ll.start);
+  merror (ll.start, "lossless_jpeg_restarts()");
+  pos = ll.start[0] = ftello(ifp);
+  for (n=1; n < ll.nseg && (len = fread (buf, 1, sizeof buf, ifp)) > 0; pos += len)
+    for (i=0; i < len && n < ll.nseg; prev = buf[i++])
+      if (prev == 0xff && (buf[i] & 0xf8) == 0xd0)
+	ll.start[n++] = pos + i + 1;
+  fseeko (ifp, ll.start[0], SEEK_SET);
+  if (n < ll.nseg) {
+    free (ll.start);
+    return 0;
+  }
+  ll.nlanes = MIN(ll.nseg, max_workers);
+  ll.row = (ushort *) calloc ((size_t) ll.nlanes * jh->wide * jh->clrs, 4);
+  merror (ll.row, "lossless_jpeg_restarts()");
+  n = run_raw_lanes (ll.nlanes, lossless_jpeg_lane, &ll);
+  free (ll.row);
+  free (ll.start);
+  if (n) longjmp (failure, 1);
+  return 1;
+}
+
+void CLASS lossless_jpeg_load_raw()
+{
+  struct jhead jh;
+
+  if (!ljpeg_start (&jh, 0)) return;
+  if (jh.wide<1 || jh.high<1 || jh.clrs<1 || jh.bits<1)
+	longjmp(failure, 2);
+  if (!lossless_jpeg_restarts (&jh))
+    lossless_jpeg_rows (&jh, 0, jh.high);
   ljpeg_end (&jh);
 }
 
@@ -1027,7 +1752,7 @@ void CLASS ljpeg_idct (struct jhead *jh)
 {
   int c, i, j, len, skip, coef;
   float work[3][8][8];
-  static float cs[106] = { 0 };
+  static thread_local float cs[106] = { 0 };
   static const uchar zigzag[80] =
   {  0, 1, 8,16, 9, 2, 3,10,17,24,32,25,18,11, 4, 5,12,19,26,33,
     40,48,41,34,27,20,13, 6, 7,14,21,28,35,42,49,56,57,50,43,36,
@@ -1059,50 +1784,100 @@ void CLASS ljpeg_idct (struct jhead *jh)
   FORC(64) jh->idct[c] = CLIP(((float *)work[2])[c]+0.5);
 }
 
-void CLASS lossless_dng_load_raw()
+int CLASS lossless_dng_tile (unsigned trow, unsigned tcol)
 {
-  unsigned save, trow=0, tcol=0, jwide, jrow, jcol, row, col, i, j;
+  unsigned jwide, jrow, jcol, row, col, i, j;
   struct jhead jh;
   ushort *rp;
 
+  if (!ljpeg_start (&jh, 0)) return 0;
+  jwide = jh.wide;
+  if (filters) jwide *= jh.clrs;
+  jwide /= MIN (is_raw, tiff_samples);
+  switch (jh.algo) {
+    case 0xc1:
+      jh.vpred[0] = 16384;
+      getbits(-1);
+      for (jrow=0; jrow+7 < jh.high; jrow += 8) {
+        for (jcol=0; jcol+7 < jh.wide; jcol += 8) {
+          ljpeg_idct (&jh);
+          rp = jh.idct;
+          row = trow + jcol/tile_width + jrow*2;
+          col = tcol + jcol%tile_width;
+          for (i=0; i < 16; i+=2)
+            for (j=0; j < 8; j++)
+              adobe_copy_pixel (row+i, col+j, &rp);
+        }
+      }
+      break;
+    case 0xc3:
+      for (row=col=jrow=0; jrow < jh.high; jrow++) {
+        rp = ljpeg_row (jrow, &jh);
+        for (jcol=0; jcol < jwide; jcol++) {
+          adobe_copy_pixel (trow+row, tcol+col, &rp);
+          if (++col >= tile_width || col >= raw_width)
+            row += 1 + (col = 0);
+        }
+      }
+  }
+  ljpeg_end (&jh);
+  return 1;
+}
+
+/*
+   Tiles are independent, so read the offset table first and let
+   each lane take every nlanes-th tile.
+ */
+struct dng_lanes {
+  unsigned *offset;
+  int ntiles, ncols, nlanes;
+};
+
+void CLASS lossless_dng_lane (void *arg, int lane)
+{
+  struct dng_lanes *dl = (struct dng_lanes *) arg;
+  int tile;
+
+  for (tile=lane; tile < dl->ntiles; tile += dl->nlanes) {
+    fseek (ifp, dl->offset[tile], SEEK_SET);
+    lossless_dng_tile (tile / dl->ncols * tile_length,
+		       tile % dl->ncols * tile_width);
+  }
+}
+
+int CLASS lossless_dng_tiles()
+{
+  struct dng_lanes dl;
+  int i;
+
+  if (max_workers < 2 || tile_length == INT_MAX || tile_width < 1) return 0;
+  dl.ncols = (raw_width + tile_width - 1) / tile_width;
+  dl.ntiles = (raw_height + tile_length - 1) / tile_length * dl.ncols;
+  if (dl.ntiles < 2) return 0;
+  dl.offset = (unsigned *) calloc (dl.ntiles, sizeof *dl.offset);
+  merror (dl.offset, "lossless_dng_tiles()");
+  for (i=0; i < dl.ntiles; i++)
+    dl.offset[i] = get4();
+  dl.nlanes = MIN(dl.ntiles, max_workers);
+  i = run_raw_lanes (dl.nlanes, lossless_dng_lane, &dl);
+  free (dl.offset);
+  if (i) longjmp (failure, 1);
+  return 1;
+}
+
+void CLASS lossless_dng_load_raw()
+{
+  unsigned save, trow=0, tcol=0;
+
+  if (lossless_dng_tiles()) return;
   while (trow < raw_height) {
     save = ftell(ifp);
     if (tile_length < INT_MAX)
       fseek (ifp, get4(), SEEK_SET);
-    if (!ljpeg_start (&jh, 0)) break;
-    jwide = jh.wide;
-    if (filters) jwide *= jh.clrs;
-    jwide /= MIN (is_raw, tiff_samples);
-    switch (jh.algo) {
-      case 0xc1:
-        jh.vpred[0] = 16384;
-        getbits(-1);
-        for (jrow=0; jrow+7 < jh.high; jrow += 8) {
-          for (jcol=0; jcol+7 < jh.wide; jcol += 8) {
-            ljpeg_idct (&jh);
-            rp = jh.idct;
-            row = trow + jcol/tile_width + jrow*2;
-            col = tcol + jcol%tile_width;
-            for (i=0; i < 16; i+=2)
-              for (j=0; j < 8; j++)
-                adobe_copy_pixel (row+i, col+j, &rp);
-          }
-        }
-        break;
-      case 0xc3:
-        for (row=col=jrow=0; jrow < jh.high; jrow++) {
-          rp = ljpeg_row (jrow, &jh);
-          for (jcol=0; jcol < jwide; jcol++) {
-            adobe_copy_pixel (trow+row, tcol+col, &rp);
-            if (++col >= tile_width || col >= raw_width)
-              row += 1 + (col = 0);
-          }
-        }
-    }
+    if (!lossless_dng_tile (trow, tcol)) break;
     fseek (ifp, save+4, SEEK_SET);
     if ((tcol += tile_width) >= raw_width)
       trow += tile_length + (tcol = 0);
-    ljpeg_end (&jh);
   }
 }
 
@@ -1204,12 +1979,14 @@ void CLASS nikon_load_raw()
       max += (min = 16) << 1;
     }
     for (col=0; col < raw_width; col++) {
-      i = gethuff(huff);
-      len = i & 15;
-      shl = i >> 4;
-      diff = ((getbits(len-shl) << 1) + 1) << shl >> 1;
-      if ((diff & (1 << (len-1))) == 0)
-        diff -= (1 << len) - !shl;
+      if (!huff_lut_diff (huff, &diff)) {
+        i = gethuff(huff);
+        len = i & 15;
+        shl = i >> 4;
+        diff = ((getbits(len-shl) << 1) + 1) << shl >> 1;
+        if ((diff & (1 << (len-1))) == 0)
+          diff -= (1 << len) - !shl;
+      }
       if (col < 2) hpred[col] = vpred[row & 1][col] += diff;
       else           hpred[col & 1] += diff;
       if ((ushort)(hpred[col & 1] + min) >= max) derror();
@@ -1678,8 +2455,8 @@ void CLASS phase_one_load_raw()
 
 unsigned CLASS ph1_bithuff (int nbits, ushort *huff)
 {
-  static UINT64 bitbuf=0;
-  static int vbits=0;
+  static thread_local UINT64 bitbuf=0;
+  static thread_local int vbits=0;
   unsigned c;
 
   if (nbits == -1)
@@ -1698,7 +2475,7 @@ unsigned CLASS ph1_bithuff (int nbits, ushort *huff)
   return c;
 }
 #define ph1_bits(n) ph1_bithuff(n,0)
-#define ph1_huff(h) ph1_bithuff(*h,h+1)
+#define ph1_huff(h) ph1_bithuff(*h & 0xff,h+1)
 
 void CLASS phase_one_load_raw_c()
 {
@@ -1892,30 +2669,183 @@ void CLASS imacon_full_load_raw()
       read_shorts (image[row*width+col], 3);
 }
 
-void CLASS packed_load_raw()
+/*
+   packed_load_raw() rows that start on a byte boundary are read whole
+   and unpacked from memory.  Chunks wider than a byte are stored
+   little-endian, so their bytes are reversed first.  What is left is a
+   big-endian bit stream, and eight pixels of up to 16 bits always fit
+   in one 16-byte vector.
+ */
+static int unpack_simd = 0;        /* set by dcraw_init() */
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+int CLASS unpack_bits_simd (const uchar *bp, ushort *pix, int n, int bps)
+{
+  char hi[16], lo[16];
+  ushort lmul[8], rmul[8];
+  __m128i mhi, mlo, ml, mr, v, x, y;
+  int i, c, s, b;
+
+  for (c=0; c < 8; c++) {
+    s = bps * c;
+    b = s >> 3;
+    hi[c*2] = b+1;
+    hi[c*2+1] = b;
+    lo[c*2] = s & 7 ? b+2 : -128;
+    lo[c*2+1] = -128;
+    lmul[c] = 1 << (s & 7);
+    rmul[c] = 1 << ((s & 7) + 8);
+  }
+  mhi = _mm_loadu_si128 ((__m128i *) hi);
+  mlo = _mm_loadu_si128 ((__m128i *) lo);
+  ml = _mm_loadu_si128 ((__m128i *) lmul);
+  mr = _mm_loadu_si128 ((__m128i *) rmul);
+  for (i=0; i+8 <= n; i+=8, bp += bps) {
+    v = _mm_loadu_si128 ((__m128i *) bp);
+    x = _mm_mullo_epi16 (_mm_shuffle_epi8 (v, mhi), ml);
+    y = _mm_mulhi_epu16 (_mm_shuffle_epi8 (v, mlo), mr);
+    _mm_storeu_si128 ((__m128i *) (pix+i),
+	_mm_srl_epi16 (_mm_or_si128 (x, y), _mm_cvtsi32_si128 (16-bps)));
+  }
+  return i;
+}
+#elif defined(__aarch64__)
+int CLASS unpack_bits_simd (const uchar *bp, ushort *pix, int n, int bps)
+{
+  uchar hi[16], lo[16];
+  short lsh[8], rsh[8];
+  uint8x16_t mhi, mlo, v;
+  int16x8_t ls, rs, fs;
+  uint16x8_t x, y;
+  int i, c, s, b;
+
+  for (c=0; c < 8; c++) {
+    s = bps * c;
+    b = s >> 3;
+    hi[c*2] = b+1;
+    hi[c*2+1] = b;
+    lo[c*2] = s & 7 ? b+2 : 0xff;
+    lo[c*2+1] = 0xff;
+    lsh[c] = s & 7;
+    rsh[c] = (s & 7) - 8;
+  }
+  mhi = vld1q_u8 (hi);
+  mlo = vld1q_u8 (lo);
+  ls = vld1q_s16 (lsh);
+  rs = vld1q_s16 (rsh);
+  fs = vdupq_n_s16 (bps-16);
+  for (i=0; i+8 <= n; i+=8, bp += bps) {
+    v = vld1q_u8 (bp);
+    x = vshlq_u16 (vreinterpretq_u16_u8 (vqtbl1q_u8 (v, mhi)), ls);
+    y = vshlq_u16 (vreinterpretq_u16_u8 (vqtbl1q_u8 (v, mlo)), rs);
+    vst1q_u16 (pix+i, vshlq_u16 (vorrq_u16 (x, y), fs));
+  }
+  return i;
+}
+#else
+int CLASS unpack_bits_simd (const uchar *bp, ushort *pix, int n, int bps)
 {
-  int vbits=0, bwide, rbits, bite, half, irow, row, col, val, i;
-  UINT64 bitbuf=0;
+  return 0;
+}
+#endif
 
-  bwide = raw_width * tiff_bps / 8;
-  bwide += bwide & load_flags >> 9;
-  rbits = bwide * 8 - raw_width * tiff_bps;
-  if (load_flags & 1) bwide = bwide * 16 / 15;
-  bite = 8 + (load_flags & 56);
-  half = (raw_height+1) >> 1;
-  for (irow=0; irow < raw_height; irow++) {
-    row = irow;
-    if (load_flags & 2 &&
-        (row = irow % half * 2 + irow / half) == 1 &&
-        load_flags & 4) {
-      if (vbits=0, tiff_compress)
-        fseek (ifp, data_offset - (-half*bwide & -2048), SEEK_SET);
-      else {
-        fseek (ifp, 0, SEEK_END);
-        fseek (ifp, ftell(ifp) >> 3 << 2, SEEK_SET);
-      }
+/* Needs 16 readable bytes past the last pixel. */
+void CLASS unpack_bits (const uchar *bp, ushort *pix, int n, int bps)
+{
+  UINT64 w;
+  unsigned bit;
+  int i=0, c;
+
+  if (unpack_simd)
+    i = unpack_bits_simd (bp, pix, n, bps);
+  if (!(bps & 1))
+    for ( ; i+4 <= n; i+=4) {
+      bit = i * bps;
+      for (w=c=0; c < 8; c++)
+	w = w << 8 | bp[(bit >> 3) + c];
+      FORC4 pix[i+c] = w >> (64 - bps*(c+1)) & ((1 << bps) - 1);
     }
-    for (col=0; col < raw_width; col++) {
+  for ( ; i < n; i++) {
+    bit = i * bps;
+    w = bp[bit >> 3] << 16 | bp[(bit >> 3) + 1] << 8 | bp[(bit >> 3) + 2];
+    pix[i] = w >> (24 - bps - (bit & 7)) & ((1 << bps) - 1);
+  }
+}
+
+/*
+   A row cut short by the end of the file goes through the bit loop, as
+   every EOF from fgetc() there set all the bits not yet used to one.
+ */
+void CLASS packed_row_eof (const uchar *data, int got, int bite, int row)
+{
+  UINT64 bitbuf=0;
+  int vbits=0, col, i, pos=0;
+
+  for (col=0; col < raw_width; col++) {
+    for (vbits -= tiff_bps; vbits < 0; vbits += bite) {
+      bitbuf <<= bite;
+      for (i=0; i < bite; i+=8, pos++)
+        bitbuf |= (pos < got ? (UINT64) data[pos] : ~0ULL) << i;
+    }
+    RAW(row,col ^ (load_flags >> 6 & 3)) = bitbuf << (64-tiff_bps-vbits) >> (64-tiff_bps);
+  }
+}
+
+void CLASS packed_row (uchar *data, int bwide, int bite, int row)
+{
+  int got, col, i, c, x = load_flags >> 6 & 3;
+  ushort *pix = &RAW(row,0);
+
+  if ((got = fread (data, 1, bwide, ifp)) < bwide) {
+    packed_row_eof (data, got, bite, row);
+    return;
+  }
+  if (bite > 8)
+    for (i=0; i < bwide; i += bite >> 3)
+      for (c=0; c < bite >> 4; c++)
+	SWAP (data[i+c], data[i+(bite >> 3)-1-c]);
+  if (x) pix = (ushort *) (data + ((bwide + 17) & -2));
+  unpack_bits (data, pix, raw_width, tiff_bps);
+  if (x)
+    for (col=0; col < raw_width; col++)
+      RAW(row,col ^ x) = pix[col];
+}
+
+void CLASS packed_load_raw()
+{
+  int vbits=0, bwide, rbits, bite, half, irow, row, col, val, i;
+  UINT64 bitbuf=0;
+  uchar *data=0;
+
+  bwide = raw_width * tiff_bps / 8;
+  bwide += bwide & load_flags >> 9;
+  rbits = bwide * 8 - raw_width * tiff_bps;
+  if (load_flags & 1) bwide = bwide * 16 / 15;
+  bite = 8 + (load_flags & 56);
+  half = (raw_height+1) >> 1;
+  if (!(load_flags & 1) && rbits >= 0 && tiff_bps <= 16 && bite <= 32 &&
+	bwide % (bite >> 3) == 0) {
+    data = (uchar *) malloc (bwide + 18 + raw_width*2);
+    merror (data, "packed_load_raw()");
+  }
+  for (irow=0; irow < raw_height; irow++) {
+    row = irow;
+    if (load_flags & 2 &&
+        (row = irow % half * 2 + irow / half) == 1 &&
+        load_flags & 4) {
+      if (vbits=0, tiff_compress)
+        fseek (ifp, data_offset - (-half*bwide & -2048), SEEK_SET);
+      else {
+        fseek (ifp, 0, SEEK_END);
+        fseek (ifp, ftell(ifp) >> 3 << 2, SEEK_SET);
+      }
+    }
+    if (data) {
+      packed_row (data, bwide, bite, row);
+      continue;
+    }
+    for (col=0; col < raw_width; col++) {
       for (vbits -= tiff_bps; vbits < 0; vbits += bite) {
         bitbuf <<= bite;
         for (i=0; i < bite; i+=8)
@@ -1928,6 +2858,7 @@ void CLASS packed_load_raw()
     }
     vbits -= rbits;
   }
+  free (data);
 }
 
 void CLASS nokia_load_raw()
@@ -1979,8 +2910,8 @@ void CLASS canon_rmf_load_raw()
 
 unsigned CLASS pana_bits (int nbits)
 {
-  static uchar buf[0x4000];
-  static int vbits;
+  static thread_local uchar buf[0x4000];
+  static thread_local int vbits;
   int byte;
 
   if (!nbits) return vbits=0;
@@ -2274,14 +3205,29 @@ void CLASS kodak_jpeg_load_raw() {}
 void CLASS lossy_dng_load_raw() {}
 #else
 
+/* libjpeg's own handler exits the process */
+METHODDEF(void)
+jpeg_error_exit (j_common_ptr cinfo)
+{
+  char msg[JMSG_LENGTH_MAX];
+
+  (*cinfo->err->format_message) (cinfo, msg);
+  fprintf (stderr, "%s: %s\n", ifname, msg);
+  jpeg_destroy (cinfo);
+  longjmp (failure, 3);
+}
+
 METHODDEF(boolean)
 fill_input_buffer (j_decompress_ptr cinfo)
 {
-  static uchar jpeg_buffer[4096];
+  static thread_local uchar jpeg_buffer[4096];
   size_t nbytes;
 
-  nbytes = fread (jpeg_buffer, 1, 4096, ifp);
-  swab (jpeg_buffer, jpeg_buffer, nbytes);
+  if (!(nbytes = fread (jpeg_buffer, 1, 4096, ifp))) {
+    jpeg_buffer[0] = 0xff;                /* truncated: end the image */
+    jpeg_buffer[1] = JPEG_EOI;
+    nbytes = 2;
+  } else swab (jpeg_buffer, jpeg_buffer, nbytes);
   cinfo->src->next_input_byte = jpeg_buffer;
   cinfo->src->bytes_in_buffer = nbytes;
   return TRUE;
@@ -2296,6 +3242,7 @@ void CLASS kodak_jpeg_load_raw()
   int row, col;
 
   cinfo.err = jpeg_std_error (&jerr);
+  jerr.error_exit = jpeg_error_exit;
   jpeg_create_decompress (&cinfo);
   jpeg_stdio_src (&cinfo, ifp);
   cinfo.src->fill_input_buffer = fill_input_buffer;
@@ -2366,6 +3313,7 @@ void CLASS lossy_dng_load_raw()
     FORC3 memcpy (cur[c], curve, sizeof cur[0]);
   }
   cinfo.err = jpeg_std_error (&jerr);
+  jerr.error_exit = jpeg_error_exit;
   jpeg_create_decompress (&cinfo);
   while (trow < raw_height) {
     fseek (ifp, save+=4, SEEK_SET);
@@ -2373,15 +3321,16 @@ void CLASS lossy_dng_load_raw()
       fseek (ifp, get4(), SEEK_SET);
     jpeg_stdio_src (&cinfo, ifp);
     jpeg_read_header (&cinfo, TRUE);
+    cinfo.scale_denom = 1 << shrink;        /* let the IDCT do the shrinking */
     jpeg_start_decompress (&cinfo);
     buf = (*cinfo.mem->alloc_sarray)
         ((j_common_ptr) &cinfo, JPOOL_IMAGE, cinfo.output_width*3, 1);
     while (cinfo.output_scanline < cinfo.output_height &&
-        (row = trow + cinfo.output_scanline) < height) {
+        (row = (trow >> shrink) + cinfo.output_scanline) < iheight) {
       jpeg_read_scanlines (&cinfo, buf, 1);
       pixel = (JSAMPLE (*)[3]) buf[0];
-      for (col=0; col < cinfo.output_width && tcol+col < width; col++) {
-        FORC3 image[row*width+tcol+col][c] = cur[c][pixel[col][c]];
+      for (col=0; col < cinfo.output_width && (tcol >> shrink)+col < iwidth; col++) {
+        FORC3 image[row*iwidth+(tcol >> shrink)+col][c] = cur[c][pixel[col][c]];
       }
     }
     jpeg_abort_decompress (&cinfo);
@@ -2633,7 +3582,7 @@ void CLASS kodak_thumb_load_raw()
 
 void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
 {
-  static unsigned pad[128], p;
+  static thread_local unsigned pad[128], p;
 
   if (start) {
     for (p=0; p < 4; p++)
@@ -2697,26 +3646,37 @@ void CLASS sony_arw_load_raw()
 void CLASS sony_arw2_load_raw()
 {
   uchar *data, *dp;
-  ushort pix[16];
-  int row, col, val, max, min, imax, imin, sh, bit, i;
+  ushort pix[16], delta[15];
+  int row, col, max, min, imax, imin, sh, i, j;
+  UINT64 lo, hi;
 
-  data = (uchar *) malloc (raw_width+1);
+  data = (uchar *) calloc (raw_width+1, 1);   /* delta[14] reads the spare byte */
   merror (data, "sony_arw2_load_raw()");
   for (row=0; row < height; row++) {
     fread (data, 1, raw_width, ifp);
     for (dp=data, col=0; col < raw_width-30; dp+=16) {
-      max = 0x7ff & (val = sget4(dp));
-      min = 0x7ff & val >> 11;
-      imax = 0x0f & val >> 22;
-      imin = 0x0f & val >> 26;
+      /* each block is a 128-bit little-endian word */
+      for (lo=hi=0, i=8; i--; ) {
+        lo = lo << 8 | dp[i];
+        hi = hi << 8 | dp[i+8];
+      }
+      max = 0x7ff & lo;
+      min = 0x7ff & lo >> 11;
+      imax = 0x0f & lo >> 22;
+      imin = 0x0f & lo >> 26;
       for (sh=0; sh < 4 && 0x80 << sh <= max-min; sh++);
-      for (bit=30, i=0; i < 16; i++)
+      for (i=0; i < 4; i++)
+        delta[i] = lo >> (30 + i*7) & 0x7f;
+      delta[4] = (lo >> 58 | hi << 6) & 0x7f;
+      for (i=5; i < 14; i++)
+        delta[i] = hi >> (i*7 - 34) & 0x7f;
+      delta[14] = dp[16] & 0x7f;        /* only used if imax == imin */
+      for (j=i=0; i < 16; i++)
         if      (i == imax) pix[i] = max;
         else if (i == imin) pix[i] = min;
         else {
-          pix[i] = ((sget2(dp+(bit >> 3)) >> (bit & 7) & 0x7f) << sh) + min;
+          pix[i] = (delta[j++] << sh) + min;
           if (pix[i] > 0x7ff) pix[i] = 0x7ff;
-          bit += 7;
         }
       for (i=0; i < 16; i++, col+=2)
         RAW(row,col) = curve[pix[i] << 1] >> 2;
@@ -3023,7 +3983,7 @@ void CLASS redcine_load_raw()
 
 void CLASS foveon_decoder (unsigned size, unsigned code)
 {
-  static unsigned huff[1024];
+  static thread_local unsigned huff[1024];
   struct decode *cur;
   int i, len;
 
@@ -3180,8 +4140,8 @@ void CLASS foveon_load_camf()
       meta_data[i] ^= ((((high << 8) - wide) >> 1) + wide) >> 17;
     }
   } else if (type == 4) {
-    free (meta_data);
-    meta_data = (char *) malloc (meta_length = wide*high*3/2);
+    arena_free (meta_data);
+    meta_data = (char *) arena_calloc (ARENA_META, meta_length = wide*high*3/2, 1);
     merror (meta_data, "foveon_load_camf()");
     foveon_huff (huff);
     get4();
@@ -3723,6 +4683,31 @@ void CLASS foveon_interpolate()
 
 /* RESTRICTED code ends here */
 
+/*
+   Average each (1 << shrink)-pixel square of the CFA into one
+   four-color pixel, for thumbnails that are never demosaiced.
+ */
+void CLASS bin_pixels()
+{
+  unsigned row, col, c, (*sum)[8];
+
+  sum = (unsigned (*)[8]) calloc (iwidth, sizeof *sum);
+  merror (sum, "bin_pixels()");
+  for (row=0; row < height; row++) {
+    for (col=0; col < width; col++) {
+      c = fcol(row,col);
+      sum[col >> shrink][c] += RAW(row+top_margin,col+left_margin);
+      sum[col >> shrink][c+4]++;
+    }
+    if (((row+1) & ((1 << shrink) - 1)) && row+1 < height) continue;
+    for (col=0; col < iwidth; col++)
+      FORC4 if (sum[col][c+4])
+        image[(row >> shrink)*iwidth+col][c] = sum[col][c] / sum[col][c+4];
+    memset (sum, 0, iwidth * sizeof *sum);
+  }
+  free (sum);
+}
+
 void CLASS crop_masked_pixels()
 {
   int row, col;
@@ -3731,7 +4716,8 @@ void CLASS crop_masked_pixels()
   if (load_raw == &CLASS phase_one_load_raw ||
       load_raw == &CLASS phase_one_load_raw_c)
     phase_one_correct();
-  if (fuji_width) {
+  if (!image) ;                /* render_strips() copies rows itself */
+  else if (fuji_width) {
     for (row=0; row < raw_height-top_margin*2; row++) {
       for (col=0; col < fuji_width << !fuji_layout; col++) {
         if (fuji_layout) {
@@ -3745,6 +4731,8 @@ void CLASS crop_masked_pixels()
           BAYER(r,c) = RAW(row+top_margin,col+left_margin);
       }
     }
+  } else if (shrink > 1) {
+    bin_pixels();
   } else {
     for (row=0; row < height; row++)
       for (col=0; col < width; col++)
@@ -4026,10 +5014,90 @@ void CLASS hat_transform (float *temp, float *base, int st, int size, int sc)
     temp[i] = 2*base[st*i] + base[st*(i-sc)] + base[st*(2*size-2-(i+sc))];
 }
 
+/* hat_transform() down nc adjacent columns at once, into temp[i*nc+k] */
+void CLASS hat_transform_cols (float *temp, float *base, int st, int size, int sc, int nc)
+{
+  int i, k;
+
+  for (i=0; i < sc; i++, temp += nc)
+    for (k=0; k < nc; k++)
+      temp[k] = 2*base[st*i+k] + base[st*(sc-i)+k] + base[st*(i+sc)+k];
+  for (; i+sc < size; i++, temp += nc)
+    for (k=0; k < nc; k++)
+      temp[k] = 2*base[st*i+k] + base[st*(i-sc)+k] + base[st*(i+sc)+k];
+  for (; i < size; i++, temp += nc)
+    for (k=0; k < nc; k++)
+      temp[k] = 2*base[st*i+k] + base[st*(i-sc)+k] + base[st*(2*size-2-(i+sc))+k];
+}
+
+/*
+   Each stage of a wavelet level is spread over lanes: the square-root
+   transform, the row pass, the column pass (a block of WBLOCK columns
+   at a time, so that it walks down rows rather than single columns),
+   the thresholding and the final write-back.  Every value is computed
+   from the same inputs in the same order as before.
+ */
+#define WBLOCK 16
+
+enum { WAVELET_IN, WAVELET_ROWS, WAVELET_COLS, WAVELET_THOLD, WAVELET_OUT };
+
+struct wavelet_args {
+  float *fimg, *temp, thold;
+  int stage, nlanes, ntemp, c, scale, hpass, lpass, sc;
+};
+
+void CLASS wavelet_lane (void *arg, int lane)
+{
+  struct wavelet_args *wa = (struct wavelet_args *) arg;
+  float *fimg = wa->fimg, *temp = wa->temp + lane*wa->ntemp;
+  int hpass = wa->hpass, lpass = wa->lpass;
+  int band, row, col, i, end, nc, c = wa->c;
+
+  if (wa->stage == WAVELET_COLS) {
+    for (col = lane*WBLOCK; col < iwidth; col += wa->nlanes*WBLOCK) {
+      nc = MIN(WBLOCK, iwidth-col);
+      hat_transform_cols (temp, fimg+lpass+col, iwidth, iheight, wa->sc, nc);
+      for (row=0; row < iheight; row++)
+        for (i=0; i < nc; i++)
+          fimg[lpass + row*iwidth + col+i] = temp[row*nc+i] * 0.25;
+    }
+    return;
+  }
+  for (band=lane; band*BAND < iheight; band += wa->nlanes) {
+    end = MIN((band+1)*BAND, iheight)*iwidth;
+    switch (wa->stage) {
+      case WAVELET_IN:
+        for (i = band*BAND*iwidth; i < end; i++)
+          fimg[i] = 256 * sqrt(image[i][c] << wa->scale);
+        break;
+      case WAVELET_ROWS:
+        for (row = band*BAND; row < (band+1)*BAND && row < iheight; row++) {
+          hat_transform (temp, fimg+hpass+row*iwidth, 1, iwidth, wa->sc);
+          for (col=0; col < iwidth; col++)
+            fimg[lpass + row*iwidth + col] = temp[col] * 0.25;
+        }
+        break;
+      case WAVELET_THOLD:
+        for (i = band*BAND*iwidth; i < end; i++) {
+          fimg[hpass+i] -= fimg[lpass+i];
+          if        (fimg[hpass+i] < -wa->thold) fimg[hpass+i] += wa->thold;
+          else if (fimg[hpass+i] >  wa->thold) fimg[hpass+i] -= wa->thold;
+          else         fimg[hpass+i] = 0;
+          if (hpass) fimg[i] += fimg[hpass+i];
+        }
+        break;
+      case WAVELET_OUT:
+        for (i = band*BAND*iwidth; i < end; i++)
+          image[i][c] = CLIP(SQR(fimg[i]+fimg[lpass+i])/0x10000);
+    }
+  }
+}
+
 void CLASS wavelet_denoise()
 {
-  float *fimg=0, *temp, thold, mul[2], avg, diff;
-  int scale=1, size, lev, hpass, lpass, row, col, nc, c, i, wlast, blk[2];
+  struct wavelet_args wa;
+  float *fimg=0, thold, mul[2], avg, diff;
+  int scale=1, size, lev, row, col, nc, c, i, wlast, blk[2];
   ushort *window[4];
   static const float noise[] =
   { 0.8002,0.2735,0.1202,0.0585,0.0291,0.0152,0.0080,0.0044 };
@@ -4040,38 +5108,33 @@ void CLASS wavelet_denoise()
   maximum <<= --scale;
   black <<= scale;
   FORC4 cblack[c] <<= scale;
+  wa.nlanes = MAX(1, MIN((iheight + BAND-1) / BAND, max_workers));
+  wa.ntemp = MAX(iwidth, iheight*WBLOCK);
   if ((size = iheight*iwidth) < 0x15550000)
-    fimg = (float *) malloc ((size*3 + iheight + iwidth) * sizeof *fimg);
+    fimg = (float *) malloc (((size_t) size*3 + (size_t) wa.nlanes*wa.ntemp) * sizeof *fimg);
   merror (fimg, "wavelet_denoise()");
-  temp = fimg + size*3;
+  wa.fimg = fimg;
+  wa.temp = fimg + size*3;
+  wa.scale = scale;
   if ((nc = colors) == 3 && filters) nc++;
   FORC(nc) {                        /* denoise R,G1,B,G3 individually */
-    for (i=0; i < size; i++)
-      fimg[i] = 256 * sqrt(image[i][c] << scale);
-    for (hpass=lev=0; lev < 5; lev++) {
-      lpass = size*((lev & 1)+1);
-      for (row=0; row < iheight; row++) {
-        hat_transform (temp, fimg+hpass+row*iwidth, 1, iwidth, 1 << lev);
-        for (col=0; col < iwidth; col++)
-          fimg[lpass + row*iwidth + col] = temp[col] * 0.25;
-      }
-      for (col=0; col < iwidth; col++) {
-        hat_transform (temp, fimg+lpass+col, iwidth, iheight, 1 << lev);
-        for (row=0; row < iheight; row++)
-          fimg[lpass + row*iwidth + col] = temp[row] * 0.25;
-      }
-      thold = threshold * noise[lev];
-      for (i=0; i < size; i++) {
-        fimg[hpass+i] -= fimg[lpass+i];
-        if        (fimg[hpass+i] < -thold) fimg[hpass+i] += thold;
-        else if (fimg[hpass+i] >  thold) fimg[hpass+i] -= thold;
-        else         fimg[hpass+i] = 0;
-        if (hpass) fimg[i] += fimg[hpass+i];
-      }
-      hpass = lpass;
-    }
-    for (i=0; i < size; i++)
-      image[i][c] = CLIP(SQR(fimg[i]+fimg[lpass+i])/0x10000);
+    wa.c = c;
+    wa.stage = WAVELET_IN;
+    run_jobs (wa.nlanes, wavelet_lane, &wa);
+    for (wa.hpass=lev=0; lev < 5; lev++) {
+      wa.lpass = size*((lev & 1)+1);
+      wa.sc = 1 << lev;
+      wa.stage = WAVELET_ROWS;
+      run_jobs (wa.nlanes, wavelet_lane, &wa);
+      wa.stage = WAVELET_COLS;
+      run_jobs (wa.nlanes, wavelet_lane, &wa);
+      wa.thold = threshold * noise[lev];
+      wa.stage = WAVELET_THOLD;
+      run_jobs (wa.nlanes, wavelet_lane, &wa);
+      wa.hpass = wa.lpass;
+    }
+    wa.stage = WAVELET_OUT;
+    run_jobs (wa.nlanes, wavelet_lane, &wa);
   }
   if (filters && colors == 3) {  /* pull G1 and G3 closer together */
     for (row=0; row < 2; row++) {
@@ -4104,13 +5167,37 @@ void CLASS wavelet_denoise()
   free (fimg);
 }
 
-void CLASS scale_colors()
+struct scale_args {
+  float *mul;
+  ushort *black;
+  int iheight, iwidth;
+};
+
+void CLASS scale_colors_band (void *arg, int band)
+{
+  struct scale_args *sa = (struct scale_args *) arg;
+  ushort *bl = sa->black, *pix;
+  int row, col, c, val, dark[4];
+
+  for (row=band*BAND; row < (band+1)*BAND && row < sa->iheight; row++) {
+    pix = image[row*sa->iwidth];
+    for (col=0; col < sa->iwidth; col++, pix+=4) {
+      FORC4 dark[c] = bl[c];
+      if (bl[4] && bl[5])
+        FORC4 dark[c] += bl[6 + row % bl[4] * bl[5] + col % bl[5]];
+      FORC4 {
+        val = (pix[c] - dark[c]) * sa->mul[c];
+        pix[c] = CLIP(val);
+      }
+    }
+  }
+}
+
+void CLASS scale_factors (float scale_mul[4])
 {
-  unsigned bottom, right, size, row, col, ur, uc, i, x, y, c, sum[8];
+  unsigned bottom, right, row, col, x, y, c, sum[8];
   int val, dark, sat;
   double dsum[8], dmin, dmax;
-  float scale_mul[4], fr, fc;
-  ushort *img=0, *pix;
 
   if (user_mul[0])
     memcpy (pre_mul, user_mul, sizeof pre_mul);
@@ -4181,16 +5268,22 @@ skip_block: ;
         cblack[6 + c/2 % cblack[4] * cblack[5] + c%2 % cblack[5]];
     cblack[4] = cblack[5] = 0;
   }
+}
+
+void CLASS scale_colors()
+{
+  unsigned size, row, col, ur, uc, i, c;
+  float scale_mul[4], fr, fc;
+  ushort *img=0, *pix;
+  struct scale_args sa;
+
+  scale_factors (scale_mul);
   size = iheight*iwidth;
-  for (i=0; i < size*4; i++) {
-    if (!(val = ((ushort *)image)[i])) continue;
-    if (cblack[4] && cblack[5])
-      val -= cblack[6 + i/4 / iwidth % cblack[4] * cblack[5] +
-                        i/4 % iwidth % cblack[5]];
-    val -= cblack[i & 3];
-    val *= scale_mul[i & 3];
-    ((ushort *)image)[i] = CLIP(val);
-  }
+  sa.mul = scale_mul;
+  sa.black = cblack;
+  sa.iheight = iheight;
+  sa.iwidth = iwidth;
+  run_jobs ((iheight + BAND-1) / BAND, scale_colors_band, &sa);
   if ((aber[0] != 1 || aber[2] != 1) && colors == 3) {
     if (verbose)
       fprintf (stderr,_("Correcting chromatic aberration...\n"));
@@ -4248,7 +5341,7 @@ void CLASS pre_interpolate()
           c = fcol(row,col);
           img[row*width+col][c] = image[(row >> 1)*iwidth+(col >> 1)][c];
         }
-      free (image);
+      arena_free (image);
       image = img;
       shrink = 0;
     }
@@ -4257,46 +5350,82 @@ void CLASS pre_interpolate()
     mix_green = four_color_rgb ^ half_size;
     if (four_color_rgb | half_size) colors++;
     else {
-      for (row = FC(1,0) >> 1; row < height; row+=2)
-        for (col = FC(row,1) & 1; col < width; col+=2)
-          image[row*width+col][1] = image[row*width+col][3];
+      if (image)                /* render_strips() moves its own */
+        for (row = FC(1,0) >> 1; row < height; row+=2)
+          for (col = FC(row,1) & 1; col < width; col+=2)
+            image[row*width+col][1] = image[row*width+col][3];
       filters &= ~((filters & 0x55555555) << 1);
     }
   }
   if (half_size) filters = 0;
 }
 
+/* img holds rows y0 onwards */
+void CLASS border_pixel (ushort (*img)[4], unsigned y0, unsigned row, unsigned col)
+{
+  unsigned y, x, f, c, sum[8];
+
+  memset (sum, 0, sizeof sum);
+  for (y=row-1; y != row+2; y++)
+    for (x=col-1; x != col+2; x++)
+      if (y < height && x < width) {
+        f = fcol(y,x);
+        sum[f] += img[(y-y0)*width+x][f];
+        sum[f+4]++;
+      }
+  f = fcol(row,col);
+  FORCC if (c != f && sum[c+4])
+    img[(row-y0)*width+col][c] = sum[c] / sum[c+4];
+}
+
 void CLASS border_interpolate (int border)
 {
-  unsigned row, col, y, x, f, c, sum[8];
+  unsigned row, col;
 
   for (row=0; row < height; row++)
     for (col=0; col < width; col++) {
       if (col==border && row >= border && row < height-border)
         col = width-border;
-      memset (sum, 0, sizeof sum);
-      for (y=row-1; y != row+2; y++)
-        for (x=col-1; x != col+2; x++)
-          if (y < height && x < width) {
-            f = fcol(y,x);
-            sum[f] += image[y*width+x][f];
-            sum[f+4]++;
-          }
-      f = fcol(row,col);
-      FORCC if (c != f && sum[c+4])
-        image[row*width+col][c] = sum[c] / sum[c+4];
+      border_pixel (image, 0, row, col);
     }
 }
 
-void CLASS lin_interpolate()
+struct lin_args { int (*code)[16][32], size; };
+
+/* the inner columns of one row; img points at its first pixel */
+void CLASS lin_interpolate_row (struct lin_args *la, ushort (*img)[4], int row)
 {
-  int code[16][16][32], size=16, *ip, sum[4];
-  int f, c, i, x, y, row, col, shift, color;
+  int *ip, sum[4], i, col;
   ushort *pix;
 
-  if (verbose) fprintf (stderr,_("Bilinear interpolation...\n"));
+  for (col=1; col < width-1; col++) {
+    pix = img[col];
+    ip = la->code[row % la->size][col % la->size];
+    memset (sum, 0, sizeof sum);
+    for (i=*ip++; i--; ip+=3)
+      sum[ip[2]] += pix[ip[0]] << ip[1];
+    for (i=colors; --i; ip+=2)
+      pix[ip[0]] = sum[ip[0]] * ip[1] >> 8;
+  }
+}
+
+void CLASS lin_interpolate_band (void *arg, int band)
+{
+  struct lin_args *la = (struct lin_args *) arg;
+  int row;
+
+  for (row=1+band*BAND; row < 1+(band+1)*BAND && row < height-1; row++)
+    lin_interpolate_row (la, image + row*width, row);
+}
+
+/* fills in la->code; offsets assume rows width pixels apart */
+void CLASS lin_interpolate_code (struct lin_args *la)
+{
+  int (*code)[16][32] = la->code, size=16, *ip, sum[4];
+  int f, c, x, y, row, col, shift, color;
+
   if (filters == 9) size = 6;
-  border_interpolate(1);
+  la->size = size;
   for (row=0; row < size; row++)
     for (col=0; col < size; col++) {
       ip = code[row][col]+1;
@@ -4319,17 +5448,100 @@ void CLASS lin_interpolate()
           *ip++ = 256 / sum[c];
         }
     }
-  for (row=1; row < height-1; row++)
-    for (col=1; col < width-1; col++) {
+}
+
+void CLASS lin_interpolate()
+{
+  int code[16][16][32];
+  struct lin_args la;
+
+  if (verbose) fprintf (stderr,_("Bilinear interpolation...\n"));
+  border_interpolate(1);
+  la.code = code;
+  lin_interpolate_code (&la);
+  run_jobs ((height-2 + BAND-1) / BAND, lin_interpolate_band, &la);
+}
+
+/*
+   Bands only read pixels that lin_interpolate() produced: each one
+   writes its rows two behind, like the serial loop did, and keeps
+   the two rows at either end (which neighbouring bands read) aside
+   until every band is done.
+ */
+struct vng_args {
+  int *(*code)[16], prow, pcol, nb;
+  ushort (*brow)[4], (*edge)[4];
+};
+
+#define VNG_ROW(r) (edge && (r) < r0+2 ? edge + ((r)-r0)*width : \
+        edge && (r) >= r1-2 ? edge + ((r)-r1+4)*width : image + (r)*width)
+
+void CLASS vng_interpolate_band (void *arg, int band)
+{
+  struct vng_args *va = (struct vng_args *) arg;
+  ushort (*brow[5])[4], (*edge)[4]=0, *pix;
+  int *ip, gval[8], gmin, gmax, sum[4], row, col, r0, r1;
+  int t, color, g, diff, thold, num, c;
+
+  r0 = 2 + (INT64) (height-4) * band / va->nb;
+  r1 = 2 + (INT64) (height-4) * (band+1) / va->nb;
+  brow[4] = va->brow + band*width*3;
+  if (va->edge) edge = va->edge + band*width*4;
+  for (row=0; row < 3; row++)
+    brow[row] = brow[4] + row*width;
+  for (row=r0; row < r1; row++) {                /* Do VNG interpolation */
+    for (col=2; col < width-2; col++) {
       pix = image[row*width+col];
-      ip = code[row % size][col % size];
+      ip = va->code[row % va->prow][col % va->pcol];
+      memset (gval, 0, sizeof gval);
+      while ((g = ip[0]) != INT_MAX) {                /* Calculate gradients */
+        diff = ABS(pix[g] - pix[ip[1]]) << ip[2];
+        gval[ip[3]] += diff;
+        ip += 5;
+        if ((g = ip[-1]) == -1) continue;
+        gval[g] += diff;
+        while ((g = *ip++) != -1)
+          gval[g] += diff;
+      }
+      ip++;
+      gmin = gmax = gval[0];                        /* Choose a threshold */
+      for (g=1; g < 8; g++) {
+        if (gmin > gval[g]) gmin = gval[g];
+        if (gmax < gval[g]) gmax = gval[g];
+      }
+      if (gmax == 0) {
+        memcpy (brow[2][col], pix, sizeof *image);
+        continue;
+      }
+      thold = gmin + (gmax >> 1);
       memset (sum, 0, sizeof sum);
-      for (i=*ip++; i--; ip+=3)
-        sum[ip[2]] += pix[ip[0]] << ip[1];
-      for (i=colors; --i; ip+=2)
-        pix[ip[0]] = sum[ip[0]] * ip[1] >> 8;
+      color = fcol(row,col);
+      for (num=g=0; g < 8; g++,ip+=2) {                /* Average the neighbors */
+        if (gval[g] <= thold) {
+          FORCC
+            if (c == color && ip[1])
+              sum[c] += (pix[c] + pix[ip[1]]) >> 1;
+            else
+              sum[c] += pix[ip[0] + c];
+          num++;
+        }
+      }
+      FORCC {                                        /* Save to buffer */
+        t = pix[color];
+        if (c != color)
+          t += (sum[c] - sum[color]) / num;
+        brow[2][col][c] = CLIP(t);
+      }
     }
+    if (row > r0+1)                                /* Write buffer to image */
+      memcpy (VNG_ROW(row-2)+2, brow[0]+2, (width-4)*sizeof *image);
+    for (g=0; g < 4; g++)
+      brow[(g-1) & 3] = brow[g];
+  }
+  memcpy (VNG_ROW(row-2)+2, brow[0]+2, (width-4)*sizeof *image);
+  memcpy (VNG_ROW(row-1)+2, brow[1]+2, (width-4)*sizeof *image);
 }
+#undef VNG_ROW
 
 /*
    This algorithm is officially called:
@@ -4367,10 +5579,10 @@ void CLASS vng_interpolate()
     +1,-1,+1,+1,0,0x88, +1,+0,+1,+2,0,0x08, +1,+0,+2,-1,0,0x40,
     +1,+0,+2,+1,0,0x10
   }, chood[] = { -1,-1, -1,0, -1,+1, 0,+1, +1,+1, +1,0, +1,-1, 0,-1 };
-  ushort (*brow[5])[4], *pix;
-  int prow=8, pcol=2, *ip, *code[16][16], gval[8], gmin, gmax, sum[4];
+  int prow=8, pcol=2, *ip, *code[16][16];
   int row, col, x, y, x1, x2, y1, y2, t, weight, grads, color, diag;
-  int g, diff, thold, num, c;
+  int g, i, b, r0, r1;
+  struct vng_args va;
 
   lin_interpolate();
   if (verbose) fprintf (stderr,_("VNG interpolation...\n"));
@@ -4409,79 +5621,46 @@ void CLASS vng_interpolate()
           *ip++ = 0;
       }
     }
-  brow[4] = (ushort (*)[4]) calloc (width*3, sizeof **brow);
-  merror (brow[4], "vng_interpolate()");
-  for (row=0; row < 3; row++)
-    brow[row] = brow[4] + row*width;
-  for (row=2; row < height-2; row++) {                /* Do VNG interpolation */
-    for (col=2; col < width-2; col++) {
-      pix = image[row*width+col];
-      ip = code[row % prow][col % pcol];
-      memset (gval, 0, sizeof gval);
-      while ((g = ip[0]) != INT_MAX) {                /* Calculate gradients */
-        diff = ABS(pix[g] - pix[ip[1]]) << ip[2];
-        gval[ip[3]] += diff;
-        ip += 5;
-        if ((g = ip[-1]) == -1) continue;
-        gval[g] += diff;
-        while ((g = *ip++) != -1)
-          gval[g] += diff;
-      }
-      ip++;
-      gmin = gmax = gval[0];                        /* Choose a threshold */
-      for (g=1; g < 8; g++) {
-        if (gmin > gval[g]) gmin = gval[g];
-        if (gmax < gval[g]) gmax = gval[g];
-      }
-      if (gmax == 0) {
-        memcpy (brow[2][col], pix, sizeof *image);
-        continue;
-      }
-      thold = gmin + (gmax >> 1);
-      memset (sum, 0, sizeof sum);
-      color = fcol(row,col);
-      for (num=g=0; g < 8; g++,ip+=2) {                /* Average the neighbors */
-        if (gval[g] <= thold) {
-          FORCC
-            if (c == color && ip[1])
-              sum[c] += (pix[c] + pix[ip[1]]) >> 1;
-            else
-              sum[c] += pix[ip[0] + c];
-          num++;
-        }
-      }
-      FORCC {                                        /* Save to buffer */
-        t = pix[color];
-        if (c != color)
-          t += (sum[c] - sum[color]) / num;
-        brow[2][col][c] = CLIP(t);
-      }
-    }
-    if (row > 3)                                /* Write buffer to image */
-      memcpy (image[(row-2)*width+2], brow[0]+2, (width-4)*sizeof *image);
-    for (g=0; g < 4; g++)
-      brow[(g-1) & 3] = brow[g];
-  }
-  memcpy (image[(row-2)*width+2], brow[0]+2, (width-4)*sizeof *image);
-  memcpy (image[(row-1)*width+2], brow[1]+2, (width-4)*sizeof *image);
-  free (brow[4]);
+  va.code = code;
+  va.prow = prow;
+  va.pcol = pcol;
+  va.nb = MAX(1, (height-4) / BAND);
+  va.brow = (ushort (*)[4]) calloc (va.nb*width*3, sizeof *image);
+  merror (va.brow, "vng_interpolate()");
+  va.edge = 0;
+  if (va.nb > 1) {
+    va.edge = (ushort (*)[4]) calloc (va.nb*width*4, sizeof *image);
+    merror (va.edge, "vng_interpolate()");
+  }
+  run_jobs (va.nb, vng_interpolate_band, &va);
+  for (b=0; va.edge && b < va.nb; b++) {        /* Write band edges */
+    r0 = 2 + (INT64) (height-4) * b / va.nb;
+    r1 = 2 + (INT64) (height-4) * (b+1) / va.nb;
+    for (i=0; i < 4; i++) {
+      row = i < 2 ? r0+i : r1-4+i;
+      memcpy (image[row*width+2], va.edge[(b*4+i)*width+2],
+                (width-4)*sizeof *image);
+    }
+  }
+  free (va.edge);
+  free (va.brow);
   free (code[0][0]);
 }
 
 /*
    Patterned Pixel Grouping Interpolation by Alain Desbiolles
 */
-void CLASS ppg_interpolate()
+void CLASS ppg_interpolate_band (void *arg, int band)
 {
   int dir[5] = { 1, width, -1, -width, 1 };
-  int row, col, diff[2], guess[2], c, d, i;
+  int pass = *(int *) arg, row, col, diff[2], guess[2], c, d, i, rend;
   ushort (*pix)[4];
 
-  border_interpolate(3);
-  if (verbose) fprintf (stderr,_("PPG interpolation...\n"));
-
+  row = (pass ? 1:3) + band*BAND;
+  rend = MIN(row+BAND, height-(pass ? 1:3));
 /*  Fill in the green layer with gradients and pattern recognition: */
-  for (row=3; row < height-3; row++)
+  if (pass == 0)
+  for ( ; row < rend; row++)
     for (col=3+(FC(row,3) & 1), c=FC(row,col); col < width-3; col+=2) {
       pix = image + row*width+col;
       for (i=0; (d=dir[i]) > 0; i++) {
@@ -4497,7 +5676,8 @@ void CLASS ppg_interpolate()
       pix[0][1] = ULIM(guess[i] >> 2, pix[d][1], pix[-d][1]);
     }
 /*  Calculate red and blue for each green pixel:                */
-  for (row=1; row < height-1; row++)
+  if (pass == 1)
+  for ( ; row < rend; row++)
     for (col=1+(FC(row,2) & 1), c=FC(row,col+1); col < width-1; col+=2) {
       pix = image + row*width+col;
       for (i=0; (d=dir[i]) > 0; c=2-c, i++)
@@ -4505,7 +5685,8 @@ void CLASS ppg_interpolate()
                         - pix[-d][1] - pix[d][1]) >> 1);
     }
 /*  Calculate blue for red pixels and vice versa:                */
-  for (row=1; row < height-1; row++)
+  if (pass == 2)
+  for ( ; row < rend; row++)
     for (col=1+(FC(row,1) & 1), c=2-FC(row,col); col < width-1; col+=2) {
       pix = image + row*width+col;
       for (i=0; (d=dir[i]+dir[i+1]) > 0; i++) {
@@ -4522,17 +5703,41 @@ void CLASS ppg_interpolate()
     }
 }
 
+/*
+   No pass reads a value that the same pass writes,
+   so the rows within a pass can be done in any order.
+ */
+void CLASS ppg_interpolate()
+{
+  int pass;
+
+  border_interpolate(3);
+  if (verbose) fprintf (stderr,_("PPG interpolation...\n"));
+  for (pass=0; pass < 3; pass++)
+    run_jobs ((height - (pass ? 2:6) + BAND-1) / BAND,
+                ppg_interpolate_band, &pass);
+}
+
+static float cbrt_lut[0x10000];        /* shared, filled once by dcraw_init() */
+
+void CLASS cielab_init()
+{
+  int i;
+  float r;
+
+  for (i=0; i < 0x10000; i++) {
+    r = i / 65535.0;
+    cbrt_lut[i] = r > 0.008856 ? pow(r,1/3.0) : 7.787*r + 16/116.0;
+  }
+}
+
 void CLASS cielab (ushort rgb[3], short lab[3])
 {
   int c, i, j, k;
-  float r, xyz[3];
-  static float cbrt[0x10000], xyz_cam[3][4];
+  float xyz[3];
+  static thread_local float xyz_cam[3][4];
 
   if (!rgb) {
-    for (i=0; i < 0x10000; i++) {
-      r = i / 65535.0;
-      cbrt[i] = r > 0.008856 ? pow(r,1/3.0) : 7.787*r + 16/116.0;
-    }
     for (i=0; i < 3; i++)
       for (j=0; j < colors; j++)
         for (xyz_cam[i][j] = k=0; k < 3; k++)
@@ -4545,9 +5750,9 @@ void CLASS cielab (ushort rgb[3], short lab[3])
     xyz[1] += xyz_cam[1][c] * rgb[c];
     xyz[2] += xyz_cam[2][c] * rgb[c];
   }
-  xyz[0] = cbrt[CLIP((int) xyz[0])];
-  xyz[1] = cbrt[CLIP((int) xyz[1])];
-  xyz[2] = cbrt[CLIP((int) xyz[2])];
+  xyz[0] = cbrt_lut[CLIP((int) xyz[0])];
+  xyz[1] = cbrt_lut[CLIP((int) xyz[1])];
+  xyz[2] = cbrt_lut[CLIP((int) xyz[2])];
   lab[0] = 64 * (116 * xyz[1] - 16);
   lab[1] = 64 * 500 * (xyz[0] - xyz[1]);
   lab[2] = 64 * 200 * (xyz[1] - xyz[2]);
@@ -4558,33 +5763,219 @@ void CLASS cielab (ushort rgb[3], short lab[3])
 
 /*
    Frank Markesteijn's algorithm for Fuji X-Trans sensors
+
+   Tiles overlap, and each one starts from what its neighbours above
+   and to the left have already written.  So they run in waves: tile
+   (i,j) goes in wave 2*i+j, after every tile it depends on, and the
+   tiles of one wave never touch each other's pixels.
  */
+struct xtrans_args {
+  short (*allhex)[3][2][8];
+  ushort sgrow, sgcol;
+  int passes, ndir, ntr, ntc, nlanes, wave;
+  char *buffer;
+};
+
+void CLASS xtrans_interpolate_lane (void *arg, int lane)
+{
+  struct xtrans_args *xa = (struct xtrans_args *) arg;
+  int c, d, f, g, h, i, v, n, trow, tcol, row, col, top, left, mrow, mcol;
+  int val, ndir=xa->ndir, passes=xa->passes, pass, hm[8], avg[4], color[3][8];
+  static const short dir[4] = { 1,TS,TS+1,TS-1 };
+  short (*allhex)[3][2][8] = xa->allhex, *hex;
+  ushort max, sgrow=xa->sgrow, sgcol=xa->sgcol;
+  ushort (*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
+   short (*lab)    [TS][3], (*lix)[3];
+   float (*drv)[TS][TS], diff[6], tr;
+   char (*homo)[TS][TS], *buffer;
+
+  buffer = xa->buffer + (size_t) lane*TS*TS*(ndir*11+6);
+  lab  = (short (*)    [TS][3])(buffer + TS*TS*(ndir*6));
+  drv  = (float (*)[TS][TS])   (buffer + TS*TS*(ndir*6+6));
+  homo = (char  (*)[TS][TS])   (buffer + TS*TS*(ndir*10+6));
+
+  for (n=trow=0; trow < xa->ntr; trow++) {
+    tcol = xa->wave - 2*trow;
+    if (tcol < 0 || tcol >= xa->ntc || n++ % xa->nlanes != lane) continue;
+    top  = 3 + trow*(TS-16);
+    left = 3 + tcol*(TS-16);
+    rgb  = (ushort(*)[TS][TS][3]) buffer;
+    mrow = MIN (top+TS, height-3);
+    mcol = MIN (left+TS, width-3);
+    for (row=top; row < mrow; row++)
+      for (col=left; col < mcol; col++)
+        memcpy (rgb[0][row-top][col-left], image[row*width+col], 6);
+    FORC3 memcpy (rgb[c+1], rgb[0], sizeof *rgb);
+
+/* Interpolate green horizontally, vertically, and along both diagonals: */
+    for (row=top; row < mrow; row++)
+      for (col=left; col < mcol; col++) {
+        if ((f = fcol(row,col)) == 1) continue;
+        pix = image + row*width + col;
+        hex = allhex[row % 3][col % 3][0];
+        color[1][0] = 174 * (pix[  hex[1]][1] + pix[  hex[0]][1]) -
+                       46 * (pix[2*hex[1]][1] + pix[2*hex[0]][1]);
+        color[1][1] = 223 *  pix[  hex[3]][1] + pix[  hex[2]][1] * 33 +
+                       92 * (pix[      0 ][f] - pix[ -hex[2]][f]);
+        FORC(2) color[1][2+c] =
+              164 * pix[hex[4+c]][1] + 92 * pix[-2*hex[4+c]][1] + 33 *
+              (2*pix[0][f] - pix[3*hex[4+c]][f] - pix[-3*hex[4+c]][f]);
+        FORC4 rgb[c^!((row-sgrow) % 3)][row-top][col-left][1] =
+              LIM(color[1][c] >> 8,pix[0][1],pix[0][3]);
+      }
+
+    for (pass=0; pass < passes; pass++) {
+      if (pass == 1)
+        memcpy (rgb+=4, buffer, 4*sizeof *rgb);
+
+/* Recalculate green from interpolated values of closer pixels:        */
+      if (pass) {
+        for (row=top+2; row < mrow-2; row++)
+          for (col=left+2; col < mcol-2; col++) {
+            if ((f = fcol(row,col)) == 1) continue;
+            pix = image + row*width + col;
+            hex = allhex[row % 3][col % 3][1];
+            for (d=3; d < 6; d++) {
+              rix = &rgb[(d-2)^!((row-sgrow) % 3)][row-top][col-left];
+              val = rix[-2*hex[d]][1] + 2*rix[hex[d]][1]
+                  - rix[-2*hex[d]][f] - 2*rix[hex[d]][f] + 3*rix[0][f];
+              rix[0][1] = LIM(val/3,pix[0][1],pix[0][3]);
+            }
+          }
+      }
+
+/* Interpolate red and blue values for solitary green pixels:        */
+      for (row=(top-sgrow+4)/3*3+sgrow; row < mrow-2; row+=3)
+        for (col=(left-sgcol+4)/3*3+sgcol; col < mcol-2; col+=3) {
+          rix = &rgb[0][row-top][col-left];
+          h = fcol(row,col+1);
+          memset (diff, 0, sizeof diff);
+          for (i=1, d=0; d < 6; d++, i^=TS^1, h^=2) {
+            for (c=0; c < 2; c++, h^=2) {
+              g = 2*rix[0][1] - rix[i<<c][1] - rix[-i<<c][1];
+              color[h][d] = g + rix[i<<c][h] + rix[-i<<c][h];
+              if (d > 1)
+                diff[d] += SQR (rix[i<<c][1] - rix[-i<<c][1]
+                              - rix[i<<c][h] + rix[-i<<c][h]) + SQR(g);
+            }
+            if (d > 1 && (d & 1))
+              if (diff[d-1] < diff[d])
+                FORC(2) color[c*2][d] = color[c*2][d-1];
+            if (d < 2 || (d & 1)) {
+              FORC(2) rix[0][c*2] = CLIP(color[c*2][d]/2);
+              rix += TS*TS;
+            }
+          }
+        }
+
+/* Interpolate red for blue pixels and vice versa:                */
+      for (row=top+3; row < mrow-3; row++)
+        for (col=left+3; col < mcol-3; col++) {
+          if ((f = 2-fcol(row,col)) == 1) continue;
+          rix = &rgb[0][row-top][col-left];
+          c = (row-sgrow) % 3 ? TS:1;
+          h = 3 * (c ^ TS ^ 1);
+          for (d=0; d < 4; d++, rix += TS*TS) {
+            i = d > 1 || ((d ^ c) & 1) ||
+               ((ABS(rix[0][1]-rix[c][1])+ABS(rix[0][1]-rix[-c][1])) <
+              2*(ABS(rix[0][1]-rix[h][1])+ABS(rix[0][1]-rix[-h][1]))) ? c:h;
+            rix[0][f] = CLIP((rix[i][f] + rix[-i][f] +
+                2*rix[0][1] - rix[i][1] - rix[-i][1])/2);
+          }
+        }
+
+/* Fill in red and blue for 2x2 blocks of green:                */
+      for (row=top+2; row < mrow-2; row++) if ((row-sgrow) % 3)
+        for (col=left+2; col < mcol-2; col++) if ((col-sgcol) % 3) {
+          rix = &rgb[0][row-top][col-left];
+          hex = allhex[row % 3][col % 3][1];
+          for (d=0; d < ndir; d+=2, rix += TS*TS)
+            if (hex[d] + hex[d+1]) {
+              g = 3*rix[0][1] - 2*rix[hex[d]][1] - rix[hex[d+1]][1];
+              for (c=0; c < 4; c+=2) rix[0][c] =
+                      CLIP((g + 2*rix[hex[d]][c] + rix[hex[d+1]][c])/3);
+            } else {
+              g = 2*rix[0][1] - rix[hex[d]][1] - rix[hex[d+1]][1];
+              for (c=0; c < 4; c+=2) rix[0][c] =
+                      CLIP((g + rix[hex[d]][c] + rix[hex[d+1]][c])/2);
+            }
+        }
+    }
+    rgb = (ushort(*)[TS][TS][3]) buffer;
+    mrow -= top;
+    mcol -= left;
+
+/* Convert to CIELab and differentiate in all directions:        */
+    for (d=0; d < ndir; d++) {
+      for (row=2; row < mrow-2; row++)
+        for (col=2; col < mcol-2; col++)
+          cielab (rgb[d][row][col], lab[row][col]);
+      for (f=dir[d & 3],row=3; row < mrow-3; row++)
+        for (col=3; col < mcol-3; col++) {
+          lix = &lab[row][col];
+          g = 2*lix[0][0] - lix[f][0] - lix[-f][0];
+          drv[d][row][col] = SQR(g)
+            + SQR((2*lix[0][1] - lix[f][1] - lix[-f][1] + g*500/232))
+            + SQR((2*lix[0][2] - lix[f][2] - lix[-f][2] - g*500/580));
+        }
+    }
+
+/* Build homogeneity maps from the derivatives:                        */
+    memset(homo, 0, ndir*TS*TS);
+    for (row=4; row < mrow-4; row++)
+      for (col=4; col < mcol-4; col++) {
+        for (tr=FLT_MAX, d=0; d < ndir; d++)
+          if (tr > drv[d][row][col])
+              tr = drv[d][row][col];
+        tr *= 8;
+        for (d=0; d < ndir; d++)
+          for (v=-1; v <= 1; v++)
+            for (h=-1; h <= 1; h++)
+              if (drv[d][row+v][col+h] <= tr)
+                homo[d][row][col]++;
+      }
+
+/* Average the most homogenous pixels for the final result:        */
+    if (height-top < TS+4) mrow = height-top+2;
+    if (width-left < TS+4) mcol = width-left+2;
+    for (row = MIN(top,8); row < mrow-8; row++)
+      for (col = MIN(left,8); col < mcol-8; col++) {
+        for (d=0; d < ndir; d++)
+          for (hm[d]=0, v=-2; v <= 2; v++)
+            for (h=-2; h <= 2; h++)
+              hm[d] += homo[d][row+v][col+h];
+        for (d=0; d < ndir-4; d++)
+          if (hm[d] < hm[d+4]) hm[d  ] = 0; else
+          if (hm[d] > hm[d+4]) hm[d+4] = 0;
+        for (max=hm[0],d=1; d < ndir; d++)
+          if (max < hm[d]) max = hm[d];
+        max -= max >> 3;
+        memset (avg, 0, sizeof avg);
+        for (d=0; d < ndir; d++)
+          if (hm[d] >= max) {
+            FORC3 avg[c] += rgb[d][row][col][c];
+            avg[3]++;
+          }
+        FORC3 image[(row+top)*width+col+left][c] = avg[c]/avg[3];
+      }
+  }
+}
+
 void CLASS xtrans_interpolate (int passes)
 {
-  int c, d, f, g, h, i, v, ng, row, col, top, left, mrow, mcol;
-  int val, ndir, pass, hm[8], avg[4], color[3][8];
+  int c, d, g, h, v, ng, row, col, val;
   static const short orth[12] = { 1,0,0,1,-1,0,0,-1,1,0,0,1 },
         patt[2][16] = { { 0,1,0,-1,2,0,-1,0,1,1,1,-1,0,0,0,0 },
-                        { 0,1,0,-2,1,0,-2,0,1,1,-2,-2,1,-1,-1,1 } },
-        dir[4] = { 1,TS,TS+1,TS-1 };
+                        { 0,1,0,-2,1,0,-2,0,1,1,-2,-2,1,-1,-1,1 } };
   short allhex[3][3][2][8], *hex;
   ushort min, max, sgrow, sgcol;
-  ushort (*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
-   short (*lab)    [TS][3], (*lix)[3];
-   float (*drv)[TS][TS], diff[6], tr;
-   char (*homo)[TS][TS], *buffer;
+  ushort (*pix)[4];
+  struct xtrans_args xa;
 
   if (verbose)
     fprintf (stderr,_("%d-pass X-Trans interpolation...\n"), passes);
 
   cielab (0,0);
-  ndir = 4 << (passes > 1);
-  buffer = (char *) malloc (TS*TS*(ndir*11+6));
-  merror (buffer, "xtrans_interpolate()");
-  rgb  = (ushort(*)[TS][TS][3]) buffer;
-  lab  = (short (*)    [TS][3])(buffer + TS*TS*(ndir*6));
-  drv  = (float (*)[TS][TS])   (buffer + TS*TS*(ndir*6+6));
-  homo = (char  (*)[TS][TS])   (buffer + TS*TS*(ndir*10+6));
 
 /* Map a green hexagon around each non-green pixel and vice versa:        */
   for (row=0; row < 3; row++)
@@ -4620,168 +6011,19 @@ void CLASS xtrans_interpolate (int passes)
       }
     }
 
-  for (top=3; top < height-19; top += TS-16)
-    for (left=3; left < width-19; left += TS-16) {
-      mrow = MIN (top+TS, height-3);
-      mcol = MIN (left+TS, width-3);
-      for (row=top; row < mrow; row++)
-        for (col=left; col < mcol; col++)
-          memcpy (rgb[0][row-top][col-left], image[row*width+col], 6);
-      FORC3 memcpy (rgb[c+1], rgb[0], sizeof *rgb);
-
-/* Interpolate green horizontally, vertically, and along both diagonals: */
-      for (row=top; row < mrow; row++)
-        for (col=left; col < mcol; col++) {
-          if ((f = fcol(row,col)) == 1) continue;
-          pix = image + row*width + col;
-          hex = allhex[row % 3][col % 3][0];
-          color[1][0] = 174 * (pix[  hex[1]][1] + pix[  hex[0]][1]) -
-                         46 * (pix[2*hex[1]][1] + pix[2*hex[0]][1]);
-          color[1][1] = 223 *  pix[  hex[3]][1] + pix[  hex[2]][1] * 33 +
-                         92 * (pix[      0 ][f] - pix[ -hex[2]][f]);
-          FORC(2) color[1][2+c] =
-                164 * pix[hex[4+c]][1] + 92 * pix[-2*hex[4+c]][1] + 33 *
-                (2*pix[0][f] - pix[3*hex[4+c]][f] - pix[-3*hex[4+c]][f]);
-          FORC4 rgb[c^!((row-sgrow) % 3)][row-top][col-left][1] =
-                LIM(color[1][c] >> 8,pix[0][1],pix[0][3]);
-        }
-
-      for (pass=0; pass < passes; pass++) {
-        if (pass == 1)
-          memcpy (rgb+=4, buffer, 4*sizeof *rgb);
-
-/* Recalculate green from interpolated values of closer pixels:        */
-        if (pass) {
-          for (row=top+2; row < mrow-2; row++)
-            for (col=left+2; col < mcol-2; col++) {
-              if ((f = fcol(row,col)) == 1) continue;
-              pix = image + row*width + col;
-              hex = allhex[row % 3][col % 3][1];
-              for (d=3; d < 6; d++) {
-                rix = &rgb[(d-2)^!((row-sgrow) % 3)][row-top][col-left];
-                val = rix[-2*hex[d]][1] + 2*rix[hex[d]][1]
-                    - rix[-2*hex[d]][f] - 2*rix[hex[d]][f] + 3*rix[0][f];
-                rix[0][1] = LIM(val/3,pix[0][1],pix[0][3]);
-              }
-            }
-        }
-
-/* Interpolate red and blue values for solitary green pixels:        */
-        for (row=(top-sgrow+4)/3*3+sgrow; row < mrow-2; row+=3)
-          for (col=(left-sgcol+4)/3*3+sgcol; col < mcol-2; col+=3) {
-            rix = &rgb[0][row-top][col-left];
-            h = fcol(row,col+1);
-            memset (diff, 0, sizeof diff);
-            for (i=1, d=0; d < 6; d++, i^=TS^1, h^=2) {
-              for (c=0; c < 2; c++, h^=2) {
-                g = 2*rix[0][1] - rix[i<<c][1] - rix[-i<<c][1];
-                color[h][d] = g + rix[i<<c][h] + rix[-i<<c][h];
-                if (d > 1)
-                  diff[d] += SQR (rix[i<<c][1] - rix[-i<<c][1]
-                                - rix[i<<c][h] + rix[-i<<c][h]) + SQR(g);
-              }
-              if (d > 1 && (d & 1))
-                if (diff[d-1] < diff[d])
-                  FORC(2) color[c*2][d] = color[c*2][d-1];
-              if (d < 2 || (d & 1)) {
-                FORC(2) rix[0][c*2] = CLIP(color[c*2][d]/2);
-                rix += TS*TS;
-              }
-            }
-          }
-
-/* Interpolate red for blue pixels and vice versa:                */
-        for (row=top+3; row < mrow-3; row++)
-          for (col=left+3; col < mcol-3; col++) {
-            if ((f = 2-fcol(row,col)) == 1) continue;
-            rix = &rgb[0][row-top][col-left];
-            c = (row-sgrow) % 3 ? TS:1;
-            h = 3 * (c ^ TS ^ 1);
-            for (d=0; d < 4; d++, rix += TS*TS) {
-              i = d > 1 || ((d ^ c) & 1) ||
-                 ((ABS(rix[0][1]-rix[c][1])+ABS(rix[0][1]-rix[-c][1])) <
-                2*(ABS(rix[0][1]-rix[h][1])+ABS(rix[0][1]-rix[-h][1]))) ? c:h;
-              rix[0][f] = CLIP((rix[i][f] + rix[-i][f] +
-                  2*rix[0][1] - rix[i][1] - rix[-i][1])/2);
-            }
-          }
-
-/* Fill in red and blue for 2x2 blocks of green:                */
-        for (row=top+2; row < mrow-2; row++) if ((row-sgrow) % 3)
-          for (col=left+2; col < mcol-2; col++) if ((col-sgcol) % 3) {
-            rix = &rgb[0][row-top][col-left];
-            hex = allhex[row % 3][col % 3][1];
-            for (d=0; d < ndir; d+=2, rix += TS*TS)
-              if (hex[d] + hex[d+1]) {
-                g = 3*rix[0][1] - 2*rix[hex[d]][1] - rix[hex[d+1]][1];
-                for (c=0; c < 4; c+=2) rix[0][c] =
-                        CLIP((g + 2*rix[hex[d]][c] + rix[hex[d+1]][c])/3);
-              } else {
-                g = 2*rix[0][1] - rix[hex[d]][1] - rix[hex[d+1]][1];
-                for (c=0; c < 4; c+=2) rix[0][c] =
-                        CLIP((g + rix[hex[d]][c] + rix[hex[d+1]][c])/2);
-              }
-          }
-      }
-      rgb = (ushort(*)[TS][TS][3]) buffer;
-      mrow -= top;
-      mcol -= left;
-
-/* Convert to CIELab and differentiate in all directions:        */
-      for (d=0; d < ndir; d++) {
-        for (row=2; row < mrow-2; row++)
-          for (col=2; col < mcol-2; col++)
-            cielab (rgb[d][row][col], lab[row][col]);
-        for (f=dir[d & 3],row=3; row < mrow-3; row++)
-          for (col=3; col < mcol-3; col++) {
-            lix = &lab[row][col];
-            g = 2*lix[0][0] - lix[f][0] - lix[-f][0];
-            drv[d][row][col] = SQR(g)
-              + SQR((2*lix[0][1] - lix[f][1] - lix[-f][1] + g*500/232))
-              + SQR((2*lix[0][2] - lix[f][2] - lix[-f][2] - g*500/580));
-          }
-      }
-
-/* Build homogeneity maps from the derivatives:                        */
-      memset(homo, 0, ndir*TS*TS);
-      for (row=4; row < mrow-4; row++)
-        for (col=4; col < mcol-4; col++) {
-          for (tr=FLT_MAX, d=0; d < ndir; d++)
-            if (tr > drv[d][row][col])
-                tr = drv[d][row][col];
-          tr *= 8;
-          for (d=0; d < ndir; d++)
-            for (v=-1; v <= 1; v++)
-              for (h=-1; h <= 1; h++)
-                if (drv[d][row+v][col+h] <= tr)
-                  homo[d][row][col]++;
-        }
-
-/* Average the most homogenous pixels for the final result:        */
-      if (height-top < TS+4) mrow = height-top+2;
-      if (width-left < TS+4) mcol = width-left+2;
-      for (row = MIN(top,8); row < mrow-8; row++)
-        for (col = MIN(left,8); col < mcol-8; col++) {
-          for (d=0; d < ndir; d++)
-            for (hm[d]=0, v=-2; v <= 2; v++)
-              for (h=-2; h <= 2; h++)
-                hm[d] += homo[d][row+v][col+h];
-          for (d=0; d < ndir-4; d++)
-            if (hm[d] < hm[d+4]) hm[d  ] = 0; else
-            if (hm[d] > hm[d+4]) hm[d+4] = 0;
-          for (max=hm[0],d=1; d < ndir; d++)
-            if (max < hm[d]) max = hm[d];
-          max -= max >> 3;
-          memset (avg, 0, sizeof avg);
-          for (d=0; d < ndir; d++)
-            if (hm[d] >= max) {
-              FORC3 avg[c] += rgb[d][row][col][c];
-              avg[3]++;
-            }
-          FORC3 image[(row+top)*width+col+left][c] = avg[c]/avg[3];
-        }
-    }
-  free(buffer);
+  xa.allhex = allhex;
+  xa.sgrow = sgrow;
+  xa.sgcol = sgcol;
+  xa.passes = passes;
+  xa.ndir = 4 << (passes > 1);
+  xa.ntr = height > 22 ? (height-22 + TS-17) / (TS-16) : 0;
+  xa.ntc = width  > 22 ? (width -22 + TS-17) / (TS-16) : 0;
+  xa.nlanes = MAX(1, MIN(MIN(xa.ntr, (xa.ntc+1)/2), max_workers));
+  xa.buffer = (char *) malloc ((size_t) xa.nlanes*TS*TS*(xa.ndir*11+6));
+  merror (xa.buffer, "xtrans_interpolate()");
+  for (xa.wave=0; xa.wave < 2*xa.ntr + xa.ntc - 2; xa.wave++)
+    run_jobs (xa.nlanes, xtrans_interpolate_lane, &xa);
+  free(xa.buffer);
   border_interpolate(8);
 }
 #undef fcol
@@ -4789,137 +6031,244 @@ void CLASS xtrans_interpolate (int passes)
 /*
    Adaptive Homogeneity-Directed interpolation is based on
    the work of Keigo Hirakawa, Thomas Parks, and Paul Lee.
+
+   Tiles only read the pixels they are given, never what other tiles
+   wrote, so each worker takes every nlanes-th tile into its own buffer.
  */
-void CLASS ahd_interpolate()
+struct ahd_args { int ntiles, ncols, nlanes; char *buffer; };
+
+void CLASS ahd_interpolate_lane (void *arg, int lane)
 {
-  int i, j, top, left, row, col, tr, tc, c, d, val, hm[2];
+  struct ahd_args *aa = (struct ahd_args *) arg;
+  int i, j, tile, top, left, row, col, tr, tc, c, d, f, val, hm[2];
   static const int dir[4] = { -1, 1, -TS, TS };
   unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
   ushort (*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
    short (*lab)[TS][TS][3], (*lix)[3];
    char (*homo)[TS][TS], *buffer;
 
-  if (verbose) fprintf (stderr,_("AHD interpolation...\n"));
-
-  cielab (0,0);
-  border_interpolate(5);
-  buffer = (char *) malloc (26*TS*TS);
-  merror (buffer, "ahd_interpolate()");
+  buffer = aa->buffer + (size_t) lane*26*TS*TS;
   rgb  = (ushort(*)[TS][TS][3]) buffer;
   lab  = (short (*)[TS][TS][3])(buffer + 12*TS*TS);
   homo = (char  (*)[TS][TS])   (buffer + 24*TS*TS);
 
-  for (top=2; top < height-5; top += TS-6)
-    for (left=2; left < width-5; left += TS-6) {
+  for (tile=lane; tile < aa->ntiles; tile += aa->nlanes) {
+    top  = 2 + tile / aa->ncols * (TS-6);
+    left = 2 + tile % aa->ncols * (TS-6);
 
 /*  Interpolate green horizontally and vertically:                */
-      for (row=top; row < top+TS && row < height-2; row++) {
-        col = left + (FC(row,left) & 1);
-        for (c = FC(row,col); col < left+TS && col < width-2; col+=2) {
-          pix = image + row*width+col;
-          val = ((pix[-1][1] + pix[0][c] + pix[1][1]) * 2
-                - pix[-2][c] - pix[2][c]) >> 2;
-          rgb[0][row-top][col-left][1] = ULIM(val,pix[-1][1],pix[1][1]);
-          val = ((pix[-width][1] + pix[0][c] + pix[width][1]) * 2
-                - pix[-2*width][c] - pix[2*width][c]) >> 2;
-          rgb[1][row-top][col-left][1] = ULIM(val,pix[-width][1],pix[width][1]);
-        }
+    for (row=top; row < top+TS && row < height-2; row++) {
+      col = left + (FC(row,left) & 1);
+      for (c = FC(row,col); col < left+TS && col < width-2; col+=2) {
+        pix = image + row*width+col;
+        val = ((pix[-1][1] + pix[0][c] + pix[1][1]) * 2
+              - pix[-2][c] - pix[2][c]) >> 2;
+        rgb[0][row-top][col-left][1] = ULIM(val,pix[-1][1],pix[1][1]);
+        val = ((pix[-width][1] + pix[0][c] + pix[width][1]) * 2
+              - pix[-2*width][c] - pix[2*width][c]) >> 2;
+        rgb[1][row-top][col-left][1] = ULIM(val,pix[-width][1],pix[width][1]);
       }
+    }
 /*  Interpolate red and blue, and convert to CIELab:                */
-      for (d=0; d < 2; d++)
-        for (row=top+1; row < top+TS-1 && row < height-3; row++)
-          for (col=left+1; col < left+TS-1 && col < width-3; col++) {
-            pix = image + row*width+col;
-            rix = &rgb[d][row-top][col-left];
-            lix = &lab[d][row-top][col-left];
-            if ((c = 2 - FC(row,col)) == 1) {
-              c = FC(row+1,col);
-              val = pix[0][1] + (( pix[-1][2-c] + pix[1][2-c]
-                                 - rix[-1][1] - rix[1][1] ) >> 1);
-              rix[0][2-c] = CLIP(val);
-              val = pix[0][1] + (( pix[-width][c] + pix[width][c]
-                                 - rix[-TS][1] - rix[TS][1] ) >> 1);
-            } else
-              val = rix[0][1] + (( pix[-width-1][c] + pix[-width+1][c]
-                                 + pix[+width-1][c] + pix[+width+1][c]
-                                 - rix[-TS-1][1] - rix[-TS+1][1]
-                                 - rix[+TS-1][1] - rix[+TS+1][1] + 1) >> 2);
-            rix[0][c] = CLIP(val);
-            c = FC(row,col);
-            rix[0][c] = pix[0][c];
-            cielab (rix[0],lix[0]);
-          }
+    for (d=0; d < 2; d++)
+      for (row=top+1; row < top+TS-1 && row < height-3; row++)
+        for (col=left+1; col < left+TS-1 && col < width-3; col++) {
+          pix = image + row*width+col;
+          rix = &rgb[d][row-top][col-left];
+          lix = &lab[d][row-top][col-left];
+          if ((c = 2 - FC(row,col)) == 1) {
+            c = FC(row+1,col);
+            val = pix[0][1] + (( pix[-1][2-c] + pix[1][2-c]
+                               - rix[-1][1] - rix[1][1] ) >> 1);
+            rix[0][2-c] = CLIP(val);
+            val = pix[0][1] + (( pix[-width][c] + pix[width][c]
+                               - rix[-TS][1] - rix[TS][1] ) >> 1);
+          } else
+            val = rix[0][1] + (( pix[-width-1][c] + pix[-width+1][c]
+                               + pix[+width-1][c] + pix[+width+1][c]
+                               - rix[-TS-1][1] - rix[-TS+1][1]
+                               - rix[+TS-1][1] - rix[+TS+1][1] + 1) >> 2);
+          rix[0][c] = CLIP(val);
+          c = FC(row,col);
+          rix[0][c] = pix[0][c];
+          cielab (rix[0],lix[0]);
+        }
 /*  Build homogeneity maps from the CIELab images:                */
-      memset (homo, 0, 2*TS*TS);
-      for (row=top+2; row < top+TS-2 && row < height-4; row++) {
-        tr = row-top;
-        for (col=left+2; col < left+TS-2 && col < width-4; col++) {
-          tc = col-left;
-          for (d=0; d < 2; d++) {
-            lix = &lab[d][tr][tc];
-            for (i=0; i < 4; i++) {
-               ldiff[d][i] = ABS(lix[0][0]-lix[dir[i]][0]);
-              abdiff[d][i] = SQR(lix[0][1]-lix[dir[i]][1])
-                           + SQR(lix[0][2]-lix[dir[i]][2]);
-            }
+    memset (homo, 0, 2*TS*TS);
+    for (row=top+2; row < top+TS-2 && row < height-4; row++) {
+      tr = row-top;
+      for (col=left+2; col < left+TS-2 && col < width-4; col++) {
+        tc = col-left;
+        for (d=0; d < 2; d++) {
+          lix = &lab[d][tr][tc];
+          for (i=0; i < 4; i++) {
+             ldiff[d][i] = ABS(lix[0][0]-lix[dir[i]][0]);
+            abdiff[d][i] = SQR(lix[0][1]-lix[dir[i]][1])
+                         + SQR(lix[0][2]-lix[dir[i]][2]);
           }
-          leps = MIN(MAX(ldiff[0][0],ldiff[0][1]),
-                     MAX(ldiff[1][2],ldiff[1][3]));
-          abeps = MIN(MAX(abdiff[0][0],abdiff[0][1]),
-                      MAX(abdiff[1][2],abdiff[1][3]));
-          for (d=0; d < 2; d++)
-            for (i=0; i < 4; i++)
-              if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
-                homo[d][tr][tc]++;
         }
+        leps = MIN(MAX(ldiff[0][0],ldiff[0][1]),
+                   MAX(ldiff[1][2],ldiff[1][3]));
+        abeps = MIN(MAX(abdiff[0][0],abdiff[0][1]),
+                    MAX(abdiff[1][2],abdiff[1][3]));
+        for (d=0; d < 2; d++)
+          for (i=0; i < 4; i++)
+            if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
+              homo[d][tr][tc]++;
+      }
+    }
+/*  Combine the most homogenous pixels for the final result:        */
+/*  (the sensor's own color is left alone, as other tiles read it)   */
+    for (row=top+3; row < top+TS-3 && row < height-5; row++) {
+      tr = row-top;
+      for (col=left+3; col < left+TS-3 && col < width-5; col++) {
+        tc = col-left;
+        for (d=0; d < 2; d++)
+          for (hm[d]=0, i=tr-1; i <= tr+1; i++)
+            for (j=tc-1; j <= tc+1; j++)
+              hm[d] += homo[d][i][j];
+        f = FC(row,col);
+        if (hm[0] != hm[1]) {
+          FORC3 if (c != f)
+            image[row*width+col][c] = rgb[hm[1] > hm[0]][tr][tc][c];
+        } else
+          FORC3 if (c != f)
+            image[row*width+col][c] =
+              (rgb[0][tr][tc][c] + rgb[1][tr][tc][c]) >> 1;
+      }
+    }
+  }
+}
+
+void CLASS ahd_interpolate()
+{
+  struct ahd_args aa;
+
+  if (verbose) fprintf (stderr,_("AHD interpolation...\n"));
+
+  cielab (0,0);
+  border_interpolate(5);
+  aa.ncols = width > 7 ? (width-7 + TS-7) / (TS-6) : 0;
+  aa.ntiles = height > 7 ? (height-7 + TS-7) / (TS-6) * aa.ncols : 0;
+  aa.nlanes = MAX(1, MIN(aa.ntiles, max_workers));
+  aa.buffer = (char *) malloc ((size_t) aa.nlanes*26*TS*TS);
+  merror (aa.buffer, "ahd_interpolate()");
+  run_jobs (aa.nlanes, ahd_interpolate_lane, &aa);
+  free (aa.buffer);
+}
+#undef TS
+
+/*
+   Each median pass copies one colour to image[][3], then takes the
+   median of the nine colour-minus-green differences around every
+   pixel.  Lanes work down bands of rows, keeping the differences for
+   three rows in floats (which hold them exactly), so that four pixels
+   at a time can go through the selection network as min/max pairs.
+   The median is one of the nine inputs either way, so the result does
+   not depend on how it was found.
+ */
+struct median_args {
+  float *rows;
+  int c, nlanes;
+};
+
+void CLASS median_copy_band (void *arg, int band)
+{
+  struct median_args *ma = (struct median_args *) arg;
+  ushort (*pix)[4] = image + band*BAND*width;
+  ushort (*end)[4] = image + MIN((band+1)*BAND, height)*width;
+
+  for ( ; pix < end; pix++)
+    pix[0][3] = pix[0][ma->c];
+}
+
+void CLASS median_lane (void *arg, int lane)
+{
+  static const uchar opt[] =        /* Optimal 9-element median search */
+  { 1,2, 4,5, 7,8, 0,1, 3,4, 6,7, 1,2, 4,5, 7,8,
+    0,3, 5,8, 4,7, 3,6, 1,4, 2,5, 4,7, 4,2, 6,4, 4,2 };
+  struct median_args *ma = (struct median_args *) arg;
+  float *diff[3], *dp;
+  ushort (*pix)[4];
+  int band, row, top, bot, col, i, j, k, med[9];
+#if defined(__x86_64__) || defined(__i386__)
+  __m128 v[9], t;
+  float out[4];
+#elif defined(__aarch64__)
+  float32x4_t v[9], t;
+  float out[4];
+#endif
+
+  for (i=0; i < 3; i++)
+    diff[i] = ma->rows + (lane*3 + i) * width;
+  for (band=lane; band*BAND < height; band += ma->nlanes) {
+    top = MAX(1, band*BAND);
+    bot = MIN(height-1, (band+1)*BAND);
+    for (row = top-1; row < bot+1; row++) {
+      dp = diff[(row-top+1) % 3];
+      for (pix = image+row*width, col=0; col < width; col++)
+        dp[col] = pix[col][3] - pix[col][1];
+      if (row < top+1) continue;
+      pix = image + (row-1)*width;
+      col = 1;
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+      for ( ; col+4 < width; col+=4) {
+        for (k=i=0; i < 3; i++)
+          for (j = -1; j <= 1; j++, k++)
+#if defined(__aarch64__)
+            v[k] = vld1q_f32 (diff[(row-top-1+i) % 3] + col+j);
+#else
+            v[k] = _mm_loadu_ps (diff[(row-top-1+i) % 3] + col+j);
+#endif
+        for (i=0; i < sizeof opt; i+=2) {
+#if defined(__aarch64__)
+          t = vminq_f32 (v[opt[i]], v[opt[i+1]]);
+          v[opt[i+1]] = vmaxq_f32 (v[opt[i]], v[opt[i+1]]);
+#else
+          t = _mm_min_ps (v[opt[i]], v[opt[i+1]]);
+          v[opt[i+1]] = _mm_max_ps (v[opt[i]], v[opt[i+1]]);
+#endif
+          v[opt[i]] = t;
+        }
+#if defined(__aarch64__)
+        vst1q_f32 (out, v[4]);
+#else
+        _mm_storeu_ps (out, v[4]);
+#endif
+        for (k=0; k < 4; k++)
+          pix[col+k][ma->c] = CLIP((int) out[k] + pix[col+k][1]);
       }
-/*  Combine the most homogenous pixels for the final result:        */
-      for (row=top+3; row < top+TS-3 && row < height-5; row++) {
-        tr = row-top;
-        for (col=left+3; col < left+TS-3 && col < width-5; col++) {
-          tc = col-left;
-          for (d=0; d < 2; d++)
-            for (hm[d]=0, i=tr-1; i <= tr+1; i++)
-              for (j=tc-1; j <= tc+1; j++)
-                hm[d] += homo[d][i][j];
-          if (hm[0] != hm[1])
-            FORC3 image[row*width+col][c] = rgb[hm[1] > hm[0]][tr][tc][c];
-          else
-            FORC3 image[row*width+col][c] =
-                (rgb[0][tr][tc][c] + rgb[1][tr][tc][c]) >> 1;
-        }
+#endif
+      for ( ; col < width-1; col++) {
+        for (k=i=0; i < 3; i++)
+          for (j = -1; j <= 1; j++)
+            med[k++] = diff[(row-top-1+i) % 3][col+j];
+        for (i=0; i < sizeof opt; i+=2)
+          if     (med[opt[i]] > med[opt[i+1]])
+            SWAP (med[opt[i]] , med[opt[i+1]]);
+        pix[col][ma->c] = CLIP(med[4] + pix[col][1]);
       }
     }
-  free (buffer);
+  }
 }
-#undef TS
 
 void CLASS median_filter()
 {
-  ushort (*pix)[4];
-  int pass, c, i, j, k, med[9];
-  static const uchar opt[] =        /* Optimal 9-element median search */
-  { 1,2, 4,5, 7,8, 0,1, 3,4, 6,7, 1,2, 4,5, 7,8,
-    0,3, 5,8, 4,7, 3,6, 1,4, 2,5, 4,7, 4,2, 6,4, 4,2 };
+  struct median_args ma;
+  int pass;
 
+  ma.nlanes = MAX(1, MIN((height + BAND-1) / BAND, max_workers));
+  ma.rows = (float *) malloc (ma.nlanes * 3 * width * sizeof *ma.rows);
+  merror (ma.rows, "median_filter()");
   for (pass=1; pass <= med_passes; pass++) {
     if (verbose)
       fprintf (stderr,_("Median filter pass %d...\n"), pass);
-    for (c=0; c < 3; c+=2) {
-      for (pix = image; pix < image+width*height; pix++)
-        pix[0][3] = pix[0][c];
-      for (pix = image+width; pix < image+width*(height-1); pix++) {
-        if ((pix-image+1) % width < 2) continue;
-        for (k=0, i = -width; i <= width; i += width)
-          for (j = i-1; j <= i+1; j++)
-            med[k++] = pix[j][3] - pix[j][1];
-        for (i=0; i < sizeof opt; i+=2)
-          if     (med[opt[i]] > med[opt[i+1]])
-            SWAP (med[opt[i]] , med[opt[i+1]]);
-        pix[0][c] = CLIP(med[4] + pix[0][1]);
-      }
+    for (ma.c=0; ma.c < 3; ma.c+=2) {
+      run_jobs ((height + BAND-1) / BAND, median_copy_band, &ma);
+      run_jobs (ma.nlanes, median_lane, &ma);
     }
   }
+  free (ma.rows);
 }
 
 void CLASS blend_highlights()
@@ -4959,81 +6308,127 @@ void CLASS blend_highlights()
     }
 }
 
-#define SCALE (4 >> shrink)
-void CLASS recover_highlights()
+/*
+   The three stages below work on bands of map rows.  A spreading sweep
+   only fills cells that were empty, from neighbours that were already
+   set, so its new values go to "fill" and are merged once the sweep is
+   over; the rows of one sweep can then be done in any order.
+ */
+struct highlight_args {
+  float *map, *fill, grow;
+  int hsat[4], c, kc, scale;
+  unsigned high, wide;
+};
+
+void CLASS highlight_map_band (void *arg, int band)
 {
-  float *map, sum, wgt, grow;
-  int hsat[4], count, spread, change, val, i;
-  unsigned high, wide, mrow, mcol, row, col, kc, c, d, y, x;
+  struct highlight_args *ha = (struct highlight_args *) arg;
+  float sum, wgt;
+  int count, c = ha->c, kc = ha->kc, scale = ha->scale;
+  unsigned mrow, mcol, row, col;
   ushort *pixel;
+
+  for (mrow = band*BAND; mrow < (band+1)*BAND && mrow < ha->high; mrow++)
+    for (mcol=0; mcol < ha->wide; mcol++) {
+      sum = wgt = count = 0;
+      for (row = mrow*scale; row < (mrow+1)*scale; row++)
+        for (col = mcol*scale; col < (mcol+1)*scale; col++) {
+          pixel = image[row*width+col];
+          if (pixel[c] / ha->hsat[c] == 1 && pixel[kc] > 24000) {
+            sum += pixel[c];
+            wgt += pixel[kc];
+            count++;
+          }
+        }
+      if (count == scale*scale)
+        ha->map[mrow*ha->wide+mcol] = sum / wgt;
+    }
+}
+
+void CLASS highlight_spread_band (void *arg, int band)
+{
   static const signed char dir[8][2] =
     { {-1,-1}, {-1,0}, {-1,1}, {0,1}, {1,1}, {1,0}, {1,-1}, {0,-1} };
+  struct highlight_args *ha = (struct highlight_args *) arg;
+  float *map = ha->map, sum;
+  int count;
+  unsigned mrow, mcol, d, y, x;
+
+  for (mrow = band*BAND; mrow < (band+1)*BAND && mrow < ha->high; mrow++)
+    for (mcol=0; mcol < ha->wide; mcol++) {
+      if (map[mrow*ha->wide+mcol]) continue;
+      sum = count = 0;
+      for (d=0; d < 8; d++) {
+        y = mrow + dir[d][0];
+        x = mcol + dir[d][1];
+        if (y < ha->high && x < ha->wide && map[y*ha->wide+x] > 0) {
+          sum  += (1 + (d & 1)) * map[y*ha->wide+x];
+          count += 1 + (d & 1);
+        }
+      }
+      if (count > 3)
+        ha->fill[mrow*ha->wide+mcol] = (sum+ha->grow) / (count+ha->grow);
+    }
+}
 
-  if (verbose) fprintf (stderr,_("Rebuilding highlights...\n"));
+void CLASS highlight_apply_band (void *arg, int band)
+{
+  struct highlight_args *ha = (struct highlight_args *) arg;
+  int val, c = ha->c, kc = ha->kc, scale = ha->scale;
+  unsigned mrow, mcol, row, col;
+  ushort *pixel;
 
-  grow = pow (2, 4-highlight);
-  FORCC hsat[c] = 32000 * pre_mul[c];
-  for (kc=0, c=1; c < colors; c++)
-    if (pre_mul[kc] < pre_mul[c]) kc = c;
-  high = height / SCALE;
-  wide =  width / SCALE;
-  map = (float *) calloc (high, wide*sizeof *map);
-  merror (map, "recover_highlights()");
-  FORCC if (c != kc) {
-    memset (map, 0, high*wide*sizeof *map);
-    for (mrow=0; mrow < high; mrow++)
-      for (mcol=0; mcol < wide; mcol++) {
-        sum = wgt = count = 0;
-        for (row = mrow*SCALE; row < (mrow+1)*SCALE; row++)
-          for (col = mcol*SCALE; col < (mcol+1)*SCALE; col++) {
-            pixel = image[row*width+col];
-            if (pixel[c] / hsat[c] == 1 && pixel[kc] > 24000) {
-              sum += pixel[c];
-              wgt += pixel[kc];
-              count++;
-            }
-          }
-        if (count == SCALE*SCALE)
-          map[mrow*wide+mcol] = sum / wgt;
-      }
-    for (spread = 32/grow; spread--; ) {
-      for (mrow=0; mrow < high; mrow++)
-        for (mcol=0; mcol < wide; mcol++) {
-          if (map[mrow*wide+mcol]) continue;
-          sum = count = 0;
-          for (d=0; d < 8; d++) {
-            y = mrow + dir[d][0];
-            x = mcol + dir[d][1];
-            if (y < high && x < wide && map[y*wide+x] > 0) {
-              sum  += (1 + (d & 1)) * map[y*wide+x];
-              count += 1 + (d & 1);
-            }
+  for (mrow = band*BAND; mrow < (band+1)*BAND && mrow < ha->high; mrow++)
+    for (mcol=0; mcol < ha->wide; mcol++)
+      for (row = mrow*scale; row < (mrow+1)*scale; row++)
+        for (col = mcol*scale; col < (mcol+1)*scale; col++) {
+          pixel = image[row*width+col];
+          if (pixel[c] / ha->hsat[c] > 1) {
+            val = pixel[kc] * ha->map[mrow*ha->wide+mcol];
+            if (pixel[c] < val) pixel[c] = CLIP(val);
           }
-          if (count > 3)
-            map[mrow*wide+mcol] = - (sum+grow) / (count+grow);
         }
-      for (change=i=0; i < high*wide; i++)
-        if (map[i] < 0) {
-          map[i] = -map[i];
+}
+
+#define SCALE (4 >> shrink)
+void CLASS recover_highlights()
+{
+  struct highlight_args ha;
+  int spread, change, i, nbands;
+  unsigned c;
+
+  if (verbose) fprintf (stderr,_("Rebuilding highlights...\n"));
+
+  ha.grow = pow (2, 4-highlight);
+  FORCC ha.hsat[c] = 32000 * pre_mul[c];
+  for (ha.kc=0, c=1; c < colors; c++)
+    if (pre_mul[ha.kc] < pre_mul[c]) ha.kc = c;
+  ha.scale = SCALE;
+  ha.high = height / SCALE;
+  ha.wide =  width / SCALE;
+  nbands = (ha.high + BAND-1) / BAND;
+  ha.map = (float *) calloc (ha.high, 2*ha.wide*sizeof *ha.map);
+  merror (ha.map, "recover_highlights()");
+  ha.fill = ha.map + ha.high*ha.wide;
+  FORCC if (c != ha.kc) {
+    ha.c = c;
+    memset (ha.map, 0, ha.high*ha.wide*sizeof *ha.map);
+    run_jobs (nbands, highlight_map_band, &ha);
+    for (spread = 32/ha.grow; spread--; ) {
+      run_jobs (nbands, highlight_spread_band, &ha);
+      for (change=i=0; i < ha.high*ha.wide; i++)
+        if (ha.fill[i]) {
+          ha.map[i] = ha.fill[i];
+          ha.fill[i] = 0;
           change = 1;
         }
       if (!change) break;
     }
-    for (i=0; i < high*wide; i++)
-      if (map[i] == 0) map[i] = 1;
-    for (mrow=0; mrow < high; mrow++)
-      for (mcol=0; mcol < wide; mcol++) {
-        for (row = mrow*SCALE; row < (mrow+1)*SCALE; row++)
-          for (col = mcol*SCALE; col < (mcol+1)*SCALE; col++) {
-            pixel = image[row*width+col];
-            if (pixel[c] / hsat[c] > 1) {
-              val = pixel[kc] * map[mrow*wide+mcol];
-              if (pixel[c] < val) pixel[c] = CLIP(val);
-            }
-          }
-      }
+    for (i=0; i < ha.high*ha.wide; i++)
+      if (ha.map[i] == 0) ha.map[i] = 1;
+    run_jobs (nbands, highlight_apply_band, &ha);
   }
-  free (map);
+  free (ha.map);
 }
 #undef SCALE
 
@@ -5048,6 +6443,36 @@ void CLASS tiff_get (unsigned base,
     fseek (ifp, get4()+base, SEEK_SET);
 }
 
+/*
+   Remember every embedded JPEG we come across, not just the one
+   that ends up in thumb_offset, so that callers can choose the
+   smallest one that is big enough.
+ */
+void CLASS add_preview (off_t offset, unsigned length)
+{
+  unsigned i;
+
+  if (!offset || !length || npreviews >= DCRAW_MAX_PREVIEWS) return;
+  for (i=0; i < npreviews; i++)
+    if (previews[i].offset == offset) return;
+  previews[npreviews].offset = offset;
+  previews[npreviews].length = length;
+  previews[npreviews].width = previews[npreviews].height = 0;
+  previews[npreviews++].type = dc_jpeg;
+}
+
+/* for containers that give the size, so list_previews() needn't look */
+void CLASS add_sized_preview (off_t offset, unsigned length, ushort wide, ushort high)
+{
+  unsigned n = npreviews;
+
+  add_preview (offset, length);
+  if (npreviews > n) {
+    previews[n].width  = wide;
+    previews[n].height = high;
+  }
+}
+
 void CLASS parse_thumb_note (int base, unsigned toff, unsigned tlen)
 {
   unsigned entries, tag, type, len, save;
@@ -5059,6 +6484,7 @@ void CLASS parse_thumb_note (int base, unsigned toff, unsigned tlen)
     if (tag == tlen) thumb_length = get4();
     fseek (ifp, save, SEEK_SET);
   }
+  add_preview (thumb_offset, thumb_length);
 }
 
 int CLASS parse_tiff_ifd (int base);
@@ -5246,11 +6672,14 @@ nf: order = 0x4949;
         (tag == 0x280 && type == 1)) {
       thumb_offset = ftell(ifp);
       thumb_length = len;
+      add_preview (thumb_offset, thumb_length);
     }
     if (tag == 0x88 && type == 4 && (thumb_offset = get4()))
       thumb_offset += base;
-    if (tag == 0x89 && type == 4)
+    if (tag == 0x89 && type == 4) {
       thumb_length = get4();
+      add_preview (thumb_offset, thumb_length);
+    }
     if (tag == 0x8c || tag == 0x96)
       meta_offset = ftell(ifp);
     if (tag == 0x97) {
@@ -5493,6 +6922,7 @@ void CLASS parse_mos (int offset)
     if (!strcmp(data,"JPEG_preview_data")) {
       thumb_offset = from;
       thumb_length = skip;
+      add_preview (thumb_offset, thumb_length);
     }
     if (!strcmp(data,"icc_camera_profile")) {
       profile_offset = from;
@@ -5643,6 +7073,7 @@ int CLASS parse_tiff_ifd (int base)
         if (type != 7 || fgetc(ifp) != 0xff || fgetc(ifp) != 0xd8) break;
         thumb_offset = ftell(ifp) - 2;
         thumb_length = len;
+        add_preview (thumb_offset, thumb_length);
         break;
       case 61440:                        /* Fuji HS10 table */
         fseek (ifp, get4()+base, SEEK_SET);
@@ -6356,7 +7787,7 @@ void CLASS parse_external_jpeg()
       *jext = '0';
     }
   if (strcmp (jname, ifname)) {
-    if ((ifp = fopen (jname, "rb"))) {
+    if ((ifp = open_input (jname, 0))) {
       if (verbose)
         fprintf (stderr,_("Reading metadata from %s ...\n"), jname);
       parse_tiff (12);
@@ -6432,6 +7863,7 @@ void CLASS parse_ciff (int offset, int length, int depth)
     if (type == 0x2007) {
       thumb_offset = ftell(ifp);
       thumb_length = len;
+      add_preview (thumb_offset, thumb_length);
     }
     if (type == 0x1818) {
       shutter = pow (2, -int_to_float((get4(),get4())));
@@ -6746,10 +8178,18 @@ void CLASS parse_riff()
     fseek (ifp, size, SEEK_CUR);
 }
 
+/*
+   A CR3 carries three JPEGs: the 160x120 THMB in the moov uuid, the
+   ~1620-pixel PRVW in its own uuid after moov, and the full-size one
+   in track 1.  All three go on the preview list with their sizes.
+   When only metadata is wanted we stop after moov, whose CMT1 and
+   CMT2 boxes hold the TIFF and EXIF directories, and skip the tracks.
+ */
 void CLASS parse_crx (int end)
 {
-  unsigned i, save, size, tag, base;
-  static int index=0, wide, high, off, len;
+  unsigned i, save, size, tag, base, pw, ph;
+  static thread_local int index=0, wide, high, off, len;
+  int meta_only = !(wanted_fields & (DCRAW_SIZE | DCRAW_PREVIEWS | DCRAW_ORIENTATION));
 
   order = 0x4d4d;
   while (ftell(ifp)+7 < end) {
@@ -6757,7 +8197,11 @@ void CLASS parse_crx (int end)
     if ((size = get4()) < 8) break;
     switch (tag = get4()) {
       case 0x6d6f6f76:                                /* moov */
+        parse_crx (save+size);
+        if (meta_only) return;
+        break;
       case 0x7472616b:                                /* trak */
+        if (meta_only) break;
       case 0x6d646961:                                /* mdia */
       case 0x6d696e66:                                /* minf */
       case 0x7374626c:                                /* stbl */
@@ -6765,25 +8209,30 @@ void CLASS parse_crx (int end)
         break;
       case 0x75756964:                                /* uuid */
         switch (i=get4()) {
-          case 0xeaf42b5e:
-			if (get4() == 0x1C984B88 && get4() == 0xB9FBB7DC && get4() == 0x406E4D16) {
-				// ok this should extract a thumb from CR3 files
-				fseek(ifp, 22, SEEK_CUR);
-				thumb_width = get2();
-				thumb_height = get2();
-				fseek(ifp, 2, SEEK_CUR);
-				thumb_length = get4();
-				thumb_offset = save+24+32;
-				write_thumb = &CLASS jpeg_thumb;
-			} else {
-				fseek(ifp, 8, SEEK_CUR);
-				parse_crx(save+size);
-			}
-			break;
+          case 0xeaf42b5e:                        /* holds PRVW */
+            fseek (ifp, 20, SEEK_CUR);
+            parse_crx (save+size);
+            break;
           case 0x85c0b687: fseek (ifp, 12, SEEK_CUR);
             parse_crx (save+size);
         }
         break;
+      case 0x54484d42:                                /* THMB */
+        fseek (ifp, 4, SEEK_CUR);
+        pw = get2();
+        ph = get2();
+        add_sized_preview (save+24, get4(), pw, ph);
+        break;
+      case 0x50525657:                                /* PRVW */
+        fseek (ifp, 6, SEEK_CUR);
+        thumb_width  = get2();
+        thumb_height = get2();
+        fseek (ifp, 2, SEEK_CUR);
+        thumb_length = get4();
+        thumb_offset = save+24;
+        write_thumb = &CLASS jpeg_thumb;
+        add_sized_preview (thumb_offset, thumb_length, thumb_width, thumb_height);
+        break;
       case 0x434d5431:                                /* CMT1 */
       case 0x434d5432:                                /* CMT2 */
         base = ftell(ifp);
@@ -6811,6 +8260,7 @@ void CLASS parse_crx (int end)
             thumb_height = high;
             thumb_length = len;
             thumb_offset = off;
+            add_sized_preview (thumb_offset, thumb_length, wide, high);
             break;
           case 3:
             raw_width  = wide;
@@ -6819,8 +8269,6 @@ void CLASS parse_crx (int end)
             load_raw = &CLASS canon_crx_load_raw;
         }
         break;
-      case 0x50525657:                                /* PRVW */
-        fseek (ifp, 6, SEEK_CUR);
     }
     fseek (ifp, save+size, SEEK_SET);
   }
@@ -6999,6 +8447,7 @@ void CLASS parse_foveon()
           thumb_offset = off+28;
           thumb_length = len-28;
           write_thumb = &CLASS jpeg_thumb;
+          add_preview (thumb_offset, thumb_length);
         }
         if (++img == 2 && !thumb_length) {
           thumb_offset = off+24;
@@ -7048,13 +8497,12 @@ void CLASS parse_foveon()
 
 /*
    All matrices are from Adobe DNG Converter unless otherwise noted.
+   adobe_coeff() takes the first entry that prefixes "make model".
  */
-void CLASS adobe_coeff (const char *make, const char *model)
-{
-  static const struct {
-    const char *prefix;
-    short black, maximum, trans[12];
-  } table[] = {
+static const struct adobe_entry {
+  const char *prefix;
+  short black, maximum, trans[12];
+} adobe_table[] = {
     { "AgfaPhoto DC-833m", 0, 0,        /* DJC */
         { 11438,-3762,-1115,-2409,9914,2497,-1227,2295,5300 } },
     { "Apple QuickTake", 0, 0,                /* DJC */
@@ -8197,23 +9645,57 @@ void CLASS adobe_coeff (const char *make, const char *model)
         { 6344,-1612,-462,-4863,12477,2681,-865,1786,6899 } },
     { "YI M1", 0, 0,
         { 7712,-2059,-653,-3882,11494,2726,-710,1332,5958 } },
-  };
+};
+
+void CLASS adobe_coeff (const char *make, const char *model)
+{
+  /*
+     The prefixes sorted, duplicates dropped, each with a link to the
+     longest other prefix that begins it.  Every prefix of a name is on
+     the chain from the last prefix sorting at or before the name, so a
+     lookup is a binary search and a short walk.  Built by dcraw_init()
+     calling adobe_coeff (0, 0).
+   */
+  static short sorted[sizeof adobe_table / sizeof *adobe_table];
+  static short up[sizeof adobe_table / sizeof *adobe_table];
+  static int nsorted;
   double cam_xyz[4][3];
   char name[130];
-  int i, j;
-
+  int i, j, k, lo, hi;
+
+  if (!make) {
+    for (i=0; i < sizeof adobe_table / sizeof *adobe_table; i++) {
+      for (j=nsorted; j > 0 &&
+        strcmp (adobe_table[sorted[j-1]].prefix, adobe_table[i].prefix) > 0; j--);
+      if (j && !strcmp (adobe_table[sorted[j-1]].prefix, adobe_table[i].prefix)) continue;
+      memmove (sorted+j+1, sorted+j, (nsorted++ - j) * sizeof *sorted);
+      sorted[j] = i;
+    }
+    for (k=0; k < nsorted; k++)
+      for (up[k] = k-1; up[k] >= 0; up[k] = up[up[k]])
+        if (!strncmp (adobe_table[sorted[k]].prefix, adobe_table[sorted[up[k]]].prefix,
+                strlen(adobe_table[sorted[up[k]]].prefix))) break;
+    return;
+  }
   sprintf (name, "%s %s", make, model);
-  for (i=0; i < sizeof table / sizeof *table; i++)
-    if (!strncmp (name, table[i].prefix, strlen(table[i].prefix))) {
-      if (table[i].black)   black   = (ushort) table[i].black;
-      if (table[i].maximum) maximum = (ushort) table[i].maximum;
-      if (table[i].trans[0]) {
+  for (lo=0, hi=nsorted; lo < hi; )
+    if (strcmp (adobe_table[sorted[k = (lo+hi) >> 1]].prefix, name) > 0)
+      hi = k;
+    else lo = k+1;
+  for (k=lo-1; k >= 0; k = up[k])
+    if (!strncmp (name, adobe_table[sorted[k]].prefix,
+                strlen(adobe_table[sorted[k]].prefix))) break;
+  for (i=INT_MAX; k >= 0; k = up[k])
+    i = MIN (i, sorted[k]);
+  if (i < INT_MAX) {
+      if (adobe_table[i].black)   black   = (ushort) adobe_table[i].black;
+      if (adobe_table[i].maximum) maximum = (ushort) adobe_table[i].maximum;
+      if (adobe_table[i].trans[0]) {
         for (raw_color = j=0; j < 12; j++)
-          ((double *)cam_xyz)[j] = table[i].trans[j] / 10000.0;
+          ((double *)cam_xyz)[j] = adobe_table[i].trans[j] / 10000.0;
         cam_xyz_coeff (rgb_cam, cam_xyz);
       }
-      break;
-    }
+  }
 }
 
 void CLASS simple_coeff (int index)
@@ -8435,7 +9917,8 @@ void CLASS identify()
     { 0x16b, "ILCE-7M3" },   { 0x16c, "DSC-RX0" },
     { 0x16d, "DSC-RX10M4" },
   };
-  static const char *orig, panalias[][12] = {
+  static thread_local const char *orig;
+  static const char panalias[][12] = {
     "@DC-FZ80", "DC-FZ82", "DC-FZ85",
     "@DC-FZ81", "DC-FZ83",
     "@DC-GF9", "DC-GX800", "DC-GX850",
@@ -8584,6 +10067,7 @@ void CLASS identify()
   memset (white, 0, sizeof white);
   memset (mask, 0, sizeof mask);
   thumb_offset = thumb_length = thumb_width = thumb_height = 0;
+  npreviews = 0;
   load_raw = thumb_load_raw = 0;
   write_thumb = &CLASS jpeg_thumb;
   data_offset = meta_offset = meta_length = tiff_bps = tiff_compress = 0;
@@ -8599,7 +10083,8 @@ void CLASS identify()
     FORC3 rgb_cam[c][i] = c == i;
   }
   colors = 3;
-  for (i=0; i < 0x10000; i++) curve[i] = i;
+  if (wanted_fields & (DCRAW_SIZE | DCRAW_PREVIEWS | DCRAW_ORIENTATION))
+    for (i=0; i < 0x10000; i++) curve[i] = i;  /* only decoding reads it */
 
   order = get2();
   hlen = get4();
@@ -8647,6 +10132,7 @@ void CLASS identify()
     fseek (ifp, 84, SEEK_SET);
     thumb_offset = get4();
     thumb_length = get4();
+    add_preview (thumb_offset, thumb_length);
     fseek (ifp, 92, SEEK_SET);
     parse_fuji (get4());
     if (thumb_offset > 120) {
@@ -8813,6 +10299,8 @@ void CLASS identify()
     strcpy (model, model+15);
   desc[511] = artist[63] = make[63] = model[63] = model2[63] = 0;
   if (!is_raw) goto notraw;
+  if (!(wanted_fields & (DCRAW_SIZE | DCRAW_PREVIEWS | DCRAW_ORIENTATION)))
+    goto notraw;                        /* metadata only, skip the camera tables */
 
   if (!height) height = raw_height;
   if (!width)  width  = raw_width;
@@ -9642,11 +11130,92 @@ quit:
 }
 #endif
 
-void CLASS convert_to_rgb()
+/*
+   Lanes take every nlanes-th band and keep their own histogram.  The
+   matrix is applied one pixel per vector, adding the columns in the
+   same order as the scalar loop.
+ */
+struct rgb_args {
+  float cols[4][4];
+  int (*hist)[4][0x2000], nlanes, raw_color, document_mode;
+};
+
+void CLASS convert_to_rgb_row (struct rgb_args *ra, ushort (*img)[4], int row, int (*hist)[0x2000])
+{
+  int col, c;
+#if defined(__x86_64__) || defined(__i386__)
+  __m128 m0, m1, m2, m3, v, lo = _mm_setzero_ps(), hi = _mm_set1_ps(65535);
+  __m128i zero = _mm_setzero_si128();
+  int out[4];
+
+  m0 = _mm_loadu_ps (ra->cols[0]);
+  m1 = _mm_loadu_ps (ra->cols[1]);
+  m2 = _mm_loadu_ps (ra->cols[2]);
+  m3 = _mm_loadu_ps (ra->cols[3]);
+#elif defined(__aarch64__)
+  float32x4_t m0, m1, m2, m3, v, lo = vdupq_n_f32(0), hi = vdupq_n_f32(65535);
+  uint32_t out[4];
+
+  m0 = vld1q_f32 (ra->cols[0]);
+  m1 = vld1q_f32 (ra->cols[1]);
+  m2 = vld1q_f32 (ra->cols[2]);
+  m3 = vld1q_f32 (ra->cols[3]);
+#else
+  float out[3];
+#endif
+
+  for (col=0; col < width; col++, img++) {
+    if (!ra->raw_color) {
+#if defined(__x86_64__) || defined(__i386__)
+      v = _mm_cvtepi32_ps (_mm_unpacklo_epi16
+            (_mm_loadl_epi64 ((__m128i *) img), zero));
+      v = _mm_add_ps (_mm_add_ps (_mm_add_ps (
+            _mm_mul_ps (m0, _mm_shuffle_ps (v, v, 0x00)),
+            _mm_mul_ps (m1, _mm_shuffle_ps (v, v, 0x55))),
+            _mm_mul_ps (m2, _mm_shuffle_ps (v, v, 0xaa))),
+            _mm_mul_ps (m3, _mm_shuffle_ps (v, v, 0xff)));
+      v = _mm_min_ps (_mm_max_ps (v, lo), hi);
+      _mm_storeu_si128 ((__m128i *) out, _mm_cvttps_epi32 (v));
+#elif defined(__aarch64__)
+      v = vcvtq_f32_u32 (vmovl_u16 (vld1_u16 (*img)));
+      v = vaddq_f32 (vaddq_f32 (vaddq_f32 (
+            vmulq_laneq_f32 (m0, v, 0),
+            vmulq_laneq_f32 (m1, v, 1)),
+            vmulq_laneq_f32 (m2, v, 2)),
+            vmulq_laneq_f32 (m3, v, 3));
+      v = vminq_f32 (vmaxq_f32 (v, lo), hi);
+      vst1q_u32 (out, vcvtq_u32_f32 (v));
+#else
+      out[0] = out[1] = out[2] = 0;
+      FORCC {
+        out[0] += ra->cols[c][0] * img[0][c];
+        out[1] += ra->cols[c][1] * img[0][c];
+        out[2] += ra->cols[c][2] * img[0][c];
+      }
+      FORC3 out[c] = CLIP((int) out[c]);
+#endif
+      FORC3 img[0][c] = out[c];
+    }
+    else if (ra->document_mode)
+      img[0][0] = img[0][fcol(row,col)];
+    FORCC hist[c][img[0][c] >> 3]++;
+  }
+}
+
+void CLASS convert_to_rgb_lane (void *arg, int lane)
 {
-  int row, col, c, i, j, k;
-  ushort *img;
-  float out[3], out_cam[3][4];
+  struct rgb_args *ra = (struct rgb_args *) arg;
+  int row, band;
+
+  for (band=lane; band*BAND < height; band += ra->nlanes)
+    for (row=band*BAND; row < (band+1)*BAND && row < height; row++)
+      convert_to_rgb_row (ra, image + row*width, row, ra->hist[lane]);
+}
+
+void CLASS convert_to_rgb_setup (struct rgb_args *ra)
+{
+  int c, i, j, k;
+  float out_cam[3][4];
   double num, inverse[3][3];
   static const double xyzd50_srgb[3][3] =
   { { 0.436083, 0.385083, 0.143055 },
@@ -9696,7 +11265,7 @@ void CLASS convert_to_rgb()
   raw_color |= colors == 1 || document_mode ||
                 output_color < 1 || output_color > 6;
   if (!raw_color) {
-    oprof = (unsigned *) calloc (phead[0], 1);
+    oprof = (unsigned *) arena_calloc (ARENA_PROFILE, phead[0], 1);
     merror (oprof, "convert_to_rgb()");
     memcpy (oprof, phead, sizeof phead);
     if (output_color == 5) oprof[4] = oprof[5];
@@ -9731,23 +11300,32 @@ void CLASS convert_to_rgb()
   if (verbose)
     fprintf (stderr, raw_color ? _("Building histograms...\n") :
         _("Converting to %s colorspace...\n"), name[output_color-1]);
+  memset (ra->cols, 0, sizeof ra->cols);
+  for (c=0; c < colors; c++) {
+    ra->cols[c][0] = out_cam[0][c];
+    ra->cols[c][1] = out_cam[1][c];
+    ra->cols[c][2] = out_cam[2][c];
+  }
+  ra->raw_color = raw_color;
+  ra->document_mode = document_mode;
+}
 
+void CLASS convert_to_rgb()
+{
+  int c, i, j;
+  struct rgb_args ra;
+
+  convert_to_rgb_setup (&ra);
+  ra.nlanes = MAX(1, MIN((height + BAND-1) / BAND, max_workers));
+  ra.hist = (int (*)[4][0x2000]) calloc (ra.nlanes, sizeof *ra.hist);
+  merror (ra.hist, "convert_to_rgb()");
+  run_jobs (ra.nlanes, convert_to_rgb_lane, &ra);
   memset (histogram, 0, sizeof histogram);
-  for (img=image[0], row=0; row < height; row++)
-    for (col=0; col < width; col++, img+=4) {
-      if (!raw_color) {
-        out[0] = out[1] = out[2] = 0;
-        FORCC {
-          out[0] += out_cam[0][c] * img[c];
-          out[1] += out_cam[1][c] * img[c];
-          out[2] += out_cam[2][c] * img[c];
-        }
-        FORC3 img[c] = CLIP((int) out[c]);
-      }
-      else if (document_mode)
-        img[0] = img[fcol(row,col)];
-      FORCC histogram[c][img[c] >> 3]++;
-    }
+  for (i=0; i < ra.nlanes; i++)
+    for (c=0; c < 4; c++)
+      for (j=0; j < 0x2000; j++)
+        histogram[c][j] += ra.hist[i][c][j];
+  free (ra.hist);
   if (colors == 4 && output_color) colors = 3;
   if (document_mode && filters) colors = 1;
 }
@@ -9808,7 +11386,7 @@ void CLASS tiff_set (struct tiff_hdr *th, ushort *ntag,
 void CLASS tiff_head (struct tiff_hdr *th, int full)
 {
   int c, psize=0;
-  struct tm *t;
+  struct tm *t, tm;
 
   memset (th, 0, sizeof *th);
   th->order = htonl(0x4d4d4949) >> 16;
@@ -9824,7 +11402,7 @@ void CLASS tiff_head (struct tiff_hdr *th, int full)
   strncpy (th->make, make, 64);
   strncpy (th->model, model, 64);
   strcpy (th->soft, "dcraw v"DCRAW_VERSION);
-  t = localtime (&timestamp);
+  t = localtime_r (&timestamp, &tm);
   sprintf (th->date, "%04d:%02d:%02d %02d:%02d:%02d",
       t->tm_year+1900,t->tm_mon+1,t->tm_mday,t->tm_hour,t->tm_min,t->tm_sec);
   strncpy (th->artist, artist, 64);
@@ -9902,13 +11480,47 @@ void CLASS jpeg_thumb()
   free (thumb);
 }
 
-void CLASS write_ppm_tiff()
+/*
+   8-bit output goes through a byte table, a band of rows at a time.
+   With output_pixels set to 3 or 4, write_ppm_tiff() leaves RGB or
+   RGBA rows (grey repeated, alpha opaque) in rgb_data instead.
+ */
+struct ppm_args {
+  uchar *ppm, *lut;
+  size_t stride;
+  int soff, rstep, cstep, ncopy, nout;
+};
+
+void CLASS write_ppm_band (void *arg, int band)
 {
-  struct tiff_hdr th;
-  uchar *ppm;
-  ushort *ppm2;
-  int c, row, col, soff, rstep, cstep;
-  int perc, val, total, white=0x2000;
+  struct ppm_args *pa = (struct ppm_args *) arg;
+  uchar *lut = pa->lut, *out;
+  ushort *pix;
+  int row, col, c;
+
+  for (row=band*BAND; row < (band+1)*BAND && row < height; row++) {
+    out = pa->ppm + row * pa->stride;
+    pix = image[pa->soff + row*pa->rstep];
+    if (pa->ncopy == 3 && pa->nout == 3)
+      for (col=0; col < width; col++, pix += pa->cstep*4, out += 3) {
+        out[0] = lut[pix[0]];
+        out[1] = lut[pix[1]];
+        out[2] = lut[pix[2]];
+      }
+    else
+      for (col=0; col < width; col++, pix += pa->cstep*4, out += pa->nout) {
+        for (c=0; c < pa->ncopy; c++)
+          out[c] = lut[pix[c]];
+        for ( ; c < pa->nout; c++)
+          out[c] = c < 3 ? out[0] : 255;
+      }
+    memset (out, 0, pa->ppm + (row+1) * pa->stride - out);
+  }
+}
+
+int CLASS white_level()
+{
+  int c, perc, val, total, white=0x2000;
 
   perc = width * height * 0.01;                /* 99th percentile white level */
   if (fuji_width) perc /= 2;
@@ -9918,14 +11530,26 @@ void CLASS write_ppm_tiff()
         if ((total += histogram[c][val]) > perc) break;
       if (white < val) white = val;
     }
-  gamma_curve (gamm[0], gamm[1], 2, (white << 3)/bright);
+  return white;
+}
+
+void CLASS write_ppm_tiff()
+{
+  struct ppm_args pa;
+  struct tiff_hdr th;
+  uchar *ppm;
+  ushort *ppm2;
+  int c, row, col, soff, rstep, cstep, val;
+
+  gamma_curve (gamm[0], gamm[1], 2, (white_level() << 3)/bright);
   iheight = height;
   iwidth  = width;
   if (flip & 4) SWAP(height,width);
   ppm = (uchar *) calloc (width, colors*output_bps/8);
   ppm2 = (ushort *) ppm;
   merror (ppm, "write_ppm_tiff()");
-  if (output_tiff) {
+  if (output_pixels) ;
+  else if (output_tiff) {
     tiff_head (&th, 1);
     fwrite (&th, sizeof th, 1, ofp);
     if (oprof)
@@ -9940,6 +11564,35 @@ void CLASS write_ppm_tiff()
   soff  = flip_index (0, 0);
   cstep = flip_index (0, 1) - soff;
   rstep = flip_index (1, 0) - flip_index (0, width);
+  if (output_bps == 8 || output_pixels) {
+    free (ppm);
+    pa.ncopy = pa.nout = colors;
+    pa.stride = (size_t) width * colors;
+    if (output_pixels) {
+      pa.ncopy = MIN(colors, 3);
+      pa.nout = output_pixels;
+      pa.stride = ((size_t) width * output_pixels + 15) & -16;
+    }
+    ppm = (uchar *) malloc (height * pa.stride + 0x10000);
+    merror (ppm, "write_ppm_tiff()");
+    pa.ppm = ppm;
+    pa.lut = ppm + height * pa.stride;
+    for (val=0; val < 0x10000; val++)
+      pa.lut[val] = curve[val] >> 8;
+    pa.soff = soff;
+    pa.rstep = rstep + width*cstep;
+    pa.cstep = cstep;
+    run_jobs ((height + BAND-1) / BAND, write_ppm_band, &pa);
+    if (output_pixels) {
+      if (!(rgb_data = (uchar *) realloc (ppm, height * pa.stride)))
+        rgb_data = ppm;
+      rgb_stride = pa.stride;
+      return;
+    }
+    fwrite (ppm, colors, (size_t) height * width, ofp);
+    free (ppm);
+    return;
+  }
   for (row=0; row < height; row++, soff += rstep) {
     for (col=0; col < width; col++, soff += cstep)
       if (output_bps == 8)
@@ -9952,14 +11605,240 @@ void CLASS write_ppm_tiff()
   free (ppm);
 }
 
-char *ExtractThumbnailFromRawFile(const char *path, size_t *outSize, unsigned short *tw, unsigned short *th, enum dcraw_type *tType, unsigned short *rw, unsigned short *rh, unsigned short *orientation) {
+/*
+   A full-size render that never builds image[].  Each lane takes
+   every nlanes-th band, copies it and the rows on either side out of
+   raw_image, and scales, interpolates and converts it the way the
+   whole-image stages would, then writes it to wherever flip puts it
+   in rgb_data.  Auto-brightness needs the histogram of the whole
+   picture before anything is written, so then the bands are rendered
+   twice, the first time for the histogram alone.
+ */
+struct strip_args {
+  ushort (*strip)[4], *black;
+  uchar *ppm, *lut;
+  size_t stride;
+  float mul[4];
+  struct lin_args la;
+  struct rgb_args ra;
+  unsigned ofilters, flip;
+  int nlanes, nout, g0, gcol[8];
+};
+
+void CLASS render_strips_lane (void *arg, int lane)
+{
+  struct strip_args *sa = (struct strip_args *) arg;
+  ushort (*strip)[4] = sa->strip + (size_t) lane * (BAND+2) * width;
+  ushort (*img)[4], *bl = sa->black;
+  uchar *out;
+  int band, row, col, y0, y1, r, x, c, dark, val;
+
+  for (band=lane; band*BAND < height; band += sa->nlanes) {
+    y0 = MAX(band*BAND - 1, 0);
+    y1 = MIN((band+1)*BAND + 1, height);
+    for (row=y0; row < y1; row++)
+      for (img=strip + (row-y0)*width, col=0; col < width; col++) {
+        c = sa->ofilters ? sa->ofilters >> (((row << 1 & 14) + (col & 1)) << 1) & 3
+                         : fcol(row,col);
+        dark = bl[c];
+        if (bl[4] && bl[5])
+          dark += bl[6 + row % bl[4] * bl[5] + col % bl[5]];
+        val = (RAW(row+top_margin,col+left_margin) - dark) * sa->mul[c];
+        memset (img[col], 0, sizeof *img);
+        img[col][c] = CLIP(val);
+        if (sa->ofilters && !((row - sa->g0) & 1) && !((col - sa->gcol[row & 7]) & 1))
+          img[col][1] = img[col][3];
+      }
+    for (row=band*BAND; row < (band+1)*BAND && row < height; row++) {
+      img = strip + (row-y0)*width;
+      if (row == 0 || row == height-1)
+        for (col=0; col < width; col++)
+          border_pixel (strip, y0, row, col);
+      else {
+        border_pixel (strip, y0, row, 0);
+        border_pixel (strip, y0, row, width-1);
+        lin_interpolate_row (&sa->la, img, row);
+      }
+    }
+    /* only after the whole band is interpolated, since that reads the
+       raw colour of the neighbouring rows */
+    for (row=band*BAND; row < (band+1)*BAND && row < height; row++) {
+      img = strip + (row-y0)*width;
+      convert_to_rgb_row (&sa->ra, img, row, sa->ra.hist[lane]);
+      if (!sa->ppm) continue;
+      r = sa->flip & 2 ? height-1-row : row;
+      for (col=0; col < width; col++) {
+        x = sa->flip & 1 ? width-1-col : col;
+        out = sa->flip & 4 ? sa->ppm + x*sa->stride + r*sa->nout
+                           : sa->ppm + r*sa->stride + x*sa->nout;
+        FORC3 out[c] = sa->lut[img[col][c]];
+        for ( ; c < sa->nout; c++)
+          out[c] = 255;
+      }
+    }
+  }
+}
+
+/* whether render_strips() can stand in for the whole-image stages;
+   no_strips turns it off, so tests/strips_check.c can compare the two */
+int CLASS strips_ok()
+{
+  return !no_strips && output_pixels && raw_image && filters && colors == 3 && !mix_green &&
+        !shrink && !half_size && !four_color_rgb && !fuji_width &&
+        !is_foveon && !document_mode && !zero_is_bad &&
+        !threshold && aber[0] == 1 && aber[2] == 1 && !med_passes &&
+        highlight < 2 && !use_auto_wb && !(use_camera_wb && cam_mul[0] == -1) &&
+        load_raw != &CLASS canon_600_load_raw;
+}
+
+void CLASS render_strips()
+{
+  struct strip_args sa;
+  int code[16][16][32], greens, ow, oh, c, i, j;
+  size_t size;
+
+  scale_factors (sa.mul);
+  sa.black = cblack;
+  greens = filters > 1000 && colors == 3;
+  sa.ofilters = filters;
+  sa.g0 = FC(1,0) >> 1;
+  for (i=0; i < 8; i++)
+    sa.gcol[i] = FC(i,1) & 1;
+  pre_interpolate();
+  if (!greens) sa.ofilters = 0;
+  if (verbose) fprintf (stderr,_("Bilinear interpolation...\n"));
+  sa.la.code = code;
+  lin_interpolate_code (&sa.la);
+  convert_to_rgb_setup (&sa.ra);
+  sa.flip = flip;
+  sa.nlanes = MAX(1, MIN((height + BAND-1) / BAND, max_workers));
+  size = (size_t) sa.nlanes * (BAND+2) * width * sizeof *sa.strip;
+  sa.strip = (ushort (*)[4]) malloc (size + sa.nlanes * sizeof *sa.ra.hist);
+  merror (sa.strip, "render_strips()");
+  sa.ra.hist = (int (*)[4][0x2000]) ((char *) sa.strip + size);
+  memset (sa.ra.hist, 0, sa.nlanes * sizeof *sa.ra.hist);
+  sa.ppm = 0;
+  if (!((highlight & ~2) || no_auto_bright)) {
+    run_jobs (sa.nlanes, render_strips_lane, &sa);
+    memset (histogram, 0, sizeof histogram);
+    for (i=0; i < sa.nlanes; i++)
+      for (c=0; c < 4; c++)
+        for (j=0; j < 0x2000; j++)
+          histogram[c][j] += sa.ra.hist[i][c][j];
+  }
+  gamma_curve (gamm[0], gamm[1], 2, (white_level() << 3)/bright);
+  iheight = height;
+  iwidth  = width;
+  ow = flip & 4 ? height : width;
+  oh = flip & 4 ? width : height;
+  sa.nout = output_pixels;
+  sa.stride = ((size_t) ow * output_pixels + 15) & -16;
+  if (!(sa.ppm = (uchar *) malloc (oh * sa.stride + 0x10000)))
+    free (sa.strip);
+  merror (sa.ppm, "render_strips()");
+  sa.lut = sa.ppm + oh * sa.stride;
+  for (i=0; i < 0x10000; i++)
+    sa.lut[i] = curve[i] >> 8;
+  for (i=0; i < oh; i++)
+    memset (sa.ppm + i * sa.stride + ow * output_pixels, 0,
+        sa.stride - ow * output_pixels);
+  run_jobs (sa.nlanes, render_strips_lane, &sa);
+  free (sa.strip);
+  if (!(rgb_data = (uchar *) realloc (sa.ppm, oh * sa.stride)))
+    rgb_data = sa.ppm;
+  rgb_stride = sa.stride;
+  width  = ow;
+  height = oh;
+}
+
+void CLASS list_previews (struct dcraw_info *info)
+{
+  struct dcraw_preview *p;
+  struct jhead jh;
+  int i;
+
+  for (i=0; i < tiff_nifds; i++)
+    if ((tiff_ifd[i].comp == 6 || tiff_ifd[i].comp == 7) &&
+        tiff_ifd[i].samples == 3 && tiff_ifd[i].bps == 8 &&
+        tiff_ifd[i].offset != data_offset)
+      add_preview (tiff_ifd[i].offset, tiff_ifd[i].bytes);
+  info->npreviews = 0;
+  if (thumb_offset) {                /* identify()'s choice goes first */
+    p = &info->previews[info->npreviews++];
+    p->offset = thumb_offset;
+    p->length = thumb_length;
+    p->width  = thumb_width;
+    p->height = thumb_height;
+    p->type = thumb_load_raw || write_thumb != &CLASS jpeg_thumb ? dc_ppm : dc_jpeg;
+  }
+  for (i=0; i < npreviews && info->npreviews < DCRAW_MAX_PREVIEWS; i++) {
+    if (previews[i].offset == thumb_offset) continue;
+    p = &info->previews[info->npreviews];
+    *p = previews[i];
+    if (!p->width) {
+      fseeko (ifp, p->offset, SEEK_SET);
+      if (!ljpeg_start (&jh, 1) || jh.bits != 8) continue;
+      p->width  = jh.wide;
+      p->height = jh.high;
+    }
+    info->npreviews++;
+  }
+}
+
+// the cheapest JPEG preview whose longer side is at least targetSize, or failing that the biggest one;
+// returns -1 if there are no previews at all
+int SelectRawPreview(const struct dcraw_info *info, unsigned short targetSize) {
+	int i, best = -1, biggest = -1;
+	unsigned best_area = 0, biggest_area = 0;
+	for (i = 0; i < info->npreviews; ++i) {
+		const struct dcraw_preview *p = &info->previews[i];
+		if (p->type != dc_jpeg || !p->width || !p->height) continue;
+		unsigned area = (unsigned)p->width * p->height;
+		if (biggest == -1 || area > biggest_area)
+			biggest = i, biggest_area = area;
+		if ((p->width >= targetSize || p->height >= targetSize) &&
+			(best == -1 || area < best_area))
+			best = i, best_area = area;
+	}
+	if (best == -1) best = biggest;
+	if (best == -1 && info->npreviews) best = 0;
+	return best;
+}
+
+// turns the P5/P6 stream from one of the write_thumb functions into rows of output_pixels channels
+static char *pnm_to_rgb(char *pnm, size_t *len) {
+	int type, w, h, maxval, n = 0, row, col, c, nc;
+	uchar *in, *out;
+
+	rgb_data = 0;
+	if (sscanf(pnm, "P%d %d %d %d%n", &type, &w, &h, &maxval, &n) == 4 && n &&
+		(type == 5 || type == 6) && maxval == 255 && w > 0 && h > 0 &&
+		*len >= n + 1 + (size_t) w * h * (nc = type == 6 ? 3 : 1)) {
+		rgb_stride = ((size_t) w * output_pixels + 15) & -16;
+		if ((rgb_data = malloc(h * rgb_stride))) {
+			for (in = (uchar *) pnm + n + 1, row = 0; row < h; row++)
+				for (out = rgb_data + row * rgb_stride, col = 0; col < w; col++, in += nc, out += output_pixels)
+					for (c = 0; c < output_pixels; c++)
+						out[c] = c > 2 ? 255 : in[nc == 3 ? c : 0];
+			thumb_width = w;
+			thumb_height = h;
+			*len = h * rgb_stride;
+		}
+	}
+	free(pnm);
+	return (char *) rgb_data;
+}
+
+// full renders the sensor data at its own size and ignores any previews
+static char *decode_raw_file(const char *path, unsigned short targetSize, int full, int channels, size_t *outSize, size_t *stride, unsigned short *tw, unsigned short *th, enum dcraw_type *tType, unsigned short *rw, unsigned short *rh, unsigned short *orientation) {
 	int status = 1;
-	pthread_mutex_lock(&mutex);
 	raw_image = 0;
 	image = 0;
 	oprof = 0;
 	meta_data = 0;
+	arena_begin();
 	ofp = stdout;
+	output_pixels = channels == 3 || channels == 4 ? channels : 0;
 	if (setjmp(failure)) {
 		fclose(ifp);
 		if (fileno(ofp) > 2) fclose(ofp);
@@ -9967,15 +11846,32 @@ char *ExtractThumbnailFromRawFile(const char *path, size_t *outSize, unsigned sh
 		goto cleanup;
 	}
 	ifname = path;
-	if (!(ifp = fopen(ifname, "rb"))) {
+	if (!(ifp = open_input(ifname, &io_stats))) {
 		perror (ifname);
-		pthread_mutex_unlock(&mutex);
-		return 0;
+		goto cleanup;
 	}
+	half_size = 0;
 	identify();
+	if (thumb_offset && !full) {
+		struct dcraw_info info;
+		list_previews(&info);
+		int i = SelectRawPreview(&info, targetSize);
+		if (i > 0 && info.previews[i].type == dc_jpeg) {
+			thumb_offset = info.previews[i].offset;
+			thumb_length = info.previews[i].length;
+			thumb_width  = info.previews[i].width;
+			thumb_height = info.previews[i].height;
+			thumb_load_raw = 0;
+			write_thumb = &CLASS jpeg_thumb;
+		}
+	}
 	write_fun = &CLASS write_ppm_tiff;
-	if ((status = !thumb_offset)) {
-		goto next;
+	status = 0;
+	if (full) {
+		// demosaiced below, in strips if possible
+	} else if (!thumb_offset) {
+		// no embedded preview: bin the sensor data down instead of demosaicing it
+		half_size = 1;
 	} else if (thumb_load_raw) {
 		load_raw = thumb_load_raw;
 		data_offset = thumb_offset;
@@ -9993,23 +11889,28 @@ char *ExtractThumbnailFromRawFile(const char *path, size_t *outSize, unsigned sh
 		width  += width  & 1;
 	}
 	if (!is_raw) {
-next:
 		fclose(ifp);
-		pthread_mutex_unlock(&mutex);
-		return 0;
+		status = 1;
+		goto cleanup;
 	}
 	shrink = filters && (half_size || ((threshold || aber[0] != 1 || aber[2] != 1)));
-	iheight = (height + shrink) >> shrink;
-	iwidth  = (width  + shrink) >> shrink;
+	if (half_size && filters > 1000 && !fuji_width && targetSize)
+		while (shrink < 4 && MAX(width,height) >> (shrink+1) >= targetSize)
+			shrink++;
+	if (half_size && load_raw == &CLASS lossy_dng_load_raw && targetSize)
+		while (shrink < 3 && MAX(width,height) >> (shrink+1) >= targetSize)
+			shrink++; // libjpeg scales by 1/2, 1/4 or 1/8 while decoding
+	iheight = (height + (1 << shrink) - 1) >> shrink;
+	iwidth  = (width  + (1 << shrink) - 1) >> shrink;
 	if (meta_length) {
-	  meta_data = (char *) malloc (meta_length);
+	  meta_data = (char *) arena_calloc (ARENA_META, meta_length, 1);
 	  merror (meta_data, "main()");
 	}
 	if (filters || colors == 1) {
-	  raw_image = (ushort *) calloc ((raw_height+7), raw_width*2);
+	  raw_image = (ushort *) arena_calloc (ARENA_RAW, (raw_height+7), raw_width*2);
 	  merror (raw_image, "main()");
 	} else {
-	  image = (ushort (*)[4]) calloc (iheight, iwidth*sizeof *image);
+	  image = (ushort (*)[4]) arena_calloc (ARENA_IMAGE, iheight, iwidth*sizeof *image);
 	  merror (image, "main()");
 	}
 	fseeko (ifp, data_offset, SEEK_SET);
@@ -10019,13 +11920,18 @@ next:
 		height = raw_height;
 		width  = raw_width;
 	}
-	iheight = (height + shrink) >> shrink;
-	iwidth  = (width  + shrink) >> shrink;
-	if (raw_image) {
-		image = (ushort (*)[4]) calloc (iheight, iwidth*sizeof *image);
+	iheight = (height + (1 << shrink) - 1) >> shrink;
+	iwidth  = (width  + (1 << shrink) - 1) >> shrink;
+	if (full && strips_ok()) {
+		// raw_image stays until the strips are rendered; crop_masked_pixels only measures the black levels
+		write_fun = &CLASS render_strips;
+		crop_masked_pixels();
+	} else if (raw_image) {
+		image = (ushort (*)[4]) arena_calloc (ARENA_IMAGE, iheight, iwidth*sizeof *image);
 		merror (image, "main()");
 		crop_masked_pixels();
-		free (raw_image);
+		arena_free (raw_image);
+		raw_image = 0;
 	}
 	if (zero_is_bad) remove_zeroes();
 	int quality = 0, i = cblack[3], c;
@@ -10039,6 +11945,8 @@ next:
 		cblack[6+c] -= i;
 	black += i;
 	FORC4 cblack[c] += black;
+	if (write_fun == &CLASS render_strips)
+		goto thumbnail;
 	if (is_foveon) {
 		if (document_mode || load_raw == &CLASS foveon_dp_load_raw) {
 			for (i=0; i < height*width*4; i++)
@@ -10066,111 +11974,220 @@ next:
 	if (!is_foveon && highlight == 2) blend_highlights();
 	if (!is_foveon && highlight > 2) recover_highlights();
 	convert_to_rgb();
+	if (half_size) {
+		thumb_width  = flip & 4 ? height : width;
+		thumb_height = flip & 4 ? width : height;
+	}
 	char *data;
 thumbnail:
-	ofp = open_memstream(&data, outSize);
-	if (!ofp) {
-		status = 1;
-		goto cleanup;
+	if (output_pixels && (write_fun == &write_ppm_tiff || write_fun == &render_strips)) {
+		// straight from image[] (or raw_image) into the caller's buffer
+		(*write_fun)();
+		data = (char *) rgb_data;
+		*outSize = height * rgb_stride;
+		thumb_width = width;
+		thumb_height = height;
+	} else {
+		ofp = open_memstream(&data, outSize);
+		if (!ofp) {
+			status = 1;
+			goto cleanup;
+		}
+		(*write_fun)();
+		fclose(ofp);
+		if (output_pixels && write_fun != &jpeg_thumb && !(data = pnm_to_rgb(data, outSize))) {
+			fclose(ifp);
+			status = 1;
+			goto cleanup;
+		}
 	}
-	(*write_fun)();
 	*tw = thumb_width;
 	*th = thumb_height;
 	*rw = raw_width;
 	*rh = raw_height;
 	if (write_fun == &jpeg_thumb)
 		*tType = dc_jpeg;
-	else if (output_tiff && write_fun == &write_ppm_tiff)
+	else if (output_pixels) {
+		*tType = dc_rgb;
+		*stride = rgb_stride;
+	} else if (output_tiff && write_fun == &write_ppm_tiff)
 		*tType = dc_tiff;
 	else
 		*tType = dc_ppm;
 	*orientation = "12435867"[flip&7]-'0';
+	if (output_pixels && (write_fun == &write_ppm_tiff || write_fun == &render_strips))
+		*orientation = 1; // write_ppm_tiff has applied flip already
 	fclose(ifp);
-	fclose(ofp);
 cleanup:
-	free(meta_data);
-	free(oprof);
-	free(image);
-	pthread_mutex_unlock(&mutex);
+	arena_free(meta_data);
+	arena_free(oprof);
+	arena_free(image);
+	arena_free(raw_image);
+	arena_end();
 	if (status) return 0;
 	return data;
 }
 
-unsigned char *CopyExifDataFromRawFile(const char *path, int *outLen) {
-	pthread_mutex_lock(&mutex);
-	if (setjmp (failure)) {
+char *ExtractThumbnailFromRawFile(const char *path, unsigned short targetSize, size_t *outSize, unsigned short *tw, unsigned short *th, enum dcraw_type *tType, unsigned short *rw, unsigned short *rh, unsigned short *orientation) {
+	return decode_raw_file(path, targetSize, 0, 0, outSize, NULL, tw, th, tType, rw, rh, orientation);
+}
+
+char *DecodeThumbnailFromRawFile(const char *path, unsigned short targetSize, int channels, size_t *outSize, size_t *stride, unsigned short *tw, unsigned short *th, enum dcraw_type *tType, unsigned short *rw, unsigned short *rh, unsigned short *orientation) {
+	return decode_raw_file(path, targetSize, 0, channels, outSize, stride, tw, th, tType, rw, rh, orientation);
+}
+
+char *DecodeRawFile(const char *path, int channels, size_t *outSize, size_t *stride, unsigned short *w, unsigned short *h, unsigned short *rw, unsigned short *rh) {
+	enum dcraw_type type;
+	unsigned short orientation;
+	if (channels != 3 && channels != 4) return 0;
+	return decode_raw_file(path, 0, 1, channels, outSize, stride, w, h, &type, rw, rh, &orientation);
+}
+
+int ProbeRawFile(const char *path, unsigned wanted, struct dcraw_info *info) {
+	memset(info, 0, sizeof *info);
+	info->timestamp = -1;
+	info->exif_offset = -1;
+	if (setjmp(failure)) {
 	  fclose(ifp);
-	  pthread_mutex_unlock(&mutex);
+	  wanted_fields = DCRAW_ALL;
 	  return 0;
 	}
 	ifname = path;
-	if (!(ifp = fopen (ifname, "rb"))) {
-	  perror (ifname);
-	  pthread_mutex_unlock(&mutex);
+	if (!(ifp = open_input(ifname, &io_stats))) {
+	  perror(ifname);
 	  return 0;
 	}
 	// we assume that the timestamp lives inside the EXIF metadata,
 	// so we set exifBase and size at the same time timestamp gets set
 	exifBase = -1;
+	wanted_fields = wanted;
 	identify();
-	unsigned char *data = 0;
+	wanted_fields = DCRAW_ALL;
 	if (exifBase != -1) {
-		int dataSize = exifSize + 6;
-		fseek(ifp, exifBase, SEEK_SET);
-		if ((data = malloc(dataSize))) {
-			memcpy(data, "Exif\0\0", 6); // add this so we can pass it to exiftags
-			fread(data+6, 1, exifSize, ifp);
+		info->exif_offset = exifBase;
+		info->exif_length = exifSize;
+	}
+	if (!is_raw) {
+		fclose(ifp);
+		return 0;
+	}
+	info->timestamp = timestamp;
+	info->orientation = "12435867"[flip&7]-'0'; // convert internal "flip" value back to a exif orientation (the &7 is just to be paranoid about keeping the index within 0-7)
+	if (wanted & DCRAW_SIZE) {
+		info->raw_width = raw_width;
+		info->raw_height = raw_height;
+	}
+	if (wanted & DCRAW_PREVIEWS)
+		list_previews(info);
+	fclose(ifp);
+	return 1;
+}
+
+unsigned char *CopyExifDataFromRawFile(const char *path, const struct dcraw_info *info, int *outLen) {
+	if (info->exif_offset == -1 || info->exif_length <= 0) return 0;
+	FILE *f = fopen(path, "rb");
+	if (!f) return 0;
+	unsigned char *data = 0;
+	int dataSize = info->exif_length + 6;
+	if (fseek(f, info->exif_offset, SEEK_SET) == 0 && (data = malloc(dataSize))) {
+		memcpy(data, "Exif\0\0", 6); // add this so we can pass it to exiftags
+		if (fread(data+6, 1, info->exif_length, f) == info->exif_length) {
 			*outLen = dataSize;
+		} else {
+			free(data);
+			data = 0;
 		}
 	}
-	fclose(ifp);
-	pthread_mutex_unlock(&mutex);
+	fclose(f);
 	return data;
 }
 
-time_t ExifDateFromRawFile(const char *path) {
-	pthread_mutex_lock(&mutex);
-	if (setjmp (failure)) {
-	  fclose(ifp);
-	  pthread_mutex_unlock(&mutex);
-	  return -1;
+// map the preview straight from the file, so the only copy made is the
+// one the image decoder makes when it reads it
+const void *MapRawPreview(const char *path, const struct dcraw_preview *preview, int *mapped) {
+	if (preview->type != dc_jpeg || preview->length < 2) return 0;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return 0;
+	struct stat st;
+	if (fstat(fd, &st) || preview->offset < 0 || preview->offset + preview->length > st.st_size) {
+		close(fd); // touching a mapped page past EOF would crash us
+		return 0;
 	}
-	ifname = path;
-	if (!(ifp = fopen (ifname, "rb"))) {
-	  perror (ifname);
-	  pthread_mutex_unlock(&mutex);
-	  return -1;
+	uchar *bytes;
+	if ((*mapped = input_can_map(fd))) {
+		off_t delta = preview->offset % getpagesize();
+		void *base = mmap(0, preview->length + delta, PROT_READ, MAP_PRIVATE, fd, preview->offset - delta);
+		close(fd);
+		if (base == MAP_FAILED) return 0;
+		bytes = (uchar *)base + delta;
+	} else {
+		// Image I/O keeps reading the bytes after we return, and a mapping on a
+		// network volume or a card would take us down if it went away; copy the span
+		ssize_t got = 0, n;
+		if ((bytes = malloc(preview->length)))
+			while (got < preview->length &&
+				   (n = pread(fd, bytes + got, preview->length - got, preview->offset + got)) > 0)
+				got += n;
+		close(fd);
+		if (!bytes) return 0;
+		if (got < preview->length) {
+			free(bytes);
+			return 0;
+		}
 	}
-	identify();
-	fclose(ifp);
-	pthread_mutex_unlock(&mutex);
-	if (!is_raw) return -1;
-	return timestamp;
+	if (bytes[0] != 0xff || bytes[1] != 0xd8) {
+		UnmapRawPreview(bytes, preview, *mapped);
+		return 0;
+	}
+	return bytes;
 }
 
-unsigned short ExifOrientationFromRawFile(const char *path) {
-	pthread_mutex_lock(&mutex);
-	if (setjmp(failure)) {
-	  fclose(ifp);
-	  pthread_mutex_unlock(&mutex);
-	  return -1;
-	}
-	ifname = path;
-	if (!(ifp = fopen(ifname, "rb"))) {
-	  perror(ifname);
-	  pthread_mutex_unlock(&mutex);
-	  return -1;
+void UnmapRawPreview(const void *bytes, const struct dcraw_preview *preview, int mapped) {
+	if (!mapped) {
+		free((void *)bytes);
+		return;
 	}
-	identify();
-	unsigned short orientation = "12435867"[flip&7]-'0'; // convert internal "flip" value back to a exif orientation (the &7 is just to be paranoid about keeping the index within 0-7)
-	fclose(ifp);
-	pthread_mutex_unlock(&mutex);
-	if (!is_raw) return 0;
-	return orientation;
+	off_t delta = preview->offset % getpagesize();
+	munmap((uchar *)bytes - delta, preview->length + delta);
+}
+
+void GetRawInputStats(struct dcraw_io_stats *stats) {
+	*stats = io_stats;
+}
+
+void SetRawArena(int enabled, unsigned trimAfter) {
+	arena_on = enabled;
+	arena_idle = trimAfter;
+}
+
+void TrimRawArena(void) {
+	pthread_mutex_lock(&arena_lock);
+	for (struct arena *ar = arenas; ar; ar = ar->next)
+		if (!ar->busy) arena_release(ar);
+	pthread_mutex_unlock(&arena_lock);
+}
+
+void GetRawAllocStats(struct dcraw_alloc_stats *stats) {
+	*stats = alloc_stats;
+	stats->held_bytes = 0;
+	pthread_mutex_lock(&arena_lock); // another thread may be trimming our buffers
+	if (arena)
+		for (int i = 0; i < ARENA_SLOTS; i++)
+			stats->held_bytes += arena->buf[i].size;
+	pthread_mutex_unlock(&arena_lock);
 }
 
-// because of the global variables, calling functions in here is not thread safe
-// for now we'll just use a lock to make sure they run one at a time
+// all decoder state is thread_local, so the functions above may be called from
+// any number of threads at once; only the shared lookup tables need setting up
 void dcraw_init(void) {
-	pthread_mutex_init(&mutex, NULL);
+	cielab_init();
+	adobe_coeff(0, 0);
+	pthread_key_create(&arena_key, arena_exit);
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	max_workers = n > 1 ? (n < 16 ? n : 16) : 1;
+#if defined(__x86_64__) || defined(__i386__)
+	unpack_simd = __builtin_cpu_supports("ssse3");
+#elif defined(__aarch64__)
+	unpack_simd = 1;
+#endif
 }
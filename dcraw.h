@@ -1,10 +1,77 @@
 #ifndef _DCRAW_H_
 #define _DCRAW_H_
 #include <time.h>
-enum dcraw_type: char { dc_jpeg, dc_tiff, dc_ppm };
+#include <sys/types.h>
+enum dcraw_type: char { dc_jpeg, dc_tiff, dc_ppm, dc_rgb };
+
+// an embedded preview image. dc_jpeg previews can be read straight from the
+// file; anything else has to go through ExtractThumbnailFromRawFile.
+struct dcraw_preview {
+	off_t offset;
+	unsigned length;
+	unsigned short width, height;
+	enum dcraw_type type;
+};
+
+#define DCRAW_MAX_PREVIEWS 8
+// everything we want to know about a raw file, from a single pass over its headers
+struct dcraw_info {
+	time_t timestamp;           // -1 if none
+	unsigned short orientation; // EXIF orientation
+	unsigned short raw_width, raw_height;
+	int exif_offset, exif_length; // exif_offset is -1 if there is no EXIF block
+	unsigned short npreviews;
+	struct dcraw_preview previews[DCRAW_MAX_PREVIEWS];
+};
+
+// what ProbeRawFile should fill in. Every probe parses all of the file's headers, but asking for no more than the
+// timestamp and EXIF block skips the per-camera fix-ups: the orientation of a few cameras is set there, and so is
+// the final check that the file can be decoded, so then a nonzero result only means the headers look like a raw file.
+enum {
+	DCRAW_TIMESTAMP = 1,   // timestamp
+	DCRAW_ORIENTATION = 2, // orientation
+	DCRAW_EXIF = 4,        // exif_offset, exif_length
+	DCRAW_SIZE = 8,        // raw_width, raw_height
+	DCRAW_PREVIEWS = 16,   // npreviews, previews
+	DCRAW_ALL = 31
+};
+
+// how the last file this thread probed or decoded was read
+struct dcraw_io_stats {
+	unsigned long long bytes;      // bytes the decoder consumed
+	unsigned long long read_bytes; // bytes fetched from the file; 0 if it was mapped
+	unsigned reads;                // read calls made on the file
+	unsigned seeks;                // times the decoder moved to a new position
+	char mapped;
+};
+
+// allocations of the big decoder buffers (raw data, image, metadata, profile) on this thread
+struct dcraw_alloc_stats {
+	unsigned long long allocs, alloc_bytes; // fresh buffers and their total size
+	unsigned long long reuses;              // buffers handed out again by the arena
+	size_t held_bytes;                      // kept by the arena right now
+};
+
 void dcraw_init(void);
-time_t ExifDateFromRawFile(const char *path);
-unsigned char *CopyExifDataFromRawFile(const char *path, int *outLen);
-char *ExtractThumbnailFromRawFile(const char *path, size_t *outSize, unsigned short *tw, unsigned short *th, enum dcraw_type *tType, unsigned short *rw, unsigned short *rh, unsigned short *orientation);
-unsigned short ExifOrientationFromRawFile(const char *path);
+void GetRawInputStats(struct dcraw_io_stats *stats);
+// let each thread keep its decoder buffers between DecodeThumbnailFromRawFile calls; they are dropped when
+// the thread exits, or once it has been idle for trimAfter seconds and any thread starts decoding
+void SetRawArena(int enabled, unsigned trimAfter);
+void TrimRawArena(void); // drop the buffers of every thread that isn't decoding right now
+void GetRawAllocStats(struct dcraw_alloc_stats *stats);
+int ProbeRawFile(const char *path, unsigned wanted, struct dcraw_info *info); // returns 0 if not a raw file
+unsigned char *CopyExifDataFromRawFile(const char *path, const struct dcraw_info *info, int *outLen);
+// dc_jpeg previews only; returns preview->length read-only bytes, or NULL. They are mapped from files on internal
+// disks (*mapped is set) and read into a copy otherwise; pass *mapped back to UnmapRawPreview.
+const void *MapRawPreview(const char *path, const struct dcraw_preview *preview, int *mapped);
+void UnmapRawPreview(const void *bytes, const struct dcraw_preview *preview, int mapped);
+int SelectRawPreview(const struct dcraw_info *info, unsigned short targetSize); // index of the cheapest preview at least targetSize pixels on its longer side
+char *ExtractThumbnailFromRawFile(const char *path, unsigned short targetSize, size_t *outSize, unsigned short *tw, unsigned short *th, enum dcraw_type *tType, unsigned short *rw, unsigned short *rh, unsigned short *orientation);
+// same, but anything other than a JPEG preview comes back as dc_rgb: tw x th pixels of 8-bit RGB (channels 3) or RGBX
+// (channels 4, alpha opaque), rows *stride bytes apart, to be shown with *orientation. Free the result with free().
+char *DecodeThumbnailFromRawFile(const char *path, unsigned short targetSize, int channels, size_t *outSize, size_t *stride, unsigned short *tw, unsigned short *th, enum dcraw_type *tType, unsigned short *rw, unsigned short *rh, unsigned short *orientation);
+// demosaic the whole sensor into w x h pixels of 8-bit RGB/RGBX laid out as above, already turned upright. For ordinary
+// Bayer and X-Trans files this works a band of rows at a time, so it never holds more than the raw data, the result
+// and a few bands. Free the result with free().
+char *DecodeRawFile(const char *path, int channels, size_t *outSize, size_t *stride, unsigned short *w, unsigned short *h, unsigned short *rw, unsigned short *rh);
 #endif /* !_DCRAW_H_ */
@@ -8,20 +8,20 @@
 //  Created by Dominic Yu 2005 July 12
 
 #include "jpeglib.h"
+#include "dcraw.h"
+#include "DYImageProbe.h"
 @import Foundation;
 
-typedef NS_ENUM(char, DYExiftagsFileType) {
-	JPEG,
-	HEIF,
-};
-
 @interface DYExiftags : NSObject
 + (NSString *)tagsForFile:(NSString *)aPath moreTags:(BOOL)showMore;
 + (unsigned short)orientationForFile:(NSString *)aPath;
 + (NSImage *)exifThumbForPath:(NSString *)path;
 @end
 
-time_t ExifDatetimeForFile(const char *path, DYExiftagsFileType type);
+// Raw file headers are parsed once per session; the result is cached until the file changes.
+// wanted is a mask of DCRAW_* fields; a cached entry is reused if it covers them.
+// Returns NO if it's not a raw file we understand (outInfo may still have an EXIF block).
+BOOL RawInfoForFile(NSString *path, unsigned wanted, struct dcraw_info *outInfo);
 
 // after some false starts, i've decided the following are best here.
 // perhaps even better, we could make a pure C file with these instead.
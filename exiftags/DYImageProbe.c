@@ -0,0 +1,613 @@
+//Copyright 2005-2023 Dominic Yu. Some rights reserved.
+//This work is licensed under the Creative Commons
+//Attribution-NonCommercial-ShareAlike License. To view a copy of this
+//license, visit http://creativecommons.org/licenses/by-nc-sa/2.0/ or send
+//a letter to Creative Commons, 559 Nathan Abbott Way, Stanford,
+//California 94305, USA.
+
+#include "DYImageProbe.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "exifint.h"
+
+// The first read of a JPEG or HEIF file. It's big enough to hold the markers (or the ftyp and meta boxes)
+// and the Exif block of nearly every file. Anything past it is read into a window of its own, on demand.
+#define PROBE_HEAD 131072
+#define PROBE_WINDOW 16384
+#define PROBE_MAX_READ (4 << 20)
+
+// reads an n-byte big-endian number (n may be 0, as in iloc's size fields)
+static uint64_t readnm(const unsigned char *b, int n) {
+	uint64_t v = 0;
+	while (n--)
+		v = (v << 8) | *b++;
+	return v;
+}
+
+// len bytes at off, from the head or the window; if they're in neither, the window moves there.
+// The pointer is good until the next call. Returns NULL past the end of the file.
+static unsigned char *ProbeAt(ProbeBytes *pb, off_t off, size_t len)
+{
+	if (off < 0 || off > pb->size || len > (size_t)(pb->size - off)) return NULL;
+	if (off + len <= pb->headLen) return pb->head + off;
+	if (off >= pb->winOff && off + len <= pb->winOff + pb->winLen) return pb->win + (off - pb->winOff);
+	if (len > PROBE_MAX_READ) return NULL;
+	size_t want = len > PROBE_WINDOW ? len : PROBE_WINDOW;
+	if (want > (size_t)(pb->size - off)) want = pb->size - off;
+	pb->winLen = 0;
+	if (want > pb->winCap) {
+		unsigned char *w = realloc(pb->win, want);
+		if (!w) return NULL;
+		pb->win = w;
+		pb->winCap = want;
+	}
+	pb->syscalls++;
+	ssize_t got = pread(pb->fd, pb->win, want, off);
+	if (got < 0 || (size_t)got < len) return NULL;
+	pb->winOff = off;
+	pb->winLen = got;
+	return pb->win;
+}
+
+static bool ProbeJpeg(ProbeBytes *pb, DYImageProbe *p)
+{
+	unsigned char *b = ProbeAt(pb, 0, 2);
+	off_t pos = 2;
+	if (!b || b[0] != 0xff || b[1] != 0xD8) return false; // file starts with FFD8
+	// from here on, a short file just means we keep what we've found so far
+	for(;;){
+		int a, prev = 0, marker;
+		for (a=0;;a++){
+			if (!(b = ProbeAt(pb, pos++, 1))) return true; // Unexpected end of file
+			marker = *b;
+			if (marker != 0xff && prev == 0xff) break; // each marker is FFxx, where xx is the marker number
+			prev = marker;
+		}
+		if (a > 10)
+			return true; // Extraneous {a-1} padding bytes before section {marker}
+
+		// Read the length of the section (in big endian order)
+		if (!(b = ProbeAt(pb, pos, 2))) return true;
+		unsigned itemlen = (b[0] << 8) | b[1];
+		if (itemlen < 2) return true; // invalid marker
+		off_t seg = pos + 2;
+
+		switch(marker){
+			case 0xDA: // stop before hitting compressed data
+			case 0xD9: // End Of Image
+				return true;
+
+			case 0xE1: // Exif (or possibly XMP)
+				if (!p->exifOffset && itemlen >= 8 && (b = ProbeAt(pb, seg, 6)) && !memcmp(b, "Exif\0\0", 6)) {
+					p->exifOffset = seg;
+					p->exifLength = itemlen - 2;
+				}
+				break;
+
+			case 0xFE: // Comment; we only keep one that's in the head
+				if (!pb->comment && seg + itemlen - 2 <= pb->headLen) {
+					pb->comment = pb->head + seg;
+					pb->commentLen = itemlen - 2;
+				}
+				break;
+
+			case 0xC4: // DHT, JPG and DAC share the SOFn range
+			case 0xC8:
+			case 0xCC:
+				break;
+
+			default:
+				if (marker >= 0xC0 && marker <= 0xCF && !p->width && (b = ProbeAt(pb, seg, 5))) {
+					p->height = (b[1] << 8) | b[2];
+					p->width = (b[3] << 8) | b[4];
+					p->progressive = (marker & 3) == 2; // SOF2, 6, 10, 14
+				}
+				break;
+		}
+		pos += itemlen;
+	}
+}
+
+// where the meta box is, in memory and in the file, and what its iloc box needs to resolve an item
+typedef struct {
+	unsigned char *base;
+	off_t pos;
+	off_t idat;     // the idat box's data, for items with construction_method 1
+	uint64_t idatLen;
+	unsigned offsetSize, lengthSize, indexSize;
+} HeifMeta;
+
+// Resolves an iloc item's extents to spans of the file; b points at the first extent.
+// Returns how many there are, or 0 if they don't fit in out or point outside the file or idat.
+static unsigned HeifExtents(const HeifMeta *m, unsigned char *b, unsigned n, uint64_t base_offset, int method, DYExtent *out)
+{
+	if (!n || n > DY_MAX_EXTENTS) return 0;
+	for (unsigned k = 0; k < n; ++k) {
+		b += m->indexSize;
+		uint64_t off = base_offset + readnm(b, m->offsetSize);
+		uint64_t len = readnm(b + m->offsetSize, m->lengthSize);
+		b += m->offsetSize + m->lengthSize;
+		if (method == 1) { // offsets are into idat's data
+			if (!m->idat || off > m->idatLen || len > m->idatLen - off) return 0;
+			off += m->idat;
+		}
+		// a length of 0 means "the rest of the file", which no metadata or thumbnail should need
+		if (!len || len > PROBE_MAX_READ || off > INT64_MAX - len) return 0;
+		out[k].offset = off;
+		out[k].length = (unsigned)len;
+	}
+	return n;
+}
+
+// ipco's properties are numbered from 1
+static unsigned char *HeifProperty(unsigned char *ipco, unsigned index)
+{
+	unsigned char *end = ipco + readnm(ipco, 4), *b = ipco + 8;
+	if (!index) return NULL;
+	while (end - b >= 8) {
+		uint32_t len = (uint32_t)readnm(b, 4);
+		if (len < 8 || len > end - b) return NULL;
+		if (!--index) return b;
+		b += len;
+	}
+	return NULL;
+}
+
+static bool ProbeHeif(ProbeBytes *pb, DYImageProbe *p)
+{
+	// heif files are composed of "atoms" aka "boxes"
+	unsigned char *b = ProbeAt(pb, 0, 8);
+	off_t pos = 0;
+	uint64_t boxLen;
+	unsigned hdrLen;
+	// as a sanity check, make sure the first atom is 'ftyp'
+	if (!b || memcmp(b+4, "ftyp", 4)) return false;
+	for (;;) {
+		if (!(b = ProbeAt(pb, pos, 8))) return true;
+		boxLen = readnm(b, 4); // each atom starts with a 4-byte length
+		hdrLen = 8;
+		if (boxLen == 1) { // length==1 means an 8-byte length follows the type
+			if (!(b = ProbeAt(pb, pos, 16))) return true;
+			boxLen = readnm(b+8, 8);
+			hdrLen = 16;
+		}
+		if (boxLen < hdrLen || boxLen > INT64_MAX - pos) return true;
+		if (!memcmp(b+4, "meta", 4)) break;
+		pos += boxLen; // skip to next atom
+	}
+	// found "meta" atom; look at its children in order, whichever order they're stored in
+	if (boxLen > PROBE_MAX_READ || !(b = ProbeAt(pb, pos, boxLen))) return true;
+	HeifMeta m = {.base = b, .pos = pos};
+	unsigned char *metaEnd = b + boxLen;
+	unsigned char *pitm = NULL, *iinf = NULL, *iloc = NULL, *iref = NULL, *iprp = NULL;
+	b += hdrLen + 4; // skip vers/flag
+	while (metaEnd - b >= 12) {
+		uint32_t len = (uint32_t)readnm(b, 4);
+		if (len < 12 || len > metaEnd - b) return true;
+		if (!memcmp(b+4, "pitm", 4)) pitm = b;
+		else if (!memcmp(b+4, "iinf", 4)) iinf = b;
+		else if (!memcmp(b+4, "iloc", 4)) iloc = b;
+		else if (!memcmp(b+4, "iref", 4)) iref = b;
+		else if (!memcmp(b+4, "iprp", 4)) iprp = b;
+		else if (!memcmp(b+4, "idat", 4)) {
+			m.idat = pos + (b - m.base) + 8;
+			m.idatLen = len - 8;
+		}
+		b += len;
+	}
+	if (!iinf || !iloc) return true;
+
+	// the primary image, and the thumbnail that refers to it
+	uint32_t primaryID = UINT32_MAX, thumbID = UINT32_MAX;
+	unsigned char *boxEnd;
+	int version;
+	unsigned idSize;
+	if (pitm && readnm(pitm, 4) >= 12 + (pitm[8] ? 4 : 2))
+		primaryID = (uint32_t)readnm(pitm+12, pitm[8] ? 4 : 2);
+	if (iref && primaryID != UINT32_MAX) {
+		boxEnd = iref + readnm(iref, 4);
+		idSize = iref[8] ? 4 : 2;
+		for (b = iref + 12; boxEnd - b >= 8 + idSize + 2 && thumbID == UINT32_MAX; ) {
+			uint32_t len = (uint32_t)readnm(b, 4);
+			if (len < 8 + idSize + 2 || len > boxEnd - b) break;
+			uint16_t count = readnm(b + 8 + idSize, 2);
+			if (!memcmp(b+4, "thmb", 4) && len >= 8 + idSize + 2 + count*idSize) {
+				for (unsigned k = 0; k < count; ++k)
+					if (readnm(b + 8 + idSize + 2 + k*idSize, idSize) == primaryID)
+						thumbID = (uint32_t)readnm(b+8, idSize); // from_item_ID
+			}
+			b += len;
+		}
+	}
+
+	uint32_t exifID = UINT32_MAX;
+	boxEnd = iinf + readnm(iinf, 4);
+	version = iinf[8];
+	b = iinf + 12; // skip flag
+	if (boxEnd - b < 4) return true;
+	uint32_t n = version ? (uint32_t)readnm(b, 4) : (uint32_t)readnm(b, 2);
+	b += version ? 4 : 2;
+	for (uint32_t i = 0; i < n && boxEnd - b >= 16; ++i) {
+		uint32_t eLen = (uint32_t)readnm(b, 4);
+		if (eLen < 16 || eLen > boxEnd - b) break; // must have at least size, type "infe", flag, and data
+		version = b[8]; // assume "infe"
+		idSize = version <= 2 ? 2 : 4;
+		uint32_t itemID = (uint32_t)readnm(b+12, idSize);
+		unsigned char *type = b + 12 + idSize + 2; // skip protection_index
+		if (type + 4 <= b + eLen) {
+			if (!memcmp(type, "Exif", 4))
+				exifID = itemID;
+			else if (itemID == thumbID)
+				memcpy(p->heifThumbType, type, 4);
+		}
+		b += eLen;
+	}
+
+	boxEnd = iloc + readnm(iloc, 4);
+	version = iloc[8];
+	b = iloc + 12;
+	if (boxEnd - b < 6) return true;
+	uint16_t config = readnm(b, 2);
+	m.offsetSize = (config >> 12) & 0xF;
+	m.lengthSize = (config >> 8) & 0xF;
+	unsigned base_offset_size = (config >> 4) & 0xF;
+	m.indexSize = version >= 1 ? config & 0xF : 0;
+	idSize = version < 2 ? 2 : 4;
+	n = (uint32_t)readnm(b+2, idSize);
+	b += 2 + idSize;
+	if (n > 20000) return true; // this value copied from libheif
+	DYExtent exif[DY_MAX_EXTENTS];
+	unsigned exifExtents = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		if (boxEnd - b < idSize + (version >= 1 ? 2 : 0) + 2 + base_offset_size + 2) return true;
+		uint32_t myId = (uint32_t)readnm(b, idSize);
+		b += idSize;
+		int method = 0;
+		if (version >= 1) {
+			method = b[1] & 0xF; // construction_method
+			b += 2;
+		}
+		uint16_t dataRef = readnm(b, 2);
+		b += 2;
+		uint64_t base_offset = readnm(b, base_offset_size);
+		b += base_offset_size;
+		unsigned numExtents = (unsigned)readnm(b, 2);
+		b += 2;
+		if (numExtents > 32) return true;
+		unsigned extentSize = m.indexSize + m.offsetSize + m.lengthSize;
+		if (boxEnd - b < numExtents*extentSize) return true;
+		// only items stored in this file, either in mdat or in idat
+		if (!dataRef && method <= 1) {
+			if (myId == exifID)
+				exifExtents = HeifExtents(&m, b, numExtents, base_offset, method, exif);
+			else if (myId == thumbID)
+				p->heifThumbExtentCount = HeifExtents(&m, b, numExtents, base_offset, method, p->heifThumbExtents);
+		}
+		b += numExtents*extentSize;
+	}
+
+	// the thumbnail's size and decoder configuration, and the primary image's size
+	unsigned char *ipco = NULL, *ipma = NULL;
+	if (iprp) {
+		boxEnd = iprp + readnm(iprp, 4);
+		for (b = iprp + 8; boxEnd - b >= 8; ) {
+			uint32_t len = (uint32_t)readnm(b, 4);
+			if (len < 8 || len > boxEnd - b) break;
+			if (!memcmp(b+4, "ipco", 4)) ipco = b;
+			else if (!memcmp(b+4, "ipma", 4) && len >= 16) ipma = b;
+			b += len;
+		}
+	}
+	if (ipco && ipma) {
+		boxEnd = ipma + readnm(ipma, 4);
+		version = ipma[8];
+		idSize = version < 1 ? 2 : 4;
+		unsigned assocSize = ipma[11] & 1 ? 2 : 1; // flags
+		n = (uint32_t)readnm(ipma+12, 4);
+		b = ipma + 16;
+		for (uint32_t i = 0; i < n && boxEnd - b >= idSize + 1; ++i) {
+			uint32_t itemID = (uint32_t)readnm(b, idSize);
+			unsigned count = b[idSize];
+			b += idSize + 1;
+			if (boxEnd - b < count*assocSize) break;
+			for (; count; --count, b += assocSize) {
+				if (itemID != primaryID && itemID != thumbID) continue;
+				// the high bit says whether the property is essential
+				unsigned index = assocSize == 2 ? readnm(b, 2) & 0x7FFF : b[0] & 0x7F;
+				unsigned char *prop = HeifProperty(ipco, index);
+				if (!prop) continue;
+				if (!memcmp(prop+4, "ispe", 4) && readnm(prop, 4) >= 20) {
+					uint32_t w = (uint32_t)readnm(prop+12, 4), h = (uint32_t)readnm(prop+16, 4);
+					if (itemID == primaryID) {
+						p->width = w;
+						p->height = h;
+					} else {
+						p->heifThumbWidth = w;
+						p->heifThumbHeight = h;
+					}
+				} else if (itemID == thumbID && (!memcmp(prop+4, "hvcC", 4) || !memcmp(prop+4, "av1C", 4))) {
+					p->heifThumbConfig.offset = m.pos + (prop - m.base);
+					p->heifThumbConfig.length = (unsigned)readnm(prop, 4);
+				}
+			}
+		}
+	}
+
+	// Exif blocks are read in one piece, so their extents must follow one another
+	if (!exifExtents) return true;
+	for (unsigned k = 1; k < exifExtents; ++k) {
+		if (exif[k].offset != exif[0].offset + exif[0].length) return true;
+		exif[0].length += exif[k].length;
+	}
+	// the item starts with a 4-byte offset to the TIFF header, which we expect right after "Exif\0\0"
+	if (exif[0].length < 4 + 16 || exif[0].length - 4 > PROBE_MAX_READ) return true;
+	p->exifOffset = exif[0].offset + 4;
+	p->exifLength = exif[0].length - 4;
+	return true;
+}
+
+// the entries of the IFD at off, or NULL if it doesn't fit in the TIFF block
+static unsigned char *ProbeIFD(unsigned char *b0, unsigned len, uint32_t off, enum byteorder o, unsigned *n)
+{
+	if (off < 8 || off > len - 2) return NULL;
+	*n = exif2byte(b0 + off, o);
+	if ((len - off - 2) / 12 < *n) return NULL;
+	return b0 + off + 2;
+}
+
+// DateTimeOriginal, orientation and the thumbnail span, from IFD0, the Exif SubIFD and IFD1
+static bool ProbeExif(unsigned char *e, DYImageProbe *p)
+{
+	enum byteorder o;
+	uint32_t ifd0 = bytesTo0thIFD(e, p->exifLength, &o);
+	if (!ifd0) return false;
+	unsigned char *b0 = e + 6, *b; // save beginning for offsets
+	unsigned len = p->exifLength - 6, n;
+	if (!(b = ProbeIFD(b0, len, ifd0, o, &n))) return false;
+	uint32_t subIFD = 0, ifd1 = 0;
+	if (len - (b - b0) - 12*n >= 4)
+		ifd1 = exif4byte(b + 12*n, o); // offset of next IFD; non-standard EXIF may not have one
+	while (n--) {
+		switch (exif2byte(b,o)) {
+			case 0x0112: // orientation
+				p->orientation = exif2byte(b+8,o);
+				break;
+			case 0x8769: // offset to Exif SubIFD
+				subIFD = exif4byte(b+8,o);
+				break;
+		}
+		b += 12;
+	}
+	if ((b = ProbeIFD(b0, len, subIFD, o, &n))) {
+		while (n--) {
+			uint32_t off;
+			if (exif2byte(b,o) == 0x9003 && len >= 20 && (off = exif4byte(b+8,o)) <= len - 20) { // DateTimeOriginal
+				char s[20];
+				memcpy(s, b0 + off, 19);
+				s[19] = 0; // make sure string is null-terminated before passing to sscanf
+				struct tm t;
+				if (sscanf(s, "%d:%d:%d %d:%d:%d", &t.tm_year, &t.tm_mon,
+						   &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec) == 6) {
+					t.tm_year -= 1900;
+					t.tm_mon -= 1;
+					t.tm_isdst = -1;
+					p->datetime = mktime(&t);
+				}
+				break;
+			}
+			b += 12;
+		}
+	}
+	if ((b = ProbeIFD(b0, len, ifd1, o, &n))) {
+		uint32_t thumbStart = 0, thumbLength = 0;
+		while (n--) {
+			switch (exif2byte(b,o)) {
+				case 0x0103:
+					if (exif2byte(b+8,o) != 6)
+						return true; // not a JPEG thumb, we're done.
+					break;
+				case 0x0201:
+					thumbStart = exif4byte(b+8,o);
+					break;
+				case 0x0202:
+					thumbLength = exif4byte(b+8,o);
+					break;
+			}
+			b += 12;
+		}
+		// sanity check on thumbLength, a 160x120 jpeg should take no more than 8.25 bits/pixel
+		if (thumbStart && thumbLength && thumbLength <= 32000 && thumbLength <= len && thumbStart <= len - thumbLength) {
+			p->thumbOffset = p->exifOffset + 6 + thumbStart;
+			p->thumbLength = thumbLength;
+		}
+	}
+	return true;
+}
+
+bool ProbeFile(const char *path, DYExiftagsFileType type, DYImageProbe *p, ProbeBytes *pb)
+{
+	memset(p, 0, sizeof *p);
+	memset(pb, 0, sizeof *pb);
+	p->datetime = -1;
+	pb->syscalls = 1;
+	if ((pb->fd = open(path, O_RDONLY)) == -1) {
+		p->syscalls = pb->syscalls;
+		return false;
+	}
+	bool ok = false;
+	struct stat st;
+	pb->syscalls++;
+	if (!fstat(pb->fd, &st) && st.st_size > 0) {
+		pb->size = st.st_size;
+		size_t want = st.st_size < PROBE_HEAD ? (size_t)st.st_size : PROBE_HEAD;
+		ssize_t got;
+		if ((pb->head = malloc(want))) {
+			pb->syscalls++;
+			if ((got = pread(pb->fd, pb->head, want, 0)) > 0) {
+				pb->headLen = got;
+				ok = type == HEIF ? ProbeHeif(pb, p) : ProbeJpeg(pb, p);
+			}
+		}
+	}
+	// the Exif block is usually in the head; if not, this is the window's last move
+	if (ok && p->exifOffset)
+		pb->exif = ProbeAt(pb, p->exifOffset, p->exifLength);
+	close(pb->fd);
+	pb->syscalls++;
+	p->syscalls = pb->syscalls;
+	if (!pb->exif || !ProbeExif(pb->exif, p)) {
+		pb->exif = NULL;
+		p->exifOffset = 0;
+		p->exifLength = 0;
+	}
+	return ok;
+}
+
+void ProbeBytesFree(ProbeBytes *pb) {
+	free(pb->head);
+	free(pb->win);
+}
+
+bool ProbeImageFile(const char *path, DYExiftagsFileType type, DYImageProbe *outProbe) {
+	ProbeBytes pb;
+	bool ok = ProbeFile(path, type, outProbe, &pb);
+	ProbeBytesFree(&pb);
+	return ok;
+}
+
+time_t ExifDatetimeForFile(const char *path, DYExiftagsFileType type) {
+	DYImageProbe p;
+	ProbeImageFile(path, type, &p);
+	return p.datetime;
+}
+
+static unsigned char *put2m(unsigned char *b, uint16_t n) {
+	b[0] = n >> 8;
+	b[1] = n;
+	return b + 2;
+}
+static unsigned char *put4m(unsigned char *b, uint32_t n) {
+	b[0] = n >> 24;
+	b[1] = n >> 16;
+	b[2] = n >> 8;
+	b[3] = n;
+	return b + 4;
+}
+// a box header; version < 0 for a plain box, otherwise a full box with no flags
+static unsigned char *putbox(unsigned char *b, uint32_t len, const char *type, int version) {
+	b = put4m(b, len);
+	memcpy(b, type, 4);
+	b += 4;
+	if (version >= 0)
+		b = put4m(b, version << 24);
+	return b;
+}
+
+unsigned char *CopyHeifThumbnail(const char *path, const DYImageProbe *p, size_t *outLen) {
+	if (!p->heifThumbExtentCount) return NULL;
+	bool isJpeg = !memcmp(p->heifThumbType, "jpeg", 4), isAV1 = !memcmp(p->heifThumbType, "av01", 4);
+	if (!isJpeg && !isAV1 && memcmp(p->heifThumbType, "hvc1", 4)) return NULL;
+	// coded images need their decoder configuration and size to stand on their own
+	unsigned cfgLen = p->heifThumbConfig.length;
+	if (!isJpeg && (cfgLen < 8 || cfgLen > 65536 || !p->heifThumbWidth || !p->heifThumbHeight)) return NULL;
+
+	size_t payload = 0;
+	for (unsigned k = 0; k < p->heifThumbExtentCount; ++k)
+		payload += p->heifThumbExtents[k].length;
+	// ftyp, meta (hdlr, pitm, iinf, iloc, iprp), and mdat's header
+	unsigned iprpLen = 8 + (8 + cfgLen + 20) + 21;
+	unsigned metaLen = 12 + 33 + 14 + 35 + 30 + iprpLen;
+	size_t hdrLen = isJpeg ? 0 : 24 + metaLen + 8;
+	unsigned char *out = malloc(hdrLen + payload), *b = out;
+	if (!out) return NULL;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		free(out);
+		return NULL;
+	}
+	bool ok = true;
+	if (!isJpeg) {
+		const char *brand = isAV1 ? "avif" : "heic";
+		b = putbox(b, 24, "ftyp", -1);
+		memcpy(b, brand, 4);
+		b = put4m(b+4, 0);
+		memcpy(b, "mif1", 4);
+		memcpy(b+4, brand, 4);
+		b += 8;
+		b = putbox(b, metaLen, "meta", 0);
+		b = putbox(b, 33, "hdlr", 0);
+		b = put4m(b, 0); // pre_defined
+		memcpy(b, "pict", 4);
+		memset(b+4, 0, 13); // reserved, and an empty name
+		b += 17;
+		b = putbox(b, 14, "pitm", 0);
+		b = put2m(b, 1);
+		b = putbox(b, 35, "iinf", 0);
+		b = put2m(b, 1);
+		b = putbox(b, 21, "infe", 2);
+		b = put2m(b, 1); // item_ID
+		b = put2m(b, 0); // protection_index
+		memcpy(b, p->heifThumbType, 4);
+		b[4] = 0; // item_name
+		b += 5;
+		b = putbox(b, 30, "iloc", 0);
+		*b++ = 0x44; // 4-byte offsets and lengths
+		*b++ = 0;    // no base offset
+		b = put2m(b, 1); // item_count
+		b = put2m(b, 1); // item_ID
+		b = put2m(b, 0); // data_reference_index
+		b = put2m(b, 1); // extent_count
+		b = put4m(b, (uint32_t)hdrLen); // the data follows mdat's header
+		b = put4m(b, (uint32_t)payload);
+		b = putbox(b, iprpLen, "iprp", -1);
+		b = putbox(b, 8 + cfgLen + 20, "ipco", -1);
+		ok = pread(fd, b, cfgLen, p->heifThumbConfig.offset) == cfgLen;
+		b += cfgLen;
+		b = putbox(b, 20, "ispe", 0);
+		b = put4m(b, p->heifThumbWidth);
+		b = put4m(b, p->heifThumbHeight);
+		b = putbox(b, 21, "ipma", 0);
+		b = put4m(b, 1); // entry_count
+		b = put2m(b, 1); // item_ID
+		*b++ = 2;    // association_count
+		*b++ = 0x81; // the decoder configuration, which is essential
+		*b++ = 0x02; // ispe
+		b = putbox(b, (uint32_t)(8 + payload), "mdat", -1);
+	}
+	for (unsigned k = 0; ok && k < p->heifThumbExtentCount; ++k) {
+		const DYExtent *e = p->heifThumbExtents + k;
+		ok = pread(fd, b, e->length, e->offset) == e->length;
+		b += e->length;
+	}
+	close(fd);
+	if (!ok) {
+		free(out);
+		return NULL;
+	}
+	*outLen = hdrLen + payload;
+	return out;
+}
+
+u_int32_t bytesTo0thIFD(unsigned char *b, unsigned len, enum byteorder *o) {
+	if (len < 16) return 0; // 14 bytes read in this function, plus two for length of IFD
+	if (memcmp(b, "Exif\0\0", 6)) return 0;
+	b += 6;
+
+	/* Determine endianness of the TIFF data. */
+	if (!memcmp(b, "MM", 2)) *o = BIG;
+	else if (!memcmp(b, "II", 2)) *o = LITTLE;
+	else return 0;
+	b += 2;
+
+	/* Verify the TIFF header. */
+	if (exif2byte(b, *o) != 42) return 0;
+	b += 2;
+
+	/* Get the 0th IFD, where all of the good stuff should start. */
+	return exif4byte(b, *o);
+}
@@ -0,0 +1,80 @@
+//Copyright 2005-2023 Dominic Yu. Some rights reserved.
+//This work is licensed under the Creative Commons
+//Attribution-NonCommercial-ShareAlike License. To view a copy of this
+//license, visit http://creativecommons.org/licenses/by-nc-sa/2.0/ or send
+//a letter to Creative Commons, 559 Nathan Abbott Way, Stanford,
+//California 94305, USA.
+
+// Finding the metadata and thumbnails in JPEG and HEIF files. This is plain C, so tests/heif_check.c and
+// tests/probe_bench.c can build it without Foundation.
+
+#ifndef DYIMAGEPROBE_H
+#define DYIMAGEPROBE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include "exif.h"
+
+typedef enum {
+	JPEG,
+	HEIF,
+} DYExiftagsFileType;
+
+// a span of bytes in a file; HEIF items can be split into several
+#define DY_MAX_EXTENTS 4
+typedef struct {
+	off_t offset;
+	unsigned length;
+} DYExtent;
+
+// What the browser wants from a JPEG or HEIF file, found in one read of its head; only markers or boxes
+// that point past it cost another read. Offsets are from the start of the file; 0 means not found.
+typedef struct {
+	time_t datetime;            // DateTimeOriginal, or -1
+	unsigned short orientation; // 0 if there's no exif orientation
+	off_t exifOffset;           // the APP1 marker's data (or the HEIF Exif item), which starts with "Exif\0\0"
+	unsigned exifLength;
+	off_t thumbOffset;          // the JPEG thumbnail in IFD1
+	unsigned thumbLength;
+	unsigned width, height;     // from the SOF marker, or the primary item's ispe property (HEIF)
+	bool progressive;
+	unsigned syscalls;          // open, fstat, reads and close, for measuring I/O on slow volumes
+	// the HEIF item that an iref 'thmb' box links to the primary image
+	char heifThumbType[4];      // its item type: 'hvc1', 'av01', 'jpeg'...
+	unsigned heifThumbWidth, heifThumbHeight; // from its ispe property
+	DYExtent heifThumbConfig;   // its hvcC or av1C property box
+	unsigned heifThumbExtentCount; // 0 if there's no thumbnail, or it can't be read directly
+	DYExtent heifThumbExtents[DY_MAX_EXTENTS];
+} DYImageProbe;
+
+// returns false if the file can't be read or isn't the given type
+bool ProbeImageFile(const char *path, DYExiftagsFileType type, DYImageProbe *outProbe);
+time_t ExifDatetimeForFile(const char *path, DYExiftagsFileType type);
+
+// Copies a probed HEIF thumbnail into a file of its own that Image I/O can open: JPEG thumbnails as is,
+// HEVC and AV1 ones inside a minimal one-item HEIF. Returns NULL if there's none; the caller frees the result.
+unsigned char *CopyHeifThumbnail(const char *path, const DYImageProbe *p, size_t *outLen);
+
+// the bytes a probe read: the head of the file, and a window that moves to whatever lies past it.
+// exif (and comment, for JPEGs) point into them.
+typedef struct {
+	int fd;
+	off_t size;
+	unsigned char *head;
+	size_t headLen;
+	unsigned char *win;
+	off_t winOff;
+	size_t winLen, winCap;
+	unsigned syscalls;
+	unsigned char *exif;    // the probe's exifLength bytes, starting with "Exif\0\0"
+	unsigned char *comment; // the first JPEG COM marker
+	unsigned commentLen;
+} ProbeBytes;
+// ProbeImageFile, keeping the bytes it read; free them with ProbeBytesFree even if it fails
+bool ProbeFile(const char *path, DYExiftagsFileType type, DYImageProbe *p, ProbeBytes *pb);
+void ProbeBytesFree(ProbeBytes *pb);
+
+// the offset of IFD0 in an Exif block, which starts with "Exif\0\0"; 0 if it isn't one
+u_int32_t bytesTo0thIFD(unsigned char *b, unsigned len, enum byteorder *o);
+#endif
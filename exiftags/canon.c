@@ -1220,7 +1220,6 @@ canon_custom(struct exifprop *prop, unsigned char *off, enum byteorder o,
 		if (cv && j != -1) {
 			snprintf(aprop->str, 4 + strlen(cn) + strlen(cv),
 			    "%s - %s", cn, cv);
-			free(cv);
 			cv = NULL;
 		} else {
 			snprintf(aprop->str, 4 + strlen(cn) + 10, "%s %d - %d",
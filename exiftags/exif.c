@@ -121,7 +121,6 @@ readtag(struct field *afield, int ifdseq, struct ifd *dir, struct exiftags *t,
 	for (j = 0; ftypes[j].type && ftypes[j].type != prop->type; j++);
 	if (!ftypes[j].type) {
 		exifwarn2("unknown TIFF field type; discarding", prop->name);
-		free(prop);
 		return;
 	}
 
@@ -787,49 +786,38 @@ parsetag(struct exifprop *prop, struct ifd *dir, struct exiftags *t, int domkr)
 
 
 /*
- * Delete dynamic Exif property and IFD memory.
+ * Delete dynamic Exif property and IFD memory.  It all lives in the
+ * arena, so there's only something to do if the arena is ours.
  */
 void
 exiffree(struct exiftags *t)
 {
-	struct exifprop *tmpprop;
-	struct ifdoff *tmpoff;
+	struct exifarena *a;
 
-	if (!t) return;
+	if (!t || !t->ownarena) return;
 
-	while ((tmpprop = t->props)) {
-		if (t->props->str) free(t->props->str);
-		t->props = t->props->next;
-		free(tmpprop);
-	}
-	while ((tmpoff = (struct ifdoff *)(t->md.ifdoffs))) {
-		t->md.ifdoffs = (void *)tmpoff->next;
-		free(tmpoff);
-	}
-	free(t);
+	a = t->arena;		/* t is in there too. */
+	exifarenafree(a);
+	free(a);
 }
 
 
 /*
- * Scan the Exif section.
+ * Scan the Exif section; the arena must be current.
  */
-struct exiftags *
-exifscan(unsigned char *b, int len, int domkr)
+static struct exiftags *
+scan(unsigned char *b, int len, int domkr, struct exifarena *a, int own)
 {
 	int seq;
 	u_int32_t ifdoff;
 	struct exiftags *t;
-	struct ifd *curifd, *tmpifd;
+	struct ifd *curifd;
 
 	/* Create and initialize our file info structure. */
 
-	t = (struct exiftags *)malloc(sizeof(struct exiftags));
-	if (!t) {
-		exifwarn2("can't allocate file info",
-		    (const char *)strerror(errno));
-		return (NULL);
-	}
-	memset(t, 0, sizeof(struct exiftags));
+	t = (struct exiftags *)exifalloc(sizeof(struct exiftags));
+	t->arena = a;
+	t->ownarena = own;
 
 	seq = 0;
 	t->md.etiff = b + len;	/* End of TIFF. */
@@ -881,38 +869,126 @@ exifscan(unsigned char *b, int len, int domkr)
 
 	/* Now, let's parse the fields... */
 
-	while ((tmpifd = curifd)) {
+	while (curifd) {
 		readtags(curifd, seq++, t, domkr);
 		curifd = curifd->next;
-		free(tmpifd);		/* No need to keep it around... */
 	}
 
 	return (t);
 }
 
 
+/*
+ * Scan the Exif section.
+ */
+struct exiftags *
+exifscan(unsigned char *b, int len, int domkr, struct exifarena *a)
+{
+	struct exifarena *prev;
+	struct exiftags *t;
+	int own;
+
+	if ((own = !a)) {
+		if (!(a = (struct exifarena *)malloc(sizeof(struct exifarena)))) {
+			exifwarn2("can't allocate arena",
+			    (const char *)strerror(errno));
+			return (NULL);
+		}
+		exifarenainit(a, NULL, 0);
+	}
+	prev = exifsetarena(a);
+	t = scan(b, len, domkr, a, own);
+	exifsetarena(prev);
+	return (t);
+}
+
+
 /*
  * Read the Exif section and prepare the data for output.
  */
 struct exiftags *
-exifparse(unsigned char *b, int len)
+exifparse(unsigned char *b, int len, struct exifarena *a)
 {
 	struct exiftags *t;
 	struct exifprop *curprop;
+	struct exifarena *prev;
 
 	/* Find the section and scan it. */
 
-	if (!(t = exifscan(b, len, TRUE)))
+	if (!(t = exifscan(b, len, TRUE, a)))
 		return (NULL);
 
 	/* Make field values pretty. */
 
+	prev = exifsetarena(t->arena);
 	curprop = t->props;
 	while (curprop) {
 		postprop(curprop, t);
 		tweaklvl(curprop, t);
 		curprop = curprop->next;
 	}
+	exifsetarena(prev);
 
 	return (t);
 }
+
+
+/*
+ * Flatten the property list of a scan or parse.  (Without exifparse()'s
+ * post-processing, most properties have only their numeric values.)
+ */
+struct exifrecs *
+exifrecords(struct exiftags *t)
+{
+	struct exifarena *prev;
+	struct exifrecs *r;
+	struct exifrec *rec;
+	struct exifprop *prop;
+	size_t len;
+
+	prev = exifsetarena(t->arena);
+	r = (struct exifrecs *)exifalloc(sizeof(struct exifrecs));
+	len = 0;
+	for (prop = t->props; prop; prop = prop->next) {
+		r->n++;
+		if (prop->str)
+			r->strslen += strlen(prop->str) + 1;
+	}
+	r->recs = (struct exifrec *)exifalloc(r->n * sizeof(struct exifrec));
+	r->strs = (char *)exifalloc(r->strslen ? r->strslen : 1);
+	exifsetarena(prev);
+
+	for (prop = t->props, rec = r->recs; prop; prop = prop->next, rec++) {
+		rec->tag = prop->tag;
+		rec->lvl = prop->lvl;
+		rec->ifdseq = prop->ifdseq;
+		rec->value = prop->value;
+		rec->tagset = prop->tagset;
+		rec->name = prop->name;
+		rec->descr = prop->descr;
+		rec->stroff = EXIF_NOSTR;
+		if (prop->str) {
+			rec->stroff = (u_int32_t)len;
+			rec->slen = (u_int32_t)strlen(prop->str);
+			memcpy(r->strs + len, prop->str, rec->slen + 1);
+			len += rec->slen + 1;
+		}
+	}
+	return (r);
+}
+
+
+/*
+ * Lookup a record belonging to a particular set of tags.
+ */
+const struct exifrec *
+exiffindrec(const struct exifrecs *r, struct exiftag *tagset, u_int16_t tag)
+{
+	int i;
+
+	for (i = 0; i < r->n; i++)
+		if (r->recs[i].tagset == tagset && r->recs[i].tag == tag &&
+		    r->recs[i].lvl != ED_BAD)
+			return (&r->recs[i]);
+	return (NULL);
+}
@@ -228,10 +228,28 @@ struct tiffmeta {
 };
 
 
+/*
+ * Bump arena holding everything a parse allocates: the exiftags, its
+ * properties, their strings and the IFD records.  Nothing in it is freed
+ * on its own; exifarenareset() drops all of it at once and keeps the
+ * biggest block for the next parse.  buf may start out as caller-owned
+ * storage (e.g., on the stack); it's used before anything is malloc'd.
+ */
+
+struct exifarena {
+	unsigned char *buf;	/* Block being handed out. */
+	size_t size;		/* Its size. */
+	size_t used;		/* How much of it is taken. */
+	void *blocks;		/* Blocks we malloc'd (internal only). */
+};
+
+
 /* Image info and exifprop pointer returned by exifscan(). */
 
 struct exiftags {
 	struct exifprop *props;	/* The good stuff. */
+	struct exifarena *arena; /* Where all of this lives. */
+	short ownarena;		/* Arena is exiffree()'s to release. */
 	struct tiffmeta md;	/* Beginning, end, and endianness of TIFF. */
 
 	const char *model;	/* Camera model, to aid maker tag processing. */
@@ -245,6 +263,35 @@ struct exiftags {
 };
 
 
+/*
+ * A parse flattened into an array, one record per property, for callers
+ * that want values rather than a list to walk.  The display strings are
+ * packed, NUL-terminated, into strs.  Everything lives in the parse's
+ * arena; copying recs and strs is enough to keep it.
+ */
+
+#define EXIF_NOSTR	((u_int32_t)-1)
+
+struct exifrec {
+	u_int16_t tag;		/* Tag number within tagset. */
+	u_int16_t lvl;		/* Verbosity level. */
+	int ifdseq;		/* Sequence number of parent IFD. */
+	u_int32_t value;	/* Numeric value. */
+	u_int32_t stroff;	/* Display string offset, or EXIF_NOSTR. */
+	u_int32_t slen;		/* Display string length. */
+	struct exiftag *tagset;	/* Tags used to create property. */
+	const char *name;	/* Name, for lookups and localization. */
+	const char *descr;	/* Description (English). */
+};
+
+struct exifrecs {
+	struct exifrec *recs;
+	int n;
+	char *strs;		/* All of the display strings. */
+	size_t strslen;
+};
+
+
 /* Eternal interfaces. */
 
 extern int debug;
@@ -257,8 +304,19 @@ extern void exifdie(const char *msg);
 extern void exifwarn(const char *msg);
 extern void exifwarn2(const char *msg1, const char *msg2);
 
+extern void exifarenainit(struct exifarena *a, void *buf, size_t size);
+extern void exifarenareset(struct exifarena *a);
+extern void exifarenafree(struct exifarena *a);
+
+/* With a NULL arena, the parse gets its own, released by exiffree(). */
+
 extern void exiffree(struct exiftags *t);
-extern struct exiftags *exifscan(unsigned char *buf, int len, int domkr);
-extern struct exiftags *exifparse(unsigned char *buf, int len);
+extern struct exiftags *exifscan(unsigned char *buf, int len, int domkr,
+    struct exifarena *a);
+extern struct exiftags *exifparse(unsigned char *buf, int len,
+    struct exifarena *a);
+extern struct exifrecs *exifrecords(struct exiftags *t);
+extern const struct exifrec *exiffindrec(const struct exifrecs *r,
+    struct exiftag *tagset, u_int16_t tag);
 
 #endif
@@ -216,7 +216,6 @@ gpsprop(struct exifprop *prop, struct exiftags *t)
 	case 0x0019:
 		/* Clean-up from any earlier processing. */
 
-		free(prop->str);
 		prop->str = NULL;
 
 		byte4exif(prop->value, (unsigned char *)buf, o);
@@ -251,7 +250,6 @@ gpsprop(struct exifprop *prop, struct exiftags *t)
 			break;
 		}
 
-		free(prop->str);
 		prop->str = NULL;
 		exifstralloc(&prop->str, 32);
 
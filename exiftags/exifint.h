@@ -133,6 +133,8 @@ extern int16_t exif2sbyte(unsigned char *b, enum byteorder o);
 extern u_int32_t exif4byte(unsigned char *b, enum byteorder o);
 extern void byte4exif(u_int32_t n, unsigned char *b, enum byteorder o);
 extern int32_t exif4sbyte(unsigned char *b, enum byteorder o);
+extern struct exifarena *exifsetarena(struct exifarena *a);
+extern void *exifalloc(size_t len);
 extern char *finddescr(struct descrip *table, u_int16_t val);
 extern int catdescr(char *c, struct descrip *table, u_int16_t val, int len);
 extern struct exifprop *newprop(void);
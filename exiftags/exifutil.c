@@ -206,6 +206,119 @@ exif4sbyte(unsigned char *b, enum byteorder o)
 }
 
 
+/*
+ * Arena allocation.  exifscan() and exifparse() point each thread at the
+ * arena of the parse it's running, so the allocators below don't need
+ * to be told.  Blocks we malloc start with a header linking them up.
+ */
+
+#define ARENA_ALIGN	16
+#define ARENA_BLOCK	16384
+
+struct arenablk {
+	struct arenablk *next;
+	size_t size;
+};
+
+#define BLKHDR	((sizeof(struct arenablk) + ARENA_ALIGN - 1) & \
+	~(size_t)(ARENA_ALIGN - 1))
+
+static _Thread_local struct exifarena *curarena;
+
+void
+exifarenainit(struct exifarena *a, void *buf, size_t size)
+{
+	size_t pad;
+
+	pad = buf ? -(size_t)buf & (ARENA_ALIGN - 1) : 0;
+	a->buf = buf && size > pad ? (unsigned char *)buf + pad : NULL;
+	a->size = a->buf ? size - pad : 0;
+	a->used = 0;
+	a->blocks = NULL;
+}
+
+
+/*
+ * Forget everything allocated so far.  Only the newest (biggest) block
+ * we malloc'd is kept.
+ */
+void
+exifarenareset(struct exifarena *a)
+{
+	struct arenablk *blk, *next;
+
+	if ((blk = (struct arenablk *)a->blocks)) {
+		while ((next = blk->next)) {
+			blk->next = next->next;
+			free(next);
+		}
+		a->buf = (unsigned char *)blk + BLKHDR;
+		a->size = blk->size - BLKHDR;
+	}
+	a->used = 0;
+}
+
+
+void
+exifarenafree(struct exifarena *a)
+{
+	struct arenablk *blk;
+
+	while ((blk = (struct arenablk *)a->blocks)) {
+		a->blocks = (void *)blk->next;
+		free(blk);
+	}
+	exifarenainit(a, NULL, 0);
+}
+
+
+/*
+ * Point allocations at arena a; returns the previous one.
+ */
+struct exifarena *
+exifsetarena(struct exifarena *a)
+{
+	struct exifarena *prev;
+
+	prev = curarena;
+	curarena = a;
+	return (prev);
+}
+
+
+/*
+ * Allocate zeroed memory from the current arena.
+ */
+void *
+exifalloc(size_t len)
+{
+	struct exifarena *a;
+	struct arenablk *blk;
+	size_t size;
+	void *p;
+
+	a = curarena;
+	len = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (a->size - a->used < len) {
+		size = a->size * 2 < ARENA_BLOCK ? ARENA_BLOCK : a->size * 2;
+		if (size < BLKHDR + len)
+			size = BLKHDR + len;
+		if (!(blk = (struct arenablk *)malloc(size)))
+			exifdie((const char *)strerror(errno));
+		blk->next = (struct arenablk *)a->blocks;
+		blk->size = size;
+		a->blocks = (void *)blk;
+		a->buf = (unsigned char *)blk + BLKHDR;
+		a->size = size - BLKHDR;
+		a->used = 0;
+	}
+	p = a->buf + a->used;
+	a->used += len;
+	memset(p, 0, len);
+	return (p);
+}
+
+
 /*
  * Lookup and allocate description for a value.
  */
@@ -216,8 +329,7 @@ finddescr(struct descrip *table, u_int16_t val)
 	char *c;
 
 	for (i = 0; table[i].val != -1 && table[i].val != val; i++);
-	if (!(c = (char *)malloc(strlen(table[i].descr) + 1)))
-		exifdie((const char *)strerror(errno));
+	c = (char *)exifalloc(strlen(table[i].descr) + 1);
 	strcpy(c, table[i].descr);
 	return (c);
 }
@@ -273,10 +385,7 @@ newprop(void)
 {
 	struct exifprop *prop;
 
-	prop = (struct exifprop *)malloc(sizeof(struct exifprop));
-	if (!prop)
-		exifdie((const char *)strerror(errno));
-	memset(prop, 0, sizeof(struct exifprop));
+	prop = (struct exifprop *)exifalloc(sizeof(struct exifprop));
 	return (prop);
 }
 
@@ -324,8 +433,7 @@ exifstralloc(char **str, size_t len)
 		/*** abort(); DY - changed this to return ***/
 		return;
 	}
-	if (!(*str = (char *)calloc(1, len)))
-		exifdie((const char *)strerror(errno));
+	*str = (char *)exifalloc(len);
 }
 
 
@@ -406,12 +514,7 @@ readifd(u_int32_t offset, struct ifd **dir, struct exiftag *tagset,
 		return (0);
 	}
 
-	ifdoffs = (struct ifdoff *)malloc(sizeof(struct ifdoff));
-	if (!ifdoffs) {
-		exifwarn2("can't allocate IFD offset record",
-		    (const char *)strerror(errno));
-		return (0);
-	}
+	ifdoffs = (struct ifdoff *)exifalloc(sizeof(struct ifdoff));
 	ifdoffs->offset = offset + b;
 	ifdoffs->next = NULL;
 
@@ -430,12 +533,7 @@ readifd(u_int32_t offset, struct ifd **dir, struct exiftag *tagset,
 	if ((u_int32_t)(-1) - offset < 2 || offset + 2 > tifflen)
 		return (0);
 
-	*dir = (struct ifd *)malloc(sizeof(struct ifd));
-	if (!*dir) {
-		exifwarn2("can't allocate IFD record",
-		    (const char *)strerror(errno));
-		return (0);
-	}
+	*dir = (struct ifd *)exifalloc(sizeof(struct ifd));
 
 	(*dir)->num = exif2byte(b + offset, md->order);
 	(*dir)->par = NULL;
@@ -447,7 +545,6 @@ readifd(u_int32_t offset, struct ifd **dir, struct exiftag *tagset,
 
 	if ((*dir)->num &&
 	    sizeof(struct field) > (u_int32_t)(-1) / (*dir)->num) {
-		free(*dir);
 		*dir = NULL;
 		return (0);
 	}
@@ -459,7 +556,6 @@ readifd(u_int32_t offset, struct ifd **dir, struct exiftag *tagset,
 
 	if ((u_int32_t)(-1) - (offset + 2) < ifdsize ||
 	    offset + 2 + ifdsize > tifflen) {
-		free(*dir);
 		*dir = NULL;
 		return (0);
 	}
@@ -643,8 +643,6 @@ minolta_cprop(struct exifprop *prop, unsigned char *off, struct exiftags *t,
 			break;
 		}
 	}
-	if (valbuf)
-		free(valbuf);
 }
 
 
@@ -660,7 +658,6 @@ minolta_naval(struct exifprop *props, struct exiftag *t, int16_t tag)
 	if (!(prop = findprop(props, t, tag)))
 		return;
 
-	free(prop->str);
 	prop->str = NULL;
 	exifstralloc(&prop->str, strlen(na) + 1);
 	strcpy(prop->str, na);
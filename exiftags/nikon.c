@@ -505,10 +505,7 @@ nikon_prop1(struct exifprop *prop, struct exiftags *t)
 			    strlen(c3) + 24);
 			sprintf(prop->str, "%s, %s Selected, %s Focused",
 			    c1, c3, c2);
-			free(c3);
 		}
-		free(c1);
-		free(c2);
 		break;
 
 	/*
@@ -542,7 +539,6 @@ nikon_prop1(struct exifprop *prop, struct exiftags *t)
 
 		exifstralloc(&prop->str, strlen(c1) + strlen(c2) + 2);
 		sprintf(prop->str, "%s/%s", c1, c2);
-		free(c1);
 		break;
 
 	/* Color mode. */
@@ -551,7 +547,6 @@ nikon_prop1(struct exifprop *prop, struct exiftags *t)
 		if (!(c1 = prop->str)) break;
 
 		if (!strncmp(c1, "MODE1a", 6)) {
-			free(c1);
 			prop->str = NULL;
 			c1 = "Portrait sRGB";
 			exifstralloc(&prop->str, strlen(c1) + 1);
@@ -560,7 +555,6 @@ nikon_prop1(struct exifprop *prop, struct exiftags *t)
 		}
 
 		if (!strncmp(c1, "MODE2", 5)) {
-			free(c1);
 			prop->str = NULL;
 			c1 = "Adobe RGB";
 			exifstralloc(&prop->str, strlen(c1) + 1);
@@ -569,7 +563,6 @@ nikon_prop1(struct exifprop *prop, struct exiftags *t)
 		}
 
 		if (!strncmp(c1, "MODE3a", 6)) {
-			free(c1);
 			prop->str = NULL;
 			c1 = "Landscape sRGB";
 			exifstralloc(&prop->str, strlen(c1) + 1);
@@ -319,8 +319,6 @@ sanyo_prop(struct exifprop *prop, struct exiftags *t)
 		c2 = finddescr(sanyo_res, (u_int16_t)(prop->value & 0xff));
 		exifstralloc(&prop->str, strlen(c1) + strlen(c2) + 3);
 		sprintf(prop->str, "%s, %s", c1, c2);
-		free(c1);
-		free(c2);
 		break;
 
 	/* Digital zoom. */
@@ -0,0 +1,163 @@
+/*
+   Decodes synthetic DNGs on several threads with the buffer arena on,
+   once keeping the buffers and once with another thread trimming them
+   all the time, and checks every result against a decode with the
+   arena off.  Then checks that a file that isn't raw, or isn't there,
+   leaves this thread's buffers for TrimRawArena() to drop.  The two
+   bad files make dcraw complain on stderr; that's expected.
+   Worth running under -fsanitize=thread too.
+
+   cc -std=gnu2x -O1 -DNO_JPEG -o arena_check tests/arena_check.c -lm -lpthread
+   ./arena_check
+ */
+#include "../dcraw.c"
+#include "synth_dng.h"
+
+#define NFILES 4
+#define NTHREADS 6
+#define ROUNDS 8
+
+static const struct synth synths[NFILES] = {
+  { 300, 200, 1, 2, {0,1,1,2} },
+  { 640, 480, 6, 2, {1,0,2,1} },
+  { 128, 96, 3, 2, {2,1,1,0} },
+  { 600, 402, 8, 6, {1,1,0,1,1,2, 1,1,2,1,1,0, 2,0,1,0,2,1,
+                     1,1,2,1,1,0, 1,1,0,1,1,2, 0,2,1,2,0,1} },
+};
+static char paths[NFILES][32], notraw[32];
+static unsigned expect[NFILES];
+static atomic_int done, failed;
+static unsigned long long reuses;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned decode_path (const char *path)
+{
+  size_t len, stride, j;
+  unsigned short tw, th, rw, rh, orientation;
+  enum dcraw_type type;
+  unsigned hash = 0;
+  char *data;
+
+  /* bigger than the previews, so the raw data is decoded */
+  data = DecodeThumbnailFromRawFile (path, 100, 4, &len, &stride, &tw, &th,
+                                     &type, &rw, &rh, &orientation);
+  if (!data) return 0;
+  for (j=0; j < len; j++)
+    hash = hash * 31 + (uchar) data[j];
+  free (data);
+  return hash | 1;
+}
+#define decode(i) decode_path (paths[i])
+
+static void *worker (void *arg)
+{
+  struct dcraw_alloc_stats stats;
+  int n, i;
+
+  for (n=0; n < ROUNDS * NFILES; n++) {
+    i = (n + (int) (size_t) arg) % NFILES;
+    if (decode (i) != expect[i]) {
+      printf ("%s: thread %d round %d gave a different result\n", paths[i], (int) (size_t) arg, n);
+      failed = 1;
+    }
+  }
+  GetRawAllocStats (&stats);
+  pthread_mutex_lock (&stats_lock);
+  reuses += stats.reuses;
+  pthread_mutex_unlock (&stats_lock);
+  return 0;
+}
+
+static void *trimmer (void *arg)
+{
+  while (!done) {
+    TrimRawArena();
+    sched_yield();
+  }
+  return 0;
+}
+
+static int run (int trim)
+{
+  pthread_t tid[NTHREADS], trim_tid;
+  size_t t;
+
+  done = 0;
+  reuses = 0;
+  if (trim) pthread_create (&trim_tid, 0, trimmer, 0);
+  for (t=0; t < NTHREADS; t++)
+    pthread_create (tid+t, 0, worker, (void *) t);
+  for (t=0; t < NTHREADS; t++)
+    pthread_join (tid[t], 0);
+  done = 1;
+  if (trim) pthread_join (trim_tid, 0);
+  printf ("%s: %llu buffers reused\n", trim ? "trimming" : "keeping", reuses);
+  if (!trim && !reuses) {
+    printf ("the arena handed out no buffer twice\n");
+    failed = 1;
+  }
+  if (arenas) {
+    printf ("an exited thread's buffers are still listed\n");
+    failed = 1;
+  }
+  return !failed;
+}
+
+/* a failed decode must still leave the arena idle, so a trim empties it */
+static void check_trim (const char *path, const char *what)
+{
+  struct dcraw_alloc_stats stats;
+
+  decode (0);
+  GetRawAllocStats (&stats);
+  if (!stats.held_bytes) {
+    printf ("no buffers held after decoding %s\n", paths[0]);
+    failed = 1;
+  }
+  if (decode_path (path)) {
+    printf ("%s decoded\n", what);
+    failed = 1;
+  }
+  TrimRawArena();
+  GetRawAllocStats (&stats);
+  if (stats.held_bytes) {
+    printf ("after %s, TrimRawArena() left %zu bytes\n", what, stats.held_bytes);
+    failed = 1;
+  }
+}
+
+int main()
+{
+  int i, fd;
+
+  dcraw_init();
+  for (i=0; i < NFILES; i++) {
+    strcpy (paths[i], "/tmp/arena_checkXXXXXX");
+    if ((fd = mkstemp (paths[i])) < 0 || close (fd) ||
+        !write_dng (paths[i], synths + i, i+1)) {
+      perror (paths[i]);
+      return 1;
+    }
+    if (!(expect[i] = decode (i))) {
+      printf ("%s: can't decode\n", paths[i]);
+      failed = 1;
+    }
+  }
+  SetRawArena (1, 60);
+  if (!failed) run (0);
+  SetRawArena (1, 0);
+  if (!failed) run (1);
+  SetRawArena (1, 60);
+  strcpy (notraw, "/tmp/arena_checkXXXXXX");
+  if ((fd = mkstemp (notraw)) < 0 || write (fd, paths, sizeof paths) != sizeof paths || close (fd)) {
+    perror (notraw);
+    return 1;
+  }
+  if (!failed) check_trim (notraw, "a file that isn't raw");
+  if (!failed) check_trim ("/nonexistent/arena_check.dng", "a missing file");
+  unlink (notraw);
+  for (i=0; i < NFILES; i++)
+    unlink (paths[i]);
+  if (!failed) printf ("ok\n");
+  return failed;
+}
@@ -0,0 +1,451 @@
+//Copyright 2005-2023 Dominic Yu. Some rights reserved.
+//This work is licensed under the Creative Commons
+//Attribution-NonCommercial-ShareAlike License. To view a copy of this
+//license, visit http://creativecommons.org/licenses/by-nc-sa/2.0/ or send
+//a letter to Creative Commons, 559 Nathan Abbott Way, Stanford,
+//California 94305, USA.
+
+/*
+ * Parses a corpus of generated Exif blobs, each with GPS tags and a
+ * maker note of 5-60 tags from one of eleven vendors, the way the info
+ * panel does (exifparse() and exifrecords()), with three kinds of arena:
+ * a private one per parse (NULL), one heap arena reset between parses,
+ * and a 32 KB stack buffer as appendprops() uses.  Reports the time and
+ * the mallocs per parse, and fails if the records differ.
+ *
+ *   cc -std=gnu2x -O2 -Iexiftags -o exif_arena_bench tests/exif_arena_bench.c \
+ *       exiftags/[a-z]*.c -lm
+ *   ./exif_arena_bench [blobs]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "exif.h"
+
+struct buf {
+	unsigned char *b;
+	size_t len, cap;
+};
+
+struct entry {
+	u_int16_t tag, type;
+	u_int32_t count;
+	struct buf data;
+};
+
+static unsigned seed;
+
+static unsigned
+rnd(unsigned n)
+{
+
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 8) % n);
+}
+
+static void
+put(struct buf *o, const void *data, size_t n)
+{
+
+	if (o->len + n > o->cap) {
+		o->cap = (o->len + n) * 2;
+		if (!(o->b = (unsigned char *)realloc(o->b, o->cap)))
+			abort();
+	}
+	if (data)
+		memcpy(o->b + o->len, data, n);
+	else
+		memset(o->b + o->len, 0, n);
+	o->len += n;
+}
+
+static void
+put2(struct buf *o, unsigned v)
+{
+	unsigned char b[2] = { v, v >> 8 };
+
+	put(o, b, 2);
+}
+
+static void
+put4(struct buf *o, u_int32_t v)
+{
+
+	put2(o, v);
+	put2(o, v >> 16);
+}
+
+/*
+ * A tag of the given type and count, with values that look like a camera's:
+ * small enumerations, sane rationals, printable strings.  A directory is a
+ * short array whose first value is its size in bytes, as Canon's are.
+ */
+static void
+mkentry(struct entry *e, u_int16_t tag, u_int16_t type, u_int32_t count, int dir)
+{
+	static const char chars[] = "ABCDEFGH abcdef0123456789:";
+	u_int32_t i;
+
+	e->tag = tag;
+	e->type = type;
+	e->count = count;
+	e->data.len = 0;
+	for (i = 0; i < count; i++)
+		switch (type) {
+		case 2:
+			put(&e->data, i + 1 < count ?
+			    chars + rnd(sizeof(chars) - 1) : "", 1);
+			break;
+		case 3:
+			put2(&e->data, dir && !i ? 2 * count : rnd(8));
+			break;
+		case 4:
+			put4(&e->data, rnd(8));
+			break;
+		case 5:
+		case 10:
+			put4(&e->data, 1 + rnd(999));
+			put4(&e->data, 1 + rnd(99));
+			break;
+		default:
+			put(&e->data, chars + rnd(sizeof(chars) - 1), 1);
+			break;
+		}
+}
+
+/*
+ * A maker tag of a random type.  The vendor modules trust the types of the
+ * tags they know, so these are numbered where none of them look.
+ */
+static void
+randentry(struct entry *e, u_int16_t tag)
+{
+
+	switch (rnd(6)) {
+	case 0:
+		mkentry(e, 0x4000 + tag, 2, 2 + rnd(30), 0);
+		break;
+	case 1:
+		mkentry(e, 0x4000 + tag, 5, 1 + rnd(2), 0);
+		break;
+	case 2:
+		mkentry(e, 0x4000 + tag, 7, 1 + rnd(24), 0);
+		break;
+	case 3:
+		mkentry(e, 0x4000 + tag, 4, 1, 0);
+		break;
+	default:
+		mkentry(e, 0x4000 + tag, 3, 1 + rnd(4), 0);
+		break;
+	}
+}
+
+static int
+cmpentry(const void *a, const void *b)
+{
+
+	return (((const struct entry *)a)->tag - ((const struct entry *)b)->tag);
+}
+
+/*
+ * Appends an IFD that will sit at offset base, its values past four bytes
+ * after it.  Returns where tag find's data went, or 0.
+ */
+static u_int32_t
+ifd(struct buf *o, u_int32_t base, struct entry *e, int n, u_int16_t find)
+{
+	struct buf tail = { 0 };
+	u_int32_t dpos, found = 0;
+	int i;
+
+	qsort(e, n, sizeof(*e), cmpentry);
+	dpos = base + 2 + 12 * n + 4;
+	put2(o, n);
+	for (i = 0; i < n; i++) {
+		put2(o, e[i].tag);
+		put2(o, e[i].type);
+		put4(o, e[i].count);
+		if (e[i].data.len <= 4) {
+			put(o, e[i].data.b, e[i].data.len);
+			put(o, NULL, 4 - e[i].data.len);
+			continue;
+		}
+		if (e[i].tag == find)
+			found = dpos + tail.len;
+		put4(o, dpos + tail.len);
+		put(&tail, e[i].data.b, e[i].data.len);
+		if (tail.len & 1)
+			put(&tail, NULL, 1);
+	}
+	put4(o, 0);
+	put(o, tail.b, tail.len);
+	free(tail.b);
+	return (found);
+}
+
+static void
+setstr(struct entry *e, u_int16_t tag, const char *s)
+{
+
+	e->tag = tag;
+	e->type = 2;
+	e->count = strlen(s) + 1;
+	e->data.len = 0;
+	put(&e->data, s, e->count);
+}
+
+static void
+setlong(struct entry *e, u_int16_t tag, u_int16_t type, u_int32_t v)
+{
+
+	e->tag = tag;
+	e->type = type;
+	e->count = 1;
+	e->data.len = 0;
+	if (type == 3)
+		put2(&e->data, v);
+	else
+		put4(&e->data, v);
+}
+
+/* The maker note for a note whose data starts at offset mo in the TIFF. */
+static void
+makernote(struct buf *o, const char *maker, u_int32_t mo, struct entry *m, int nm)
+{
+
+	o->len = 0;
+	if (!strcmp(maker, "NIKON")) {
+		put(o, "Nikon\0\2\x10\0\0II*\0\x08\0\0\0", 18);
+		ifd(o, 8, m, nm, 0);
+	} else if (!strcmp(maker, "FUJIFILM")) {
+		put(o, "FUJIFILM\x0c\0\0\0", 12);
+		ifd(o, 12, m, nm, 0);
+	} else if (!strcmp(maker, "OLYMPUS") || !strcmp(maker, "SANYO")) {
+		put(o, maker, 5);
+		put(o, "\0\1\0", 3);
+		ifd(o, mo + 8, m, nm, 0);
+	} else
+		ifd(o, mo, m, nm, 0);
+}
+
+/* "Exif\0\0", then IFD0, the Exif IFD with the maker note, and the GPS IFD. */
+static void
+mkexif(struct buf *out, unsigned n)
+{
+	static const char *makers[] = { "Canon", "NIKON", "OLYMPUS", "Minolta",
+	    "FUJIFILM", "Panasonic", "SANYO", "Asahi", "CASIO", "Leica", "SIGMA" };
+	static const char *models[] = { "EOS 5D", "D70", "E-1", "DiMAGE 7",
+	    "FinePix", "DMC-FZ", "C5", "PENTAX", "QV", "M8", "SD9" };
+	/* Tag, type, and count, as cameras write them. */
+	static const u_int16_t etags[][3] = { { 0x829a, 5, 1 }, { 0x829d, 5, 1 },
+	    { 0x8822, 3, 1 }, { 0x8827, 3, 1 }, { 0x9000, 7, 4 },
+	    { 0x9003, 2, 20 }, { 0x9004, 2, 20 }, { 0x9201, 10, 1 },
+	    { 0x9202, 5, 1 }, { 0x9204, 10, 1 }, { 0x9205, 5, 1 },
+	    { 0x9207, 3, 1 }, { 0x9208, 3, 1 }, { 0x9209, 3, 1 },
+	    { 0x920a, 5, 1 }, { 0x9286, 7, 40 }, { 0xa001, 3, 1 },
+	    { 0xa002, 4, 1 }, { 0xa003, 4, 1 }, { 0xa217, 3, 1 },
+	    { 0xa300, 7, 1 }, { 0xa401, 3, 1 }, { 0xa402, 3, 1 },
+	    { 0xa403, 3, 1 }, { 0xa405, 3, 1 }, { 0xa406, 3, 1 } };
+	static const u_int16_t gtags[][3] = { { 0, 1, 4 }, { 1, 2, 2 },
+	    { 2, 5, 3 }, { 3, 2, 2 }, { 4, 5, 3 }, { 5, 1, 1 }, { 6, 5, 1 },
+	    { 7, 5, 3 }, { 0x12, 2, 10 }, { 0x1d, 2, 11 } };
+	struct entry m[80] = { 0 }, ex[32] = { 0 }, gps[32] = { 0 }, i0[5] = { 0 };
+	struct buf mn = { 0 }, tiff = { 0 }, eb = { 0 };
+	const char *maker;
+	char used[0x120] = { 0 };
+	u_int32_t eo, go, mo;
+	int nm, ne, ng, i, k, tag;
+
+	seed = n * 7919 + 1;
+	maker = makers[rnd(11)];
+	/* Canon's camera and shot settings, which become a prop per value. */
+	nm = 0;
+	if (!strcmp(maker, "Canon")) {
+		mkentry(m + nm++, 1, 3, 8 + rnd(40), 1);
+		mkentry(m + nm++, 4, 3, 8 + rnd(20), 1);
+	}
+	for (k = 5 + rnd(55); k--; )
+		if (!used[tag = rnd(0x120)])
+			randentry(m + nm++, tag), used[tag] = 1;
+	for (ne = i = 0; i < (int)(sizeof(etags) / sizeof(*etags)); i++)
+		if (rnd(4))
+			mkentry(ex + ne++, etags[i][0], etags[i][1], etags[i][2], 0);
+	for (ng = i = 0; i < (int)(sizeof(gtags) / sizeof(*gtags)); i++)
+		if (rnd(3))
+			mkentry(gps + ng++, gtags[i][0], gtags[i][1], gtags[i][2], 0);
+
+	/* IFD0's size doesn't depend on its pointers, nor the Exif IFD's on the note's offset. */
+	setstr(i0, 0x10f, maker);
+	setstr(i0 + 1, 0x110, models[rnd(11)]);
+	setlong(i0 + 2, 0x112, 3, 1 + rnd(8));
+	setlong(i0 + 3, 0x8769, 4, 0);
+	setlong(i0 + 4, 0x8825, 4, 0);
+	ifd(&tiff, 8, i0, 5, 0);
+	eo = 8 + tiff.len + (tiff.len & 1);
+	makernote(&mn, maker, 0, m, nm);
+	ex[ne].tag = 0x927c;
+	ex[ne].type = 7;
+	ex[ne].count = mn.len;
+	ex[ne].data = mn;
+	mo = ifd(&eb, eo, ex, ne + 1, 0x927c);
+	for (i = 0; ex[i].tag != 0x927c; i++);
+	makernote(&ex[i].data, maker, mo, m, nm);
+	eb.len = 0;
+	ifd(&eb, eo, ex, ne + 1, 0);
+	go = eo + eb.len + (eb.len & 1);
+
+	for (i = 0; i < 5; i++)
+		if (i0[i].tag == 0x8769 || i0[i].tag == 0x8825)
+			setlong(i0 + i, i0[i].tag, 4, i0[i].tag == 0x8769 ? eo : go);
+	tiff.len = 0;
+	put(&tiff, "II*\0\x08\0\0\0", 8);
+	ifd(&tiff, 8, i0, 5, 0);
+	put(&tiff, NULL, tiff.len & 1);
+	put(&tiff, eb.b, eb.len);
+	put(&tiff, NULL, tiff.len & 1);
+	ifd(&tiff, go, gps, ng, 0);
+
+	out->len = 0;
+	put(out, "Exif\0\0", 6);
+	put(out, tiff.b, tiff.len);
+	for (i = 0; i < 80; i++)
+		free(m[i].data.b);
+	for (i = 0; i < 32; i++)
+		free(ex[i].data.b), free(gps[i].data.b);
+	for (i = 0; i < 5; i++)
+		free(i0[i].data.b);
+	free(tiff.b);
+	free(eb.b);
+}
+
+
+/* The first field of exifutil.c's block header. */
+struct blk {
+	struct blk *next;
+};
+
+static unsigned
+nblocks(const struct exifarena *a)
+{
+	const struct blk *b;
+	unsigned n;
+
+	for (n = 0, b = (const struct blk *)a->blocks; b; b = b->next)
+		n++;
+	return (n);
+}
+
+static u_int32_t
+hashrecs(const struct exifrecs *r)
+{
+	u_int32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; r && i < r->n; i++) {
+		h = (h ^ r->recs[i].tag) * 16777619;
+		h = (h ^ r->recs[i].value) * 16777619;
+		h = (h ^ r->recs[i].lvl) * 16777619;
+		if (r->recs[i].stroff != EXIF_NOSTR) {
+			const char *s = r->strs + r->recs[i].stroff;
+			while (*s)
+				h = (h ^ (unsigned char)*s++) * 16777619;
+		}
+	}
+	return (h);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *modes[] = { "private arena (NULL)",
+	    "heap arena, reset", "32 KB stack arena" };
+	int nblobs = argc > 1 ? atoi(argv[1]) : 300, i, m, round, failed = 0;
+	unsigned long long blocks, nrecs;
+	struct buf *blobs;
+	u_int32_t *expect, h;
+	double secs, best;
+
+	if (nblobs < 1 || !(blobs = (struct buf *)calloc(nblobs, sizeof(*blobs))) ||
+	    !(expect = (u_int32_t *)calloc(nblobs, sizeof(*expect)))) {
+		fprintf(stderr, "usage: %s [blobs]\n", argv[0]);
+		return (1);
+	}
+	progname = argv[0];
+	for (i = 0; i < nblobs; i++)
+		mkexif(blobs + i, i);
+
+	for (m = 0; m < 3; m++) {
+		unsigned char stackbuf[32768];
+		struct exifarena heap, *a;
+
+		exifarenainit(&heap, NULL, 0);
+		best = 1e9;
+		blocks = nrecs = 0;
+		for (round = 0; round < 5; round++) {
+			secs = now();
+			for (i = 0; i < nblobs; i++) {
+				struct exiftags *t;
+				struct exifarena stack;
+				unsigned kept = 0;
+
+				a = NULL;
+				if (m == 1) {
+					exifarenareset(&heap);
+					a = &heap;
+					kept = nblocks(a);
+				} else if (m == 2) {
+					exifarenainit(&stack, stackbuf, sizeof(stackbuf));
+					a = &stack;
+				}
+				if (!(t = exifparse(blobs[i].b, blobs[i].len, a))) {
+					if (!round) {
+						printf("blob %d: not parsed with %s\n", i, modes[m]);
+						failed = 1;
+					}
+					if (m == 2)
+						exifarenafree(&stack);
+					continue;
+				}
+				h = hashrecs(exifrecords(t));
+				if (!round) {
+					if (!m)
+						expect[i] = h;
+					else if (h != expect[i]) {
+						printf("blob %d: %s gives different records\n", i, modes[m]);
+						failed = 1;
+					}
+					blocks += nblocks(t->arena) - kept;
+					nrecs += exifrecords(t)->n;
+				}
+				if (m == 2)
+					exifarenafree(&stack);
+				else if (!m)
+					exiffree(t);
+			}
+			if ((secs = now() - secs) < best)
+				best = secs;
+		}
+		exifarenafree(&heap);
+		printf("%-22s %6.2f us/parse, %5.2f mallocs/parse, %.0f records/parse\n",
+		    modes[m], best / nblobs * 1e6, (double)blocks / nblobs,
+		    (double)nrecs / nblobs);
+	}
+	for (i = 0; i < nblobs; i++)
+		free(blobs[i].b);
+	free(blobs);
+	free(expect);
+	return (failed);
+}
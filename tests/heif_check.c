@@ -0,0 +1,407 @@
+//Copyright 2005-2023 Dominic Yu. Some rights reserved.
+//This work is licensed under the Creative Commons
+//Attribution-NonCommercial-ShareAlike License. To view a copy of this
+//license, visit http://creativecommons.org/licenses/by-nc-sa/2.0/ or send
+//a letter to Creative Commons, 559 Nathan Abbott Way, Stanford,
+//California 94305, USA.
+
+// Builds HEIF files box by box, in the layouts the probe has to cope with, and checks what ProbeImageFile
+// finds in them and what CopyHeifThumbnail makes of their thumbnails.
+//
+//   cc -std=gnu2x -Iexiftags -o heif_check tests/heif_check.c exiftags/DYImageProbe.c exiftags/exifutil.c exiftags/tagdefs.c
+//   ./heif_check
+
+#include "DYImageProbe.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+	const char *name;
+	const char *thumbType; // NULL for a file without a thumbnail
+	unsigned thumbExtents; // how many pieces the thumbnail is split into
+	bool thumbInIdat, exifInIdat;
+	bool baseOffsets;      // iloc base_offset set, and the extent offsets relative to it
+	bool wideIDs;          // 32-bit item IDs, in iloc v2, infe v3, pitm/iref/ipma v1
+	bool bigIpma;          // 15-bit property indices
+	bool reversed;         // meta's children in reverse order
+	unsigned freeBefore;   // a free box this big before meta, to push it past the probe's first read
+	unsigned truncate;     // bytes cut off the end of the file
+	unsigned short orientation;
+} Fixture;
+
+static const Fixture fixtures[] = {
+	{"hvc1 thumbnail", "hvc1", 1},
+	{"hvc1 thumbnail in three extents", "hvc1", 3, .orientation = 6},
+	{"av01 thumbnail in idat", "av01", 2, .thumbInIdat = true, .orientation = 8},
+	{"jpeg thumbnail", "jpeg", 2, .orientation = 1},
+	{"32-bit item IDs, 15-bit property indices", "hvc1", 2, .wideIDs = true, .bigIpma = true},
+	{"base offsets", "hvc1", 3, .baseOffsets = true, .exifInIdat = true},
+	{"children in reverse order", "av01", 1, .reversed = true, .orientation = 3},
+	{"meta past the first read", "hvc1", 2, .freeBefore = 200000, .orientation = 6},
+	{"exif in idat", "jpeg", 1, .exifInIdat = true},
+	{"no thumbnail", NULL, 0, .orientation = 8},
+	{"more extents than DY_MAX_EXTENTS", "hvc1", DY_MAX_EXTENTS + 1},
+	{"thumbnail cut short", "hvc1", 2, .truncate = 100},
+};
+
+#define PRIMARY_W 4032
+#define PRIMARY_H 3024
+#define THUMB_W 320
+#define THUMB_H 240
+#define PRIMARY_ID 1
+#define EXIF_ID 3
+#define DATETIME "2021:07:02 03:04:05"
+
+typedef struct {
+	unsigned char *b;
+	size_t len, cap;
+} Buf;
+
+static void put(Buf *o, const void *data, size_t n) {
+	if (o->len + n > o->cap) {
+		o->cap = (o->len + n) * 2;
+		if (!(o->b = realloc(o->b, o->cap))) abort();
+	}
+	if (data) memcpy(o->b + o->len, data, n);
+	else memset(o->b + o->len, 0, n);
+	o->len += n;
+}
+static void put1(Buf *o, unsigned v) { unsigned char c = v; put(o, &c, 1); }
+static void put2(Buf *o, unsigned v) { put1(o, v >> 8); put1(o, v); }
+static void put4(Buf *o, uint32_t v) { put2(o, v >> 16); put2(o, v); }
+static void putID(Buf *o, uint32_t id, bool wide) { if (wide) put4(o, id); else put2(o, id); }
+
+// starts a box, returning where it is so boxEnd can fill in its length
+static size_t box(Buf *o, const char *type) {
+	size_t at = o->len;
+	put4(o, 0);
+	put(o, type, 4);
+	return at;
+}
+static size_t fullbox(Buf *o, const char *type, int version, unsigned flags) {
+	size_t at = box(o, type);
+	put4(o, (uint32_t)version << 24 | flags);
+	return at;
+}
+static void boxEnd(Buf *o, size_t at) {
+	uint32_t n = (uint32_t)(o->len - at);
+	o->b[at] = n >> 24;
+	o->b[at+1] = n >> 16;
+	o->b[at+2] = n >> 8;
+	o->b[at+3] = n;
+}
+
+static void randomBytes(Buf *o, size_t n, unsigned *seed) {
+	while (n--) {
+		*seed = *seed * 1103515245 + 12345;
+		put1(o, *seed >> 16);
+	}
+}
+
+// the Exif item: an offset to the TIFF header, "Exif\0\0", then a big-endian TIFF block with
+// the orientation in IFD0 and DateTimeOriginal in the Exif SubIFD
+static void exifItem(Buf *o, unsigned short orientation) {
+	put4(o, 6);
+	put(o, "Exif\0\0MM\0*", 10);
+	put4(o, 8);          // IFD0
+	put2(o, 2);
+	put2(o, 0x0112); put2(o, 3); put4(o, 1); put2(o, orientation); put2(o, 0);
+	put2(o, 0x8769); put2(o, 4); put4(o, 1); put4(o, 38);
+	put4(o, 0);
+	put2(o, 1);          // the Exif SubIFD, at 38
+	put2(o, 0x9003); put2(o, 2); put4(o, 20); put4(o, 56);
+	put4(o, 0);
+	put(o, DATETIME, 20); // at 56
+}
+
+typedef struct {
+	Buf thumb, config, exif, primary;
+	uint32_t thumbID;
+	size_t cut[DY_MAX_EXTENTS + 2]; // where each thumbnail extent starts, and its end
+} Parts;
+
+// iloc's entry for an item whose pieces start at the given offsets, in the file or in idat
+static void ilocItem(Buf *o, const Fixture *f, int version, uint32_t id, int method, const size_t *starts, const size_t *lens, unsigned n) {
+	uint32_t base = f->baseOffsets && method == 0 ? 4 : 0;
+	putID(o, id, version == 2);
+	if (version >= 1) put2(o, method);
+	put2(o, 0); // data_reference_index
+	if (f->baseOffsets) put4(o, base);
+	put2(o, n);
+	for (unsigned k = 0; k < n; ++k) {
+		put4(o, (uint32_t)(starts[k] - base));
+		put4(o, (uint32_t)lens[k]);
+	}
+}
+
+// Lays out the whole file, assuming mdat's payload starts at mdatData; returns where it actually does.
+// meta's size doesn't depend on the offsets in it, so a second pass with the answer gets them right.
+static size_t build(const Fixture *f, const Parts *parts, size_t mdatData, Buf *o) {
+	bool thumb = f->thumbType != NULL, wide = f->wideIDs;
+	int ilocVersion = wide ? 2 : f->thumbInIdat || f->exifInIdat ? 1 : 0;
+	size_t thumbStarts[DY_MAX_EXTENTS + 1], thumbLens[DY_MAX_EXTENTS + 1], exifStart, exifLen = parts->exif.len;
+	Buf mdat = {0}, idat = {0};
+	o->len = 0;
+
+	// mdat: some padding, the primary image, the Exif item and the thumbnail, with a gap between its extents
+	put(&mdat, NULL, 16);
+	put(&mdat, parts->primary.b, parts->primary.len);
+	if (f->exifInIdat) {
+		exifStart = idat.len;
+		put(&idat, parts->exif.b, exifLen);
+	} else {
+		exifStart = mdatData + mdat.len;
+		put(&mdat, parts->exif.b, exifLen);
+	}
+	for (unsigned k = 0; thumb && k < f->thumbExtents; ++k) {
+		Buf *dst = f->thumbInIdat ? &idat : &mdat;
+		if (k) put(dst, "gapgap!", 7);
+		thumbStarts[k] = (f->thumbInIdat ? 0 : mdatData) + dst->len;
+		thumbLens[k] = parts->cut[k+1] - parts->cut[k];
+		put(dst, parts->thumb.b + parts->cut[k], thumbLens[k]);
+	}
+
+	size_t at = box(o, "ftyp");
+	put(o, "heic\0\0\0\0mif1heic", 16);
+	boxEnd(o, at);
+	if (f->freeBefore) {
+		at = box(o, "free");
+		put(o, NULL, f->freeBefore);
+		boxEnd(o, at);
+	}
+
+	Buf kids[6] = {{0}};
+	at = fullbox(&kids[0], "pitm", wide, 0);
+	putID(&kids[0], PRIMARY_ID, wide);
+	boxEnd(&kids[0], at);
+
+	Buf *k = &kids[1];
+	at = fullbox(k, "iinf", 0, 0);
+	put2(k, thumb ? 3 : 2);
+	const char *types[3] = {"hvc1", thumb ? f->thumbType : NULL, "Exif"};
+	uint32_t ids[3] = {PRIMARY_ID, parts->thumbID, EXIF_ID};
+	for (int i = 0; i < 3; ++i) {
+		if (!types[i]) continue;
+		size_t infe = fullbox(k, "infe", wide ? 3 : 2, 0);
+		putID(k, ids[i], wide);
+		put2(k, 0);
+		put(k, types[i], 4);
+		put1(k, 0);
+		boxEnd(k, infe);
+	}
+	boxEnd(k, at);
+
+	k = &kids[2];
+	at = fullbox(k, "iloc", ilocVersion, 0);
+	put1(k, 0x44);
+	put1(k, f->baseOffsets ? 0x40 : 0);
+	if (ilocVersion == 2) put4(k, thumb ? 3 : 2);
+	else put2(k, thumb ? 3 : 2);
+	size_t primaryStart = mdatData + 16, primaryLen = parts->primary.len;
+	ilocItem(k, f, ilocVersion, PRIMARY_ID, 0, &primaryStart, &primaryLen, 1);
+	if (thumb)
+		ilocItem(k, f, ilocVersion, parts->thumbID, f->thumbInIdat, thumbStarts, thumbLens, f->thumbExtents);
+	ilocItem(k, f, ilocVersion, EXIF_ID, f->exifInIdat, &exifStart, &exifLen, 1);
+	boxEnd(k, at);
+
+	k = &kids[3];
+	at = fullbox(k, "iref", wide, 0);
+	size_t ref = box(k, "cdsc");
+	putID(k, EXIF_ID, wide);
+	put2(k, 1);
+	putID(k, PRIMARY_ID, wide);
+	boxEnd(k, ref);
+	if (thumb) {
+		ref = box(k, "thmb");
+		putID(k, parts->thumbID, wide);
+		put2(k, 1);
+		putID(k, PRIMARY_ID, wide);
+		boxEnd(k, ref);
+	}
+	boxEnd(k, at);
+
+	// properties: 1 the primary's hvcC, 2 its ispe, 3 the thumbnail's ispe, 4 irot, 5 the thumbnail's config
+	k = &kids[4];
+	at = box(k, "iprp");
+	size_t ipco = box(k, "ipco");
+	size_t prop = box(k, "hvcC");
+	put(k, NULL, 22);
+	boxEnd(k, prop);
+	prop = fullbox(k, "ispe", 0, 0);
+	put4(k, PRIMARY_W);
+	put4(k, PRIMARY_H);
+	boxEnd(k, prop);
+	prop = fullbox(k, "ispe", 0, 0);
+	put4(k, THUMB_W);
+	put4(k, THUMB_H);
+	boxEnd(k, prop);
+	prop = box(k, "irot");
+	put1(k, 0);
+	boxEnd(k, prop);
+	put(k, parts->config.b, parts->config.len);
+	boxEnd(k, ipco);
+	size_t ipma = fullbox(k, "ipma", wide, f->bigIpma);
+	put4(k, thumb ? 2 : 1);
+	unsigned assoc[2][3] = {{0x81, 0x02, 0x84}, {0x03, 0x84, 0x85}};
+	for (int i = 0; i < (thumb ? 2 : 1); ++i) {
+		unsigned n = i && !parts->config.len ? 2 : 3;
+		putID(k, i ? parts->thumbID : PRIMARY_ID, wide);
+		put1(k, n);
+		for (unsigned j = 0; j < n; ++j) {
+			if (f->bigIpma) put2(k, (assoc[i][j] & 0x80) << 8 | (assoc[i][j] & 0x7f));
+			else put1(k, assoc[i][j]);
+		}
+	}
+	boxEnd(k, ipma);
+	boxEnd(k, at);
+
+	if (idat.len) {
+		at = box(&kids[5], "idat");
+		put(&kids[5], idat.b, idat.len);
+		boxEnd(&kids[5], at);
+	}
+
+	size_t meta = fullbox(o, "meta", 0, 0);
+	size_t hdlr = fullbox(o, "hdlr", 0, 0);
+	put4(o, 0);
+	put(o, "pict", 4);
+	put(o, NULL, 13);
+	boxEnd(o, hdlr);
+	for (int i = 0; i < 6; ++i) {
+		Buf *kid = &kids[f->reversed ? 5 - i : i];
+		put(o, kid->b, kid->len);
+		free(kid->b);
+	}
+	boxEnd(o, meta);
+
+	at = box(o, "mdat");
+	size_t data = o->len;
+	put(o, mdat.b, mdat.len);
+	boxEnd(o, at);
+	free(mdat.b);
+	free(idat.b);
+	return data;
+}
+
+static bool writeFile(const char *path, const unsigned char *b, size_t len) {
+	FILE *fp = fopen(path, "wb");
+	if (!fp) return false;
+	bool ok = fwrite(b, 1, len, fp) == len;
+	return !fclose(fp) && ok;
+}
+
+static bool contains(const unsigned char *b, size_t len, const Buf *what) {
+	for (size_t i = 0; i + what->len <= len; ++i)
+		if (!memcmp(b + i, what->b, what->len)) return true;
+	return false;
+}
+
+static int failures;
+
+static void fail(const char *name, const char *what) {
+	printf("%s: %s\n", name, what);
+	failures++;
+}
+
+static void check(const Fixture *f, unsigned seed, const char *path) {
+	Parts parts = {0};
+	Buf file = {0};
+	bool thumb = f->thumbType != NULL;
+	bool config = thumb && strcmp(f->thumbType, "jpeg");
+
+	parts.thumbID = f->wideIDs ? 70000 : 2;
+	randomBytes(&parts.primary, 5000, &seed);
+	if (thumb) randomBytes(&parts.thumb, 1500 + seed % 1000, &seed);
+	if (config) {
+		size_t at = box(&parts.config, strcmp(f->thumbType, "av01") ? "hvcC" : "av1C");
+		randomBytes(&parts.config, 23 + seed % 50, &seed);
+		boxEnd(&parts.config, at);
+	}
+	exifItem(&parts.exif, f->orientation);
+	for (unsigned k = 1; k < f->thumbExtents; ++k)
+		parts.cut[k] = parts.thumb.len * k / f->thumbExtents;
+	parts.cut[f->thumbExtents] = parts.thumb.len;
+
+	size_t data = build(f, &parts, 0, &file);
+	if (build(f, &parts, data, &file) != data) abort();
+	if (!writeFile(path, file.b, file.len - f->truncate)) {
+		perror(path);
+		exit(1);
+	}
+
+	DYImageProbe p;
+	if (!ProbeImageFile(path, HEIF, &p)) {
+		fail(f->name, "not probed as a HEIF file");
+		goto done;
+	}
+	struct tm t = {.tm_year = 2021 - 1900, .tm_mon = 6, .tm_mday = 2, .tm_hour = 3, .tm_min = 4, .tm_sec = 5, .tm_isdst = -1};
+	if (p.datetime != mktime(&t)) fail(f->name, "wrong DateTimeOriginal");
+	if (p.orientation != f->orientation) fail(f->name, "wrong orientation");
+	if (p.width != PRIMARY_W || p.height != PRIMARY_H) fail(f->name, "wrong primary image size");
+	size_t len;
+	if (!thumb || f->thumbExtents > DY_MAX_EXTENTS) {
+		if (p.heifThumbExtentCount) fail(f->name, "found a thumbnail that can't be read");
+		goto done;
+	}
+	if (f->truncate) {
+		unsigned char *out = CopyHeifThumbnail(path, &p, &len);
+		if (out) fail(f->name, "copied a thumbnail that isn't all there");
+		free(out);
+		goto done;
+	}
+	if (memcmp(p.heifThumbType, f->thumbType, 4)) fail(f->name, "wrong thumbnail type");
+	if (p.heifThumbWidth != THUMB_W || p.heifThumbHeight != THUMB_H) fail(f->name, "wrong thumbnail size");
+	if (p.heifThumbExtentCount != f->thumbExtents) fail(f->name, "wrong number of thumbnail extents");
+	if (config && (p.heifThumbConfig.length != parts.config.len ||
+				   memcmp(file.b + p.heifThumbConfig.offset, parts.config.b, parts.config.len)))
+		fail(f->name, "wrong thumbnail decoder configuration");
+
+	unsigned char *out = CopyHeifThumbnail(path, &p, &len);
+	if (!out) {
+		fail(f->name, "thumbnail not copied");
+		goto done;
+	}
+	if (len < parts.thumb.len || memcmp(out + len - parts.thumb.len, parts.thumb.b, parts.thumb.len))
+		fail(f->name, "the copy doesn't end with the thumbnail");
+	if (!config) {
+		if (len != parts.thumb.len) fail(f->name, "a jpeg thumbnail wasn't copied as is");
+	} else {
+		// the copy is a HEIF file of its own, whose primary image is the thumbnail
+		DYImageProbe q;
+		if (memcmp(out + 8, strcmp(f->thumbType, "av01") ? "heic" : "avif", 4))
+			fail(f->name, "the copy has the wrong brand");
+		if (!contains(out, len - parts.thumb.len, &parts.config))
+			fail(f->name, "the copy lacks the decoder configuration");
+		if (!writeFile(path, out, len) || !ProbeImageFile(path, HEIF, &q))
+			fail(f->name, "the copy doesn't probe");
+		else if (q.width != THUMB_W || q.height != THUMB_H)
+			fail(f->name, "the copy has the wrong size");
+	}
+	free(out);
+done:
+	free(file.b);
+	free(parts.thumb.b);
+	free(parts.config.b);
+	free(parts.exif.b);
+	free(parts.primary.b);
+}
+
+int main(void) {
+	char path[] = "/tmp/heif_checkXXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+	for (unsigned i = 0; i < sizeof fixtures / sizeof *fixtures; ++i) {
+		int before = failures;
+		check(fixtures + i, i + 1, path);
+		if (failures == before) printf("%s: ok\n", fixtures[i].name);
+	}
+	unlink(path);
+	return failures != 0;
+}
@@ -0,0 +1,213 @@
+/*
+   Decodes synthetic lossless JPEG difference streams with ljpeg_diff()
+   three ways: with the lookahead table, with the table switched off
+   (the byte-at-a-time gethuff() path it falls back to), and with a
+   plain bit-by-bit canonical Huffman decoder written here from the
+   JPEG spec.  Fails if they disagree; prints how fast the first two go.
+
+   cc -std=gnu2x -O2 -DNO_JPEG -o huff_bench tests/huff_bench.c -lm -lpthread
+   ./huff_bench [millions of differences]
+ */
+#include "../dcraw.c"
+
+struct table {
+  const char *name;
+  uchar spec[16+17];                  /* counts of 1..16-bit codes, then the symbols */
+};
+
+static const struct table tables[] = {
+  /* the JPEG luminance DC table, as many 12-bit raws use */
+  { "12-bit, codes up to 9 bits",
+    { 0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0, 0,1,2,3,4,5,6,7,8,9,10,11 } },
+  /* noisier 14-bit data, where code and difference often pass 14 bits */
+  { "14-bit, codes up to 10 bits",
+    { 0,1,3,3,2,2,2,2,1,1,0,0,0,0,0,0, 6,5,7,4,8,3,9,2,10,1,11,0,12,13,14,15,16 } },
+  /* mostly flat areas: one-bit code for a zero difference */
+  { "flat, codes up to 16 bits",
+    { 1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,3, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16 } },
+};
+
+struct canon_code { unsigned code[17], len[17], first[18], count[17]; uchar sym[17]; int nsym; };
+
+/* the canonical codes the table describes (JPEG spec, annex C) */
+static void canonical (const uchar *spec, struct canon_code *cc)
+{
+  unsigned code = 0, len, i, k = 0;
+
+  memset (cc, 0, sizeof *cc);
+  for (len=1; len <= 16; len++, code <<= 1) {
+    cc->first[len] = code;
+    cc->count[len] = spec[len-1];
+    for (i=0; i < spec[len-1]; i++, k++) {
+      cc->sym[k] = spec[16+k];
+      cc->code[spec[16+k]] = code++;
+      cc->len[spec[16+k]] = len;
+    }
+  }
+  cc->nsym = k;
+}
+
+struct bitwriter { uchar *buf; size_t len; UINT64 acc; int n; };
+
+static void put_bits (struct bitwriter *w, unsigned v, int n)
+{
+  uchar c;
+
+  w->acc = w->acc << n | (v & ((1ULL << n) - 1));
+  for (w->n += n; w->n >= 8; ) {
+    c = w->acc >> (w->n -= 8);
+    w->buf[w->len++] = c;
+    if (c == 0xff) w->buf[w->len++] = 0;
+  }
+}
+
+static unsigned rnd (unsigned *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 16 & 0x7fff;
+}
+
+/* a symbol drawn as if by feeding random bits to the decoder, so each turns up 2^-length of the time */
+static int random_symbol (const struct canon_code *cc, unsigned *seed)
+{
+  unsigned code, len, k;
+
+  for (;;) {
+    code = 0;
+    for (k=0, len=1; len <= 16; len++) {
+      code = code << 1 | (rnd (seed) & 1);
+      if (code - cc->first[len] < cc->count[len]) return cc->sym[k + code - cc->first[len]];
+      k += cc->count[len];
+    }
+  }
+}
+
+/* the bit-by-bit reference, reading the stuffed stream from memory */
+struct bitreader { const uchar *buf; size_t pos; int byte, n; };
+
+static int get_bit (struct bitreader *r)
+{
+  if (!r->n) {
+    r->byte = r->buf[r->pos++];
+    if (r->byte == 0xff) r->pos++;    /* skip the stuffed zero */
+    r->n = 8;
+  }
+  return r->byte >> --r->n & 1;
+}
+
+static int ref_diff (struct bitreader *r, const struct canon_code *cc)
+{
+  unsigned code = 0, len, k = 0, s, diff, i;
+
+  for (len=1; len <= 16; len++) {
+    code = code << 1 | get_bit (r);
+    if (code - cc->first[len] < cc->count[len]) break;
+    k += cc->count[len];
+  }
+  if (len > 16) return INT_MIN;
+  s = cc->sym[k + code - cc->first[len]];
+  if (s == 16) return -32768;
+  for (diff=i=0; i < s; i++)
+    diff = diff << 1 | get_bit (r);
+  if (s && !(diff >> (s-1))) return (int) diff - (int) ((1 << s) - 1);
+  return diff;
+}
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* decodes n differences from the file into out with ljpeg_diff(), returning the seconds it took */
+static double decode (FILE *fp, ushort *huff, int *out, size_t n)
+{
+  double t;
+  size_t i;
+
+  ifp = fp;
+  fseek (ifp, 0, SEEK_SET);
+  zero_after_ff = 1;
+  dng_version = 0;
+  getbits(-1);
+  t = now();
+  for (i=0; i < n; i++)
+    out[i] = ljpeg_diff (huff);
+  return now() - t;
+}
+
+int main (int argc, char **argv)
+{
+  size_t n = (argc > 1 ? atof (argv[1]) : 4) * 1e6, i;
+  char path[] = "/tmp/huff_benchXXXXXX";
+  struct canon_code cc;
+  struct bitwriter w;
+  struct bitreader r;
+  int *expect, *got, t, s, v, fd, failed = 0, pass;
+  double secs, best[2];
+  ushort *huff;
+  unsigned seed;
+  FILE *fp;
+
+  if ((fd = mkstemp (path)) < 0 || !n) {
+    perror (path);
+    return 1;
+  }
+  close (fd);
+  dcraw_init();
+  expect = (int *) malloc (n * sizeof *expect);
+  got = (int *) malloc (n * sizeof *got);
+  w.buf = (uchar *) malloc (n * 8 + 16);
+  if (!expect || !got || !w.buf) return 1;
+  printf ("%-28s %10s %10s %8s\n", "", "table", "gethuff", "speedup");
+  for (t=0; t < sizeof tables / sizeof *tables; t++) {
+    canonical (tables[t].spec, &cc);
+    seed = t + 1;
+    w.len = w.acc = w.n = 0;
+    for (i=0; i < n; i++) {
+      s = random_symbol (&cc, &seed);
+      v = s && s < 16 ? (rnd (&seed) << 15 | rnd (&seed)) & ((1 << s) - 1) : 0;
+      put_bits (&w, cc.code[s], cc.len[s]);
+      if (s < 16) put_bits (&w, v, s);
+    }
+    put_bits (&w, 0x7f, 7);           /* pad out the last byte with ones */
+    w.buf[w.len++] = 0xff;            /* EOI */
+    w.buf[w.len++] = 0xd9;
+    if (!(fp = fopen (path, "w+b")) || fwrite (w.buf, 1, w.len, fp) != w.len) {
+      perror (path);
+      return 1;
+    }
+    memset (&r, 0, sizeof r);
+    r.buf = w.buf;
+    for (i=0; i < n; i++)
+      expect[i] = ref_diff (&r, &cc);
+
+    huff = make_decoder (tables[t].spec);
+    best[0] = best[1] = 1e9;
+    for (pass=0; pass < 6; pass++) {
+      /* alternate, so neither gets the warmer cache */
+      if (pass & 1) huff[0] &= ~HUFF_LUT;
+      else huff[0] |= HUFF_LUT;
+      if ((secs = decode (fp, huff, got, n)) < best[pass & 1]) best[pass & 1] = secs;
+      if (memcmp (got, expect, n * sizeof *got)) {
+        for (i=0; got[i] == expect[i]; i++);
+        printf ("%s: difference %zu is %d %s the table, not %d\n", tables[t].name, i,
+                got[i], pass & 1 ? "without" : "with", expect[i]);
+        failed = 1;
+        break;
+      }
+    }
+    if (pass == 6)
+      printf ("%-28s %6.1f M/s %6.1f M/s %7.2fx\n", tables[t].name,
+              n / best[0] * 1e-6, n / best[1] * 1e-6, best[1] / best[0]);
+    free (huff);
+    fclose (fp);
+  }
+  unlink (path);
+  free (expect);
+  free (got);
+  free (w.buf);
+  return failed;
+}
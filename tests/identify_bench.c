@@ -0,0 +1,191 @@
+/*
+   Checks adobe_coeff()'s sorted index against a plain in-order scan of
+   adobe_table (the first entry that prefixes "make model" wins) on
+   names made from every prefix: as is, cut short, lengthened, and with
+   another prefix's tail.  Then times a lookup both ways, and a full
+   ProbeRawFile() on synthetic DNGs whose colours come from the table.
+
+   cc -std=gnu2x -O2 -DNO_JPEG -o identify_bench tests/identify_bench.c -lm -lpthread
+   ./identify_bench [files]
+ */
+#include "../dcraw.c"
+#include "synth_dng.h"
+
+#define NENTRIES (int) (sizeof adobe_table / sizeof *adobe_table)
+
+static int linear_index (const char *name)
+{
+  int i;
+
+  for (i=0; i < NENTRIES; i++)
+    if (!strncmp (name, adobe_table[i].prefix, strlen (adobe_table[i].prefix)))
+      return i;
+  return -1;
+}
+
+static void reset_colours()
+{
+  int i, c;
+
+  black = maximum = 0;
+  raw_color = 1;
+  for (i=0; i < 4; i++)
+    FORC3 rgb_cam[c][i] = c == i;
+}
+
+/* adobe_coeff() as it was before the index */
+static void linear_coeff (const char *make, const char *model)
+{
+  double cam_xyz[4][3];
+  char name[130];
+  int i, j;
+
+  sprintf (name, "%s %s", make, model);
+  if ((i = linear_index (name)) < 0) return;
+  if (adobe_table[i].black)   black   = (ushort) adobe_table[i].black;
+  if (adobe_table[i].maximum) maximum = (ushort) adobe_table[i].maximum;
+  if (adobe_table[i].trans[0]) {
+    for (raw_color = j=0; j < 12; j++)
+      ((double *)cam_xyz)[j] = adobe_table[i].trans[j] / 10000.0;
+    cam_xyz_coeff (rgb_cam, cam_xyz);
+  }
+}
+
+/* what a lookup leaves behind */
+struct coeff { ushort black, maximum; int raw_color; float rgb_cam[3][4]; };
+
+static void result (struct coeff *r)
+{
+  memset (r, 0, sizeof *r);
+  r->black = black;
+  r->maximum = maximum;
+  r->raw_color = raw_color;
+  memcpy (r->rgb_cam, rgb_cam, sizeof rgb_cam);
+}
+
+static int checked;
+
+/* splits name at its first space into make and model, as identify() passes them;
+   returns 0 if the index and the scan disagree on it */
+static int check (const char *name, char (*names)[80], int *nnames)
+{
+  char make[80], model[80];
+  const char *sp = strchr (name, ' ');
+  struct coeff got, want;
+
+  if (!sp || sp - name >= sizeof make || strlen (sp+1) >= sizeof model) return 1;
+  memcpy (make, name, sp - name);
+  make[sp - name] = 0;
+  strcpy (model, sp+1);
+  checked++;
+  reset_colours();
+  adobe_coeff (make, model);
+  result (&got);
+  reset_colours();
+  linear_coeff (make, model);
+  result (&want);
+  if (memcmp (&got, &want, sizeof got)) {
+    printf ("\"%s\": the index and the scan disagree\n", name);
+    return 0;
+  }
+  if (*nnames < 8192) strcpy (names[(*nnames)++], name);
+  return 1;
+}
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main (int argc, char **argv)
+{
+  static char names[8192][80];
+  static const char *tails[] = { "", "0", " ", "X", " Mark II", "s", "-1", "\x7f", "!" };
+  int nfiles = argc > 1 ? atoi (argv[1]) : 300, nnames = 0, failed = 0;
+  int i, j, k, n, len, round;
+  char name[160], dir[] = "/tmp/identify_benchXXXXXX", path[64];
+  const char *p, *q;
+  double t, best[3] = { 1e9, 1e9, 1e9 };
+  struct dcraw_info info;
+  struct synth s;
+
+  if (nfiles < 1 || !mkdtemp (dir)) {
+    fprintf (stderr, "usage: %s [files]\n", argv[0]);
+    return 1;
+  }
+  dcraw_init();
+  for (i=0; i < NENTRIES; i++) {
+    p = adobe_table[i].prefix;
+    len = strlen (p);
+    for (k=0; k < sizeof tails / sizeof *tails; k++) {
+      snprintf (name, sizeof name, "%s%s", p, tails[k]);
+      failed |= !check (name, names, &nnames);
+    }
+    for (n=1; n < len; n++) {
+      snprintf (name, sizeof name, "%.*s", n, p);
+      failed |= !check (name, names, &nnames);
+    }
+    /* this prefix's head on the next one's tail, and upper case */
+    q = adobe_table[(i+1) % NENTRIES].prefix;
+    snprintf (name, sizeof name, "%.*s%s", len / 2, p, q + MIN (strlen (q), len / 2));
+    failed |= !check (name, names, &nnames);
+    for (j=0; p[j]; j++) name[j] = toupper (p[j]);
+    name[j] = 0;
+    failed |= !check (name, names, &nnames);
+  }
+  printf ("%d names from %d entries: %s\n", checked, NENTRIES, failed ? "FAILED" : "the index matches the scan");
+
+  for (round=0; round < 5; round++)
+    for (k=0; k < 2; k++) {
+      t = now();
+      for (i=0; i < nnames; i++) {
+        char *sp = strchr (names[i], ' ');
+        *sp = 0;
+        if (k) linear_coeff (names[i], sp+1);
+        else adobe_coeff (names[i], sp+1);
+        *sp = ' ';
+      }
+      if ((t = now() - t) < best[k]) best[k] = t;
+    }
+  printf ("adobe_coeff() %.2f us/lookup, %.2f us with the scan\n",
+          best[0] / nnames * 1e6, best[1] / nnames * 1e6);
+
+  for (i=0; i < nfiles; i++) {
+    memset (&s, 0, sizeof s);
+    s.w = 64;
+    s.h = 48;
+    s.orient = 1;
+    s.dim = 2;
+    memcpy (s.cfa, "\0\1\1\2", 4);
+    /* every file's make and model hit the table */
+    snprintf (name, sizeof name, "%s", adobe_table[i % NENTRIES].prefix);
+    if (!strchr (name, ' ')) strcat (name, " ");
+    *strchr (name, ' ') = 0;
+    s.make = name;
+    s.model = name + strlen (name) + 1;
+    s.no_matrix = 1;
+    snprintf (path, sizeof path, "%s/%d.dng", dir, i);
+    if (!write_dng (path, &s, i+1)) {
+      perror (path);
+      return 1;
+    }
+  }
+  for (round=0; round < 5; round++) {
+    t = now();
+    for (i=0; i < nfiles; i++) {
+      snprintf (path, sizeof path, "%s/%d.dng", dir, i);
+      ProbeRawFile (path, DCRAW_ALL, &info);
+    }
+    if ((t = now() - t) < best[2]) best[2] = t;
+  }
+  printf ("ProbeRawFile (DCRAW_ALL) %6.1f us/file, %.0f files/s\n", best[2] / nfiles * 1e6, nfiles / best[2]);
+  for (i=0; i < nfiles; i++) {
+    snprintf (path, sizeof path, "%s/%d.dng", dir, i);
+    unlink (path);
+  }
+  rmdir (dir);
+  return failed;
+}
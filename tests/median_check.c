@@ -0,0 +1,95 @@
+/*
+   Checks median_filter() (bands of rows, the vector selection network
+   and the scalar one at the row ends) against the whole-image swap
+   loop it replaced, on random images of awkward sizes, with one to
+   three passes and one to five lanes.  Half the images are noise over
+   the whole 16-bit range, so the differences run from -65535 to 65535
+   and the results clip at both ends.
+
+   cc -std=gnu2x -O1 -DNO_JPEG -o median_check tests/median_check.c -lm -lpthread
+   ./median_check
+ */
+#include "../dcraw.c"
+
+/* median_filter() before the bands */
+static void ref_median_filter()
+{
+  ushort (*pix)[4];
+  int pass, c, i, j, k, med[9];
+  static const uchar opt[] =        /* Optimal 9-element median search */
+  { 1,2, 4,5, 7,8, 0,1, 3,4, 6,7, 1,2, 4,5, 7,8,
+    0,3, 5,8, 4,7, 3,6, 1,4, 2,5, 4,7, 4,2, 6,4, 4,2 };
+
+  for (pass=1; pass <= med_passes; pass++) {
+    for (c=0; c < 3; c+=2) {
+      for (pix = image; pix < image+width*height; pix++)
+        pix[0][3] = pix[0][c];
+      for (pix = image+width; pix < image+width*(height-1); pix++) {
+        if ((pix-image+1) % width < 2) continue;
+        for (k=0, i = -width; i <= width; i += width)
+          for (j = i-1; j <= i+1; j++)
+            med[k++] = pix[j][3] - pix[j][1];
+        for (i=0; i < sizeof opt; i+=2)
+          if     (med[opt[i]] > med[opt[i+1]])
+            SWAP (med[opt[i]] , med[opt[i+1]]);
+        pix[0][c] = CLIP(med[4] + pix[0][1]);
+      }
+    }
+  }
+}
+
+int main()
+{
+  static const int sizes[][2] = {
+    { 3, 3 }, { 4, 7 }, { 5, 5 }, { 6, 2 }, { 9, 65 }, { 13, 64 },
+    { 64, 129 }, { 257, 130 }, { 641, 193 }, { 1003, 67 },
+  };
+  ushort (*got)[4], (*want)[4];
+  size_t bytes;
+  unsigned seed = 1;
+  int s, noise, passes, lanes, workers, i, c, cases = 0, failed = 0;
+
+  dcraw_init();
+  workers = max_workers;
+  for (s=0; s < sizeof sizes / sizeof *sizes; s++)
+    for (noise=0; noise < 2; noise++)
+      for (passes=1; passes <= 3; passes++)
+        for (lanes=1; lanes <= 5; lanes += 2) {
+          width = sizes[s][0];
+          height = sizes[s][1];
+          bytes = (size_t) width * height * sizeof *image;
+          image = (ushort (*)[4]) malloc (bytes);
+          want = (ushort (*)[4]) malloc (bytes);
+          if (!image || !want) return 1;
+          for (i=0; i < width*height; i++)
+            FORC4 {
+              seed = seed * 1103515245 + 12345;
+              /* smooth colours with a little noise, or noise alone */
+              image[i][c] = noise ? seed >> 16 :
+                  (i % width * 97 + i / width * 31 + c * 5000 + (seed >> 24)) & 0x3fff;
+            }
+          memcpy (want, image, bytes);
+          med_passes = passes;
+          max_workers = lanes;
+          median_filter();
+          got = image;
+          image = want;
+          ref_median_filter();
+          image = got;
+          cases++;
+          for (i=0; i < width*height; i++)
+            if (memcmp (image[i], want[i], 3 * sizeof **image)) {
+              printf ("%dx%d, %s, %d passes, %d lanes: pixel %d,%d differs\n",
+                      width, height, noise ? "noise" : "smooth", passes, lanes,
+                      i % width, i / width);
+              failed = 1;
+              break;
+            }
+          free (image);
+          free (want);
+        }
+  max_workers = workers;
+  image = 0;
+  printf ("median_filter: %d cases, %s\n", cases, failed ? "FAILED" : "ok");
+  return failed;
+}
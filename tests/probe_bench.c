@@ -0,0 +1,475 @@
+//Copyright 2005-2023 Dominic Yu. Some rights reserved.
+//This work is licensed under the Creative Commons
+//Attribution-NonCommercial-ShareAlike License. To view a copy of this
+//license, visit http://creativecommons.org/licenses/by-nc-sa/2.0/ or send
+//a letter to Creative Commons, 559 Nathan Abbott Way, Stanford,
+//California 94305, USA.
+
+// Reads the capture date out of JPEG and HEIF files laid out the ways cameras and phones lay them out,
+// once with the stdio marker and box walk the date sort used to do and once with ProbeImageFile, and
+// reports the system calls and time each takes per file. The old path runs over a stdio stream that counts
+// its reads and seeks, buffered by st_blksize like fopen's. Fails if the two disagree on a date, or if the
+// probe needs more than open, fstat, one read and close for a file whose metadata is in its first read.
+//
+//   cc -std=gnu2x -O2 -Iexiftags -o probe_bench tests/probe_bench.c exiftags/DYImageProbe.c exiftags/exifutil.c exiftags/tagdefs.c
+//   ./probe_bench [files per layout]
+
+#define _GNU_SOURCE // fopencookie
+#include "DYImageProbe.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// the old path
+
+typedef struct {
+	int fd;
+	unsigned syscalls;
+} Counted;
+
+static int countedRead(Counted *c, char *buf, size_t n) {
+	c->syscalls++;
+	return (int)read(c->fd, buf, n);
+}
+static off_t countedSeek(Counted *c, off_t off, int whence) {
+	c->syscalls++;
+	return lseek(c->fd, off, whence);
+}
+static int countedClose(Counted *c) {
+	c->syscalls++;
+	return close(c->fd);
+}
+
+#ifdef __APPLE__
+static int cookieRead(void *c, char *buf, int n) { return countedRead(c, buf, n); }
+static fpos_t cookieSeek(void *c, fpos_t off, int whence) { return countedSeek(c, off, whence); }
+static int cookieClose(void *c) { return countedClose(c); }
+#else
+static ssize_t cookieRead(void *c, char *buf, size_t n) { return countedRead(c, buf, n); }
+static int cookieSeek(void *c, off64_t *off, int whence) {
+	off_t r = countedSeek(c, *off, whence);
+	if (r == -1) return -1;
+	*off = r;
+	return 0;
+}
+static int cookieClose(void *c) { return countedClose(c); }
+#endif
+
+// fopen, with the calls it makes counted
+static FILE *countedOpen(const char *path, Counted *c) {
+	struct stat st;
+	c->syscalls = 2;
+	if ((c->fd = open(path, O_RDONLY)) == -1) return NULL;
+	fstat(c->fd, &st);
+#ifdef __APPLE__
+	FILE *f = funopen(c, cookieRead, NULL, cookieSeek, cookieClose);
+#else
+	FILE *f = fopencookie(c, "r", (cookie_io_functions_t){cookieRead, NULL, cookieSeek, cookieClose});
+#endif
+	if (f) setvbuf(f, NULL, _IOFBF, st.st_blksize);
+	return f;
+}
+
+// what ExifDatetimeForFile did before the probe, trimmed to the date
+static uint16_t read2byte(FILE * f, char o) {
+	int b = fgetc(f), c;
+	if (b == EOF || (c = fgetc(f)) == EOF) return 0;
+	if (o) return (b << 8) | c;
+	return (c << 8) | b;
+}
+static uint16_t read2bytem(FILE * f) {
+	int b = fgetc(f), c;
+	if (b == EOF || (c = fgetc(f)) == EOF) return 0;
+	return (b << 8) | c;
+}
+static uint32_t read4byte(FILE * f, char o) {
+	unsigned char b[4];
+	if (4 != fread(b, 1, 4, f)) return 0;
+	if (o) return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+	return (b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
+}
+static uint32_t read4bytem(FILE * f) {
+	unsigned char b[4];
+	if (4 != fread(b, 1, 4, f)) return 0;
+	return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static bool SeekExifInHeif(FILE * f) {
+	bool inited = false;
+	for (;;) {
+		off_t boxStart = ftello(f);
+		uint64_t boxLen = read4bytem(f);
+		if (boxLen < 8) return false;
+		unsigned char type[4];
+		if (4 != fread(type, 1, 4, f)) return false;
+		if (!inited) {
+			inited = true;
+			if (memcmp(type, "ftyp", 4)) return false;
+		}
+		if (memcmp(type, "meta", 4)) {
+			if (fseeko(f, boxStart+boxLen, SEEK_SET)) return false;
+			continue;
+		}
+		off_t metaEnd = boxStart + boxLen;
+		fseek(f, 4, SEEK_CUR);
+		uint32_t exifID = UINT32_MAX;
+		while ((boxStart = ftello(f)) < metaEnd) {
+			boxLen = read4bytem(f);
+			if (boxLen < 8) return false;
+			if (4 != fread(type, 1, 4, f)) return false;
+			int version;
+			if (!memcmp(type, "iinf", 4)) {
+				version = fgetc(f);
+				fseek(f, 3, SEEK_CUR);
+				uint32_t n = version ? read4bytem(f) : read2bytem(f);
+				for (uint32_t i = 0; i < n; ++i) {
+					off_t eStart = ftello(f);
+					uint32_t eLen = read4bytem(f);
+					if (eLen < 16) return false;
+					fseek(f, 4, SEEK_CUR);
+					version = fgetc(f);
+					fseek(f, 3, SEEK_CUR);
+					uint32_t itemID = version <= 2 ? read2bytem(f) : read4bytem(f);
+					fseek(f, 2, SEEK_CUR);
+					fread(type, 1, 4, f);
+					if (!memcmp(type, "Exif", 4))
+						exifID = itemID;
+					fseeko(f, eStart+eLen, SEEK_SET);
+				}
+			} else if (!memcmp(type, "iloc", 4)) {
+				version = fgetc(f);
+				fseek(f, 3, SEEK_CUR);
+				uint16_t config = read2bytem(f);
+				uint16_t offset_size = (config >> 12) & 0xF, length_size = (config >> 8) & 0xF;
+				uint32_t n = version < 2 ? read2bytem(f) : read4bytem(f);
+				for (uint32_t i = 0; i < n; ++i) {
+					uint32_t myId = version < 2 ? read2bytem(f) : read4bytem(f);
+					if (version >= 1) fseek(f, 2, SEEK_CUR);
+					fseek(f, 2, SEEK_CUR);
+					uint16_t numExtents = read2bytem(f);
+					if (myId != exifID) {
+						fseek(f, numExtents*(offset_size+length_size), SEEK_CUR);
+						continue;
+					}
+					off_t exifOffset = read4bytem(f);
+					fseeko(f, exifOffset+4, SEEK_SET);
+					unsigned char buf[6];
+					return 6 == fread(buf, 1, 6, f) && !memcmp(buf, "Exif\0\0", 6);
+				}
+			}
+			fseeko(f, boxStart + boxLen, SEEK_SET);
+		}
+	}
+}
+
+static bool SeekExifInJpeg(FILE * infile) {
+	int a = fgetc(infile);
+	if (a != 0xff || fgetc(infile) != 0xD8) return false;
+	for(;;){
+		int prev = 0, marker = 0;
+		for (a=0;;a++){
+			marker = fgetc(infile);
+			if (marker == EOF) return false;
+			if (marker != 0xff && prev == 0xff) break;
+			prev = marker;
+		}
+		if (a > 10) return false;
+		int itemlen = read2bytem(infile);
+		if (itemlen < 2) return false;
+		unsigned char buf[6];
+		switch(marker){
+			case 0xDA:
+			case 0xD9:
+				return false;
+			case 0xE1:
+				return 6 == fread(buf, 1, 6, infile) && !memcmp(buf, "Exif\0\0", 6);
+		}
+		fseek(infile, itemlen-2, SEEK_CUR);
+	}
+}
+
+static time_t oldDatetime(const char *path, DYExiftagsFileType type, unsigned *syscalls) {
+	Counted c;
+	FILE *f = countedOpen(path, &c);
+	time_t result = -1;
+	if (!f) return -1;
+	if (type == JPEG ? SeekExifInJpeg(f) : SeekExifInHeif(f)) {
+		long b0 = ftell(f);
+		unsigned char buf[20] = "";
+		fread(buf, 1, 2, f);
+		char o = !memcmp(buf, "MM", 2);
+		uint32_t exifOffset = 0, stringOffset = 0;
+		if (read2byte(f, o) == 42 && !fseek(f, b0 + read4byte(f, o), SEEK_SET)) {
+			for (uint16_t n = read2byte(f, o); n--; fseek(f, 10, SEEK_CUR))
+				if (read2byte(f, o) == 0x8769) {
+					fseek(f, 6, SEEK_CUR);
+					exifOffset = read4byte(f, o);
+					break;
+				}
+		}
+		if (exifOffset && !fseek(f, b0+exifOffset, SEEK_SET)) {
+			for (uint16_t n = read2byte(f, o); n--; fseek(f, 10, SEEK_CUR))
+				if (read2byte(f, o) == 0x9003) {
+					fseek(f, 6, SEEK_CUR);
+					stringOffset = read4byte(f, o);
+					break;
+				}
+		}
+		struct tm t = {0};
+		if (stringOffset && !fseek(f, b0+stringOffset, SEEK_SET) && 20 == fread(buf, 1, 20, f) &&
+			sscanf((char *)buf, "%d:%d:%d %d:%d:%d", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec) == 6) {
+			t.tm_year -= 1900;
+			t.tm_mon -= 1;
+			t.tm_isdst = -1;
+			result = mktime(&t);
+		}
+	}
+	fclose(f);
+	*syscalls = c.syscalls;
+	return result;
+}
+
+// the files
+
+typedef struct {
+	unsigned char *b;
+	size_t len, cap;
+} Buf;
+
+static void put(Buf *o, const void *data, size_t n) {
+	if (o->len + n > o->cap) {
+		o->cap = (o->len + n) * 2;
+		if (!(o->b = realloc(o->b, o->cap))) abort();
+	}
+	if (data) memcpy(o->b + o->len, data, n);
+	else memset(o->b + o->len, 0, n);
+	o->len += n;
+}
+static void put1(Buf *o, unsigned v) { unsigned char c = v; put(o, &c, 1); }
+static void put2(Buf *o, unsigned v) { put1(o, v >> 8); put1(o, v); }
+static void put4(Buf *o, uint32_t v) { put2(o, v >> 16); put2(o, v); }
+static void set2(Buf *o, size_t at, unsigned v) { o->b[at] = v >> 8; o->b[at+1] = v; }
+static void set4(Buf *o, size_t at, uint32_t v) { set2(o, at, v >> 16); set2(o, at+2, v); }
+
+// "Exif\0\0" and a big-endian TIFF block: IFD0 with the orientation, the Exif SubIFD with
+// DateTimeOriginal, then pad bytes of maker-note stand-in
+static void exifBlock(Buf *o, unsigned seed, size_t pad) {
+	char date[20];
+	snprintf(date, sizeof date, "20%02u:%02u:%02u 10:20:30", seed % 23, seed % 12 + 1, seed % 28 + 1);
+	put(o, "Exif\0\0MM\0*", 10);
+	put4(o, 8);
+	put2(o, 2);
+	put2(o, 0x0112); put2(o, 3); put4(o, 1); put2(o, seed % 8 + 1); put2(o, 0);
+	put2(o, 0x8769); put2(o, 4); put4(o, 1); put4(o, 38);
+	put4(o, 0);
+	put2(o, 1);
+	put2(o, 0x9003); put2(o, 2); put4(o, 20); put4(o, 56);
+	put4(o, 0);
+	put(o, date, 20);
+	put(o, NULL, pad);
+}
+
+static void segment(Buf *o, unsigned marker, const Buf *data, size_t filler) {
+	put2(o, marker);
+	put2(o, (unsigned)(2 + (data ? data->len : filler)));
+	if (data) put(o, data->b, data->len);
+	else put(o, NULL, filler);
+}
+
+// a JPEG whose APP1 comes after app2Count APP2 segments of 60 KB, such as an ICC profile or an MPF index
+static void makeJpeg(Buf *o, unsigned seed, size_t exifPad, unsigned app2Count) {
+	Buf exif = {0};
+	exifBlock(&exif, seed, exifPad);
+	put2(o, 0xFFD8);
+	for (unsigned i = 0; i < app2Count; ++i)
+		segment(o, 0xFFE2, NULL, 60000);
+	segment(o, 0xFFE1, &exif, 0);
+	if (!app2Count) segment(o, 0xFFE2, NULL, 3000);
+	segment(o, 0xFFDB, NULL, 130);
+	static const unsigned char sof[] = {8, 0x0b, 0xd0, 0x0f, 0xc0, 3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1};
+	put2(o, 0xFFC0);
+	put2(o, 2 + sizeof sof);
+	put(o, sof, sizeof sof);
+	segment(o, 0xFFDA, NULL, 10);
+	put(o, NULL, 64000); // the scan
+	put2(o, 0xFFD9);
+	free(exif.b);
+}
+
+static size_t box(Buf *o, const char *type) {
+	size_t at = o->len;
+	put4(o, 0);
+	put(o, type, 4);
+	return at;
+}
+static void boxEnd(Buf *o, size_t at) { set4(o, at, (uint32_t)(o->len - at)); }
+
+// ftyp, meta, mdat with the Exif item after exifAfter bytes of image data; or with mdat and a free
+// box of freeLen bytes before meta
+static void makeHeif(Buf *o, unsigned seed, size_t exifAfter, size_t freeLen) {
+	Buf exif = {0};
+	exifBlock(&exif, seed, 2000);
+	size_t at = box(o, "ftyp");
+	put(o, "heic\0\0\0\0mif1heic", 16);
+	boxEnd(o, at);
+	if (freeLen) {
+		at = box(o, "free");
+		put(o, NULL, freeLen);
+		boxEnd(o, at);
+	}
+	size_t meta = box(o, "meta");
+	put4(o, 0);
+	at = box(o, "hdlr");
+	put(o, NULL, 8);
+	put(o, "pict", 4);
+	put(o, NULL, 13);
+	boxEnd(o, at);
+	at = box(o, "pitm");
+	put4(o, 0);
+	put2(o, 1);
+	boxEnd(o, at);
+	at = box(o, "iinf");
+	put4(o, 0);
+	put2(o, 2);
+	for (unsigned id = 1; id <= 2; ++id) {
+		size_t infe = box(o, "infe");
+		put4(o, 2 << 24);
+		put2(o, id);
+		put2(o, 0);
+		put(o, id == 1 ? "hvc1" : "Exif", 4);
+		put1(o, 0);
+		boxEnd(o, infe);
+	}
+	boxEnd(o, at);
+	at = box(o, "iloc");
+	put4(o, 0);
+	put1(o, 0x44);
+	put1(o, 0);
+	put2(o, 2);
+	size_t offsets = o->len;
+	for (unsigned id = 1; id <= 2; ++id) {
+		put2(o, id);
+		put2(o, 0);
+		put2(o, 1);
+		put4(o, 0); // filled in below
+		put4(o, id == 1 ? (uint32_t)exifAfter + 1 : 4 + (uint32_t)exif.len);
+	}
+	boxEnd(o, at);
+	at = box(o, "iprp");
+	size_t ipco = box(o, "ipco");
+	size_t ispe = box(o, "ispe");
+	put4(o, 0);
+	put4(o, 4032);
+	put4(o, 3024);
+	boxEnd(o, ispe);
+	boxEnd(o, ipco);
+	size_t ipma = box(o, "ipma");
+	put4(o, 0);
+	put4(o, 1);
+	put2(o, 1);
+	put1(o, 1);
+	put1(o, 1);
+	boxEnd(o, ipma);
+	boxEnd(o, at);
+	boxEnd(o, meta);
+	at = box(o, "mdat");
+	set4(o, offsets + 6, (uint32_t)o->len);
+	put(o, NULL, exifAfter + 1);
+	set4(o, offsets + 20, (uint32_t)o->len);
+	put4(o, 6);
+	put(o, exif.b, exif.len);
+	put(o, NULL, 50000);
+	boxEnd(o, at);
+	free(exif.b);
+}
+
+typedef struct {
+	const char *name;
+	DYExiftagsFileType type;
+	bool inHead; // the probe should find everything in its first read
+	size_t exifPad, exifAfter, freeLen;
+	unsigned app2Count;
+} Layout;
+
+static const Layout layouts[] = {
+	{"JPEG, small APP1 first", JPEG, true, 200},
+	{"JPEG, 48 KB APP1 with maker notes", JPEG, true, 48000},
+	{"JPEG, APP1 behind 180 KB of APP2", JPEG, false, 2000, .app2Count = 3},
+	{"HEIF, Exif at the start of mdat", HEIF, true, .exifAfter = 0},
+	{"HEIF, Exif behind 1 MB of image data", HEIF, false, .exifAfter = 1 << 20},
+	{"HEIF, meta behind a 200 KB free box", HEIF, false, .exifAfter = 0, .freeLen = 200000},
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	unsigned nfiles = argc > 1 ? atoi(argv[1]) : 50, rounds = 5;
+	char dir[] = "/tmp/probe_benchXXXXXX", path[64];
+	int failed = 0;
+	if (!nfiles || !mkdtemp(dir)) {
+		fprintf(stderr, "usage: %s [files per layout]\n", argv[0]);
+		return 1;
+	}
+	printf("%-40s %17s %17s\n", "", "syscalls/file", "us/file");
+	printf("%-40s %8s %8s %8s %8s\n", "", "old", "probe", "old", "probe");
+	for (unsigned l = 0; l < sizeof layouts / sizeof *layouts; ++l) {
+		const Layout *L = layouts + l;
+		for (unsigned i = 0; i < nfiles; ++i) {
+			Buf o = {0};
+			if (L->type == JPEG) makeJpeg(&o, i, L->exifPad, L->app2Count);
+			else makeHeif(&o, i, L->exifAfter, L->freeLen);
+			snprintf(path, sizeof path, "%s/%u", dir, i);
+			FILE *fp = fopen(path, "wb");
+			if (!fp || fwrite(o.b, 1, o.len, fp) != o.len || fclose(fp)) {
+				perror(path);
+				return 1;
+			}
+			free(o.b);
+		}
+		unsigned long long oldCalls = 0, newCalls = 0;
+		unsigned worst = 0;
+		double oldTime = 0, newTime = 0;
+		for (unsigned r = 0; r < rounds; ++r) {
+			for (unsigned i = 0; i < nfiles; ++i) {
+				snprintf(path, sizeof path, "%s/%u", dir, i);
+				unsigned calls = 0;
+				DYImageProbe p;
+				double t0 = now();
+				time_t old = oldDatetime(path, L->type, &calls);
+				double t1 = now();
+				bool ok = ProbeImageFile(path, L->type, &p);
+				double t2 = now();
+				oldTime += t1 - t0;
+				newTime += t2 - t1;
+				oldCalls += calls;
+				newCalls += p.syscalls;
+				if (worst < p.syscalls) worst = p.syscalls;
+				if (!ok || old == -1 || p.datetime != old) {
+					if (!r) printf("%s: file %u: the probe's date doesn't match\n", L->name, i);
+					failed = 1;
+				}
+			}
+		}
+		double n = (double)nfiles * rounds;
+		printf("%-40s %8.1f %8.1f %8.1f %8.1f\n", L->name, oldCalls / n, newCalls / n, oldTime / n * 1e6, newTime / n * 1e6);
+		if (L->inHead && worst > 4) {
+			printf("%s: the probe made %u system calls for a file whose metadata is in its first read\n", L->name, worst);
+			failed = 1;
+		}
+		for (unsigned i = 0; i < nfiles; ++i) {
+			snprintf(path, sizeof path, "%s/%u", dir, i);
+			unlink(path);
+		}
+	}
+	rmdir(dir);
+	return failed;
+}
@@ -0,0 +1,96 @@
+/*
+   Times ProbeRawFile() per file on synthetic DNGs for the masks the
+   browser asks for: the date alone (sorting by date), the date and
+   EXIF block (the info panel), and everything (thumbnails).  Fails if
+   the cheaper masks disagree with DCRAW_ALL on what they fill in.
+
+   cc -std=gnu2x -O2 -DNO_JPEG -o probe_raw_bench tests/probe_raw_bench.c -lm -lpthread
+   ./probe_raw_bench [files]
+ */
+#include "../dcraw.c"
+#include "synth_dng.h"
+
+static const char *cameras[][2] = {
+  { 0, 0 }, { "Canon", "EOS 5D Mark III" }, { "NIKON CORPORATION", "NIKON D850" },
+  { "SONY", "ILCE-7RM3" }, { "FUJIFILM", "X-T3" }, { "OLYMPUS CORPORATION", "E-M1MarkII" },
+  { "Panasonic", "DC-GH5" }, { "PENTAX", "K-1" },
+};
+#define NCAMERAS (sizeof cameras / sizeof *cameras)
+
+static const struct { const char *name; unsigned wanted; } masks[] = {
+  { "DCRAW_TIMESTAMP", DCRAW_TIMESTAMP },
+  { "DCRAW_TIMESTAMP | DCRAW_EXIF", DCRAW_TIMESTAMP | DCRAW_EXIF },
+  { "DCRAW_ALL", DCRAW_ALL },
+};
+#define NMASKS (sizeof masks / sizeof *masks)
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main (int argc, char **argv)
+{
+  int nfiles = argc > 1 ? atoi (argv[1]) : 200, i, m, round, failed = 0;
+  char dir[] = "/tmp/probe_raw_benchXXXXXX", path[64];
+  struct dcraw_info info, all;
+  double t, best[NMASKS];
+  struct synth s;
+
+  if (nfiles < 1 || !mkdtemp (dir)) {
+    fprintf (stderr, "usage: %s [files]\n", argv[0]);
+    return 1;
+  }
+  dcraw_init();
+  for (i=0; i < nfiles; i++) {
+    memset (&s, 0, sizeof s);
+    s.w = 256;
+    s.h = 192;
+    s.orient = "1368"[i & 3] - '0';
+    s.dim = 2;
+    memcpy (s.cfa, "\0\1\1\2", 4);
+    s.preview = i % 3 ? 160 : 0;
+    s.make = cameras[i % NCAMERAS][0];
+    s.model = cameras[i % NCAMERAS][1];
+    s.no_matrix = i % NCAMERAS != 0;
+    snprintf (path, sizeof path, "%s/%d.dng", dir, i);
+    if (!write_dng (path, &s, i+1)) {
+      perror (path);
+      return 1;
+    }
+  }
+  for (m=0; m < NMASKS; m++) best[m] = 1e9;
+  for (round=0; round < 5; round++)
+    for (m=0; m < NMASKS; m++) {
+      t = now();
+      for (i=0; i < nfiles; i++) {
+        snprintf (path, sizeof path, "%s/%d.dng", dir, i);
+        if (!ProbeRawFile (path, masks[m].wanted, &info)) {
+          printf ("%s: not probed with %s\n", path, masks[m].name);
+          failed = 1;
+        }
+      }
+      if ((t = now() - t) < best[m]) best[m] = t;
+    }
+  for (i=0; i < nfiles; i++) {
+    snprintf (path, sizeof path, "%s/%d.dng", dir, i);
+    ProbeRawFile (path, DCRAW_ALL, &all);
+    for (m=0; m < NMASKS; m++) {
+      ProbeRawFile (path, masks[m].wanted, &info);
+      if (info.timestamp != all.timestamp ||
+          ((masks[m].wanted & DCRAW_EXIF) && (info.exif_offset != all.exif_offset ||
+                                               info.exif_length != all.exif_length))) {
+        printf ("%s: %s disagrees with DCRAW_ALL\n", path, masks[m].name);
+        failed = 1;
+      }
+    }
+    unlink (path);
+  }
+  rmdir (dir);
+  for (m=0; m < NMASKS; m++)
+    printf ("%-30s %6.1f us/file\n", masks[m].name, best[m] / nfiles * 1e6);
+  return failed;
+}
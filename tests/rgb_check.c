@@ -0,0 +1,111 @@
+/*
+   Checks convert_to_rgb() (bands of rows, and the matrix applied one
+   pixel per vector) against the scalar loop it replaced, image and
+   histogram both, on random images of awkward sizes: three and four
+   colours, every output colour space, raw colour and document mode,
+   and one to five lanes.  The matrices are random too, with negative
+   terms and gains past one, so the results clip at both ends.
+
+   cc -std=gnu2x -O1 -DNO_JPEG -o rgb_check tests/rgb_check.c -lm -lpthread
+   ./rgb_check
+ */
+#include "../dcraw.c"
+
+/* the loop at the end of convert_to_rgb() before the bands */
+static void ref_convert_to_rgb (float (*cols)[4], int (*hist)[0x2000])
+{
+  ushort *img;
+  int row, col, c;
+  float out[3];
+
+  memset (hist, 0, sizeof histogram);
+  for (img=image[0], row=0; row < height; row++)
+    for (col=0; col < width; col++, img+=4) {
+      if (!raw_color) {
+        out[0] = out[1] = out[2] = 0;
+        FORCC {
+          out[0] += cols[c][0] * img[c];
+          out[1] += cols[c][1] * img[c];
+          out[2] += cols[c][2] * img[c];
+        }
+        FORC3 img[c] = CLIP((int) out[c]);
+      }
+      else if (document_mode)
+        img[0] = img[fcol(row,col)];
+      FORCC hist[c][img[c] >> 3]++;
+    }
+}
+
+int main()
+{
+  static const int sizes[][2] = {
+    { 1, 1 }, { 7, 3 }, { 65, 64 }, { 130, 129 }, { 641, 200 },
+  };
+  static int want_hist[4][0x2000];
+  ushort (*got)[4], (*want)[4];
+  struct rgb_args ra;
+  size_t bytes;
+  unsigned seed = 1;
+  int s, ncol, oc, doc, lanes, workers, i, c, cases = 0, failed = 0;
+
+  dcraw_init();
+  workers = max_workers;
+  filters = 0x94949494;
+  top_margin = left_margin = 0;
+  for (s=0; s < sizeof sizes / sizeof *sizes; s++)
+    for (ncol=3; ncol <= 4; ncol++)
+      for (oc=0; oc <= 6; oc++)
+        for (doc=0; doc < 2; doc++)
+          for (lanes=1; lanes <= 5; lanes += 2) {
+            width = sizes[s][0];
+            height = sizes[s][1];
+            bytes = (size_t) width * height * sizeof *image;
+            image = (ushort (*)[4]) malloc (bytes);
+            want = (ushort (*)[4]) malloc (bytes);
+            if (!image || !want) return 1;
+            for (i=0; i < width*height; i++)
+              FORC4 image[i][c] = (seed = seed * 1103515245 + 12345) >> 16;
+            for (i=0; i < 3; i++)
+              FORC4 {
+                seed = seed * 1103515245 + 12345;
+                rgb_cam[i][c] = (int) (seed >> 16) / 16384.0 - 1.5;
+              }
+            memcpy (want, image, bytes);
+            colors = ncol;
+            output_color = oc;
+            document_mode = doc;
+            raw_color = 0;
+            /* the matrix convert_to_rgb() will use, and its raw_color */
+            convert_to_rgb_setup (&ra);
+            free (oprof);
+            raw_color = 0;
+            max_workers = lanes;
+            convert_to_rgb();
+            free (oprof);
+            oprof = 0;
+            colors = ncol;
+            got = image;
+            image = want;
+            ref_convert_to_rgb (ra.cols, want_hist);
+            image = got;
+            cases++;
+            for (i=0; i < width*height; i++)
+              if (memcmp (image[i], want[i], sizeof *image)) {
+                printf ("%dx%d, %d colours, output %d, document %d, %d lanes: pixel %d,%d differs\n",
+                        width, height, ncol, oc, doc, lanes, i % width, i / width);
+                failed = 1;
+                break;
+              }
+            if (memcmp (histogram, want_hist, sizeof histogram)) {
+              printf ("%dx%d, %d colours, output %d, document %d, %d lanes: histogram differs\n",
+                      width, height, ncol, oc, doc, lanes);
+              failed = 1;
+            }
+            free (image);
+            free (want);
+          }
+  max_workers = workers;
+  image = 0;
+  printf ("convert_to_rgb: %d cases, %s\n", cases, failed ? "FAILED" : "ok");
+  return failed;
+}
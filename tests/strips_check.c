@@ -0,0 +1,72 @@
+/*
+   Checks that DecodeRawFile() gives the same pixels whether it renders
+   the image a band of rows at a time (render_strips) or runs the
+   whole-image stages, on synthetic DNGs of awkward sizes, CFA patterns
+   and orientations.
+
+   cc -std=gnu2x -O1 -DNO_JPEG -o strips_check tests/strips_check.c -lm -lpthread
+   ./strips_check
+ */
+#include "../dcraw.c"
+#include "synth_dng.h"
+
+static const struct synth synths[] = {
+  {   96,  80, 1, 2, {0,1,1,2} },
+  {   96,  80, 6, 2, {1,0,2,1} },
+  {   23, 129, 1, 2, {0,1,1,2} },
+  {  640, 130, 1, 2, {1,0,2,1} },
+  {  257,  65, 3, 2, {2,1,1,0} },
+  { 1203, 799, 5, 2, {0,1,1,2} },
+  { 1203, 799, 8, 2, {1,2,0,1} },
+  {  600, 402, 6, 6, {1,1,0,1,1,2, 1,1,2,1,1,0, 2,0,1,0,2,1,
+                      1,1,2,1,1,0, 1,1,0,1,1,2, 0,2,1,2,0,1} },
+};
+
+int main()
+{
+  char path[] = "/tmp/strips_checkXXXXXX", *out[2];
+  size_t size[2], stride[2], i, j, bad;
+  unsigned short w[2], h[2], rw, rh;
+  int fd, k, nout, diff, maxdiff, failed = 0;
+
+  if ((fd = mkstemp (path)) < 0) {
+    perror (path);
+    return 1;
+  }
+  close (fd);
+  dcraw_init();
+  for (i=0; i < sizeof synths / sizeof *synths; i++) {
+    const struct synth *s = synths + i;
+    if (!write_dng (path, s, i+1)) {
+      perror (path);
+      failed = 1;
+      break;
+    }
+    for (nout=3; nout <= 4; nout++) {
+      for (k=0; k < 2; k++) {
+        no_strips = k;
+        out[k] = DecodeRawFile (path, nout, size+k, stride+k, w+k, h+k, &rw, &rh);
+      }
+      bad = maxdiff = 0;
+      if (!out[0] || !out[1] || size[0] != size[1] || stride[0] != stride[1] ||
+          w[0] != w[1] || h[0] != h[1])
+        bad = -1;
+      else
+        for (j=0; j < size[0]; j++)
+          if ((diff = abs ((uchar) out[0][j] - (uchar) out[1][j]))) {
+            bad++;
+            if (maxdiff < diff) maxdiff = diff;
+          }
+      printf ("%ux%u cfa %ux%u orientation %u, %d channels: ",
+              s->w, s->h, s->dim, s->dim, s->orient, nout);
+      if (bad) {
+        printf ("%zd bytes differ, by up to %d\n", bad, maxdiff);
+        failed = 1;
+      } else printf ("ok\n");
+      free (out[0]);
+      free (out[1]);
+    }
+  }
+  unlink (path);
+  return failed;
+}
@@ -0,0 +1,144 @@
+/*
+   Synthetic little-endian DNGs for the checks and benchmarks in this
+   directory: a Bayer or X-Trans raw in IFD0, an EXIF IFD with the
+   capture date, and optionally a JPEG preview in a SubIFD.  Include it
+   after dcraw.c, or after <stdio.h>, <stdlib.h> and <string.h>.
+ */
+struct synth {
+  unsigned w, h, orient, dim;        /* dim x dim CFA pattern */
+  unsigned char cfa[36];
+  unsigned preview;                  /* width of a 4:3 JPEG preview, or 0 */
+  const char *make, *model;          /* "Synth" "DNG" if not given */
+  int no_matrix;                     /* leave the colours to adobe_coeff() */
+};
+
+static void synth_put2 (unsigned char *p, unsigned v) { p[0] = v; p[1] = v >> 8; }
+static void synth_put4 (unsigned char *p, unsigned v) { synth_put2 (p, v); synth_put2 (p+2, v >> 16); }
+
+/* copies a tag's data to pos, and returns the value for its entry:
+   the data itself if it fits in four bytes, else pos */
+static unsigned synth_data (unsigned char *buf, unsigned pos, const void *data, unsigned len)
+{
+  unsigned char v[4] = { 0 };
+
+  memcpy (buf + pos, data, len);
+  if (len > 4) return pos;
+  memcpy (v, data, len);
+  return v[0] | v[1] << 8 | v[2] << 16 | (unsigned) v[3] << 24;
+}
+
+/* a JPEG that parses as far as its SOF0 marker, which is all dcraw looks at */
+static unsigned synth_jpeg (unsigned char *p, unsigned w, unsigned h, unsigned len, unsigned seed)
+{
+  static const unsigned char head[] = {
+    0xff,0xd8, 0xff,0xc0, 0,17, 8, 0,0, 0,0, 3, 1,0x22,0, 2,0x11,1, 3,0x11,1,
+    0xff,0xda, 0,12, 3, 1,0, 2,0x11, 3,0x11, 0,63,0 };
+  unsigned i;
+
+  memcpy (p, head, sizeof head);
+  p[7] = h >> 8; p[8] = h;
+  p[9] = w >> 8; p[10] = w;
+  for (i = sizeof head; i < len-2; i++) {
+    seed = seed * 1103515245 + 12345;
+    p[i] = (seed >> 16) % 255;        /* no 0xff, so no markers */
+  }
+  p[len-2] = 0xff;
+  p[len-1] = 0xd9;
+  return len;
+}
+
+/* Writes the file; returns 0 if it can't. */
+static int write_dng (const char *path, const struct synth *s, unsigned seed)
+{
+  enum { IFD0 = 8, EXIF = IFD0 + 2 + 24*12 + 4, SUB = EXIF + 2 + 12 + 4, DATA = SUB + 2 + 8*12 + 4 };
+  static const int cm[9] = { 4716, 603, -830, -7798, 15474, 2480, -1496, 1937, 6651 };
+  static const unsigned neutral[3] = { 500, 1000, 700 };
+  const char *make = s->make ? s->make : "Synth", *model = s->model ? s->model : "DNG";
+  unsigned npat = s->dim * s->dim, pw = s->preview, ph = pw * 3 / 4, plen = pw ? 200 + pw : 0;
+  unsigned makep = DATA, modelp = makep + 64, cfap = modelp + 64, cmp = cfap + 36;
+  unsigned asnp = cmp + 9*8, datep = asnp + 3*8, jpegp = datep + 20, rawp = jpegp + plen;
+  unsigned row, col, v, i, n;
+  unsigned char *buf, *e;
+  size_t size;
+  FILE *fp;
+
+  size = rawp + (size_t) s->w * s->h * 2;
+  if (!(buf = (unsigned char *) calloc (size, 1))) return 0;
+  memcpy (buf, "II*\0", 4);
+  synth_put4 (buf+4, IFD0);
+#define TAG(tag,type,count,val) \
+  (synth_put2 (e, tag), synth_put2 (e+2, type), synth_put4 (e+4, count), \
+   synth_put4 (e+8, val), e += 12, n++)
+  e = buf + IFD0 + 2;
+  n = 0;
+  TAG (254, 4, 1, 0);
+  TAG (256, 4, 1, s->w);
+  TAG (257, 4, 1, s->h);
+  TAG (258, 3, 1, 16);
+  TAG (259, 3, 1, 1);
+  TAG (262, 3, 1, 32803);
+  TAG (271, 2, strlen (make) + 1, synth_data (buf, makep, make, strlen (make) + 1));
+  TAG (272, 2, strlen (model) + 1, synth_data (buf, modelp, model, strlen (model) + 1));
+  TAG (273, 4, 1, rawp);
+  TAG (274, 3, 1, s->orient);
+  TAG (277, 3, 1, 1);
+  TAG (278, 4, 1, s->h);
+  TAG (279, 4, 1, s->w * s->h * 2);
+  if (pw) TAG (330, 4, 1, SUB);
+  TAG (33421, 3, 2, s->dim | s->dim << 16);
+  TAG (33422, 1, npat, synth_data (buf, cfap, s->cfa, npat));
+  TAG (34665, 4, 1, EXIF);
+  TAG (50706, 1, 4, 0x0401);
+  TAG (50714, 4, 1, 64);
+  TAG (50717, 4, 1, 4095);
+  if (!s->no_matrix) {
+    TAG (50721, 10, 9, cmp);
+    TAG (50728, 5, 3, asnp);
+  }
+  synth_put2 (buf + IFD0, n);
+  synth_put4 (e, 0);
+  e = buf + EXIF + 2;
+  n = 0;
+  TAG (36867, 2, 20, datep);
+  synth_put2 (buf + EXIF, n);
+  if (pw) {
+    e = buf + SUB + 2;
+    n = 0;
+    TAG (254, 4, 1, 1);
+    TAG (256, 4, 1, pw);
+    TAG (257, 4, 1, ph);
+    TAG (259, 3, 1, 7);
+    TAG (262, 3, 1, 6);
+    TAG (273, 4, 1, jpegp);
+    TAG (277, 3, 1, 3);
+    TAG (279, 4, 1, plen);
+    synth_put2 (buf + SUB, n);
+    synth_jpeg (buf + jpegp, pw, ph, plen, seed);
+  }
+#undef TAG
+  for (i=0; i < 9; i++) {
+    synth_put4 (buf + cmp + i*8, cm[i]);
+    synth_put4 (buf + cmp + i*8 + 4, 10000);
+  }
+  for (i=0; i < 3; i++) {
+    synth_put4 (buf + asnp + i*8, neutral[i]);
+    synth_put4 (buf + asnp + i*8 + 4, 1000);
+  }
+  snprintf ((char *) buf + datep, 20, "2021:%02u:%02u 10:20:30", seed % 12 + 1, seed % 28 + 1);
+  /* smooth ramps with edges and noise, so every interpolation path differs */
+  for (row=0; row < s->h; row++)
+    for (col=0; col < s->w; col++) {
+      seed = seed * 1103515245 + 12345;
+      v = 64 + (row*9 + col*5) % 2800 + (seed >> 16) % 400;
+      if ((row / 17 + col / 23) & 1) v += 600;
+      synth_put2 (buf + rawp + ((size_t) row*s->w + col)*2, v);
+    }
+  fp = fopen (path, "wb");
+  if (!fp || fwrite (buf, 1, size, fp) != size) {
+    if (fp) fclose (fp);
+    free (buf);
+    return 0;
+  }
+  free (buf);
+  return !fclose (fp);
+}
@@ -0,0 +1,165 @@
+/*
+   Calls the raw entry points on synthetic DNGs (with and without
+   previews, plus a truncated one and a file that isn't raw at all)
+   from many threads at once, in a different order on each thread, and
+   checks every result against the same call made on one thread.
+   The broken files make dcraw complain on stderr; that's expected.
+   Worth running under -fsanitize=thread too.
+
+   cc -std=gnu2x -O1 -DNO_JPEG -o thread_check tests/thread_check.c -lm -lpthread
+   ./thread_check [threads]
+ */
+#include "../dcraw.c"
+#include "synth_dng.h"
+
+#define NFILES 7
+#define NCALLS 6
+#define ROUNDS 6
+
+static const struct synth synths[NFILES-2] = {
+  { 300, 200, 1, 2, {0,1,1,2}, 640 },
+  { 640, 480, 6, 2, {1,0,2,1}, 160 },
+  { 128, 96, 8, 2, {2,1,1,0} },
+  { 600, 402, 3, 6, {1,1,0,1,1,2, 1,1,2,1,1,0, 2,0,1,0,2,1,
+                     1,1,2,1,1,0, 1,1,0,1,1,2, 0,2,1,2,0,1}, 1024 },
+  { 256, 128, 5, 2, {0,1,1,2}, 320, "Canon", "EOS 5D" },
+};
+static char paths[NFILES][32];
+static unsigned expect[NFILES][NCALLS];
+static atomic_int failed;
+
+static unsigned hash (unsigned h, const void *data, size_t len)
+{
+  const uchar *p = (const uchar *) data;
+
+  while (len--) h = (h ^ *p++) * 16777619;
+  return h;
+}
+#define HASH(h,v) hash (h, &(v), sizeof (v))
+
+/* a hash of everything the call gave back; *got is 0 if that was nothing */
+static unsigned call (int i, int which, int *got)
+{
+  struct dcraw_info info;
+  size_t len = 0, stride = 0;
+  unsigned short tw = 0, th = 0, rw = 0, rh = 0, orientation = 0;
+  enum dcraw_type type = 0;
+  unsigned h = 2166136261u;
+  char *data = 0;
+  int n, k;
+
+  *got = 0;
+  switch (which) {
+    case 0:
+    case 1:
+      memset (&info, 0, sizeof info);
+      h = hash (h, &which, sizeof which);
+      if (!(n = ProbeRawFile (paths[i], which ? DCRAW_TIMESTAMP : DCRAW_ALL, &info)))
+        return h;
+      *got = 1;
+      h = HASH (h, n);
+      h = HASH (h, info.timestamp);
+      h = HASH (h, info.orientation);
+      h = HASH (h, info.raw_width);
+      h = HASH (h, info.raw_height);
+      h = HASH (h, info.exif_offset);
+      h = HASH (h, info.exif_length);
+      h = HASH (h, info.npreviews);
+      for (k=0; k < info.npreviews; k++) {
+        h = HASH (h, info.previews[k].offset);
+        h = HASH (h, info.previews[k].length);
+        h = HASH (h, info.previews[k].width);
+        h = HASH (h, info.previews[k].height);
+        h = HASH (h, info.previews[k].type);
+      }
+      if (!which) {
+        uchar *exif = CopyExifDataFromRawFile (paths[i], &info, &n);
+        if (exif) h = hash (h, exif, n);
+        free (exif);
+      }
+      return h;
+    case 2:
+      data = ExtractThumbnailFromRawFile (paths[i], 160, &len, &tw, &th, &type, &rw, &rh, &orientation);
+      break;
+    case 3:
+      data = DecodeThumbnailFromRawFile (paths[i], 160, 4, &len, &stride, &tw, &th, &type, &rw, &rh, &orientation);
+      break;
+    case 4:
+      /* bigger than any preview, so the raw data is decoded */
+      data = DecodeThumbnailFromRawFile (paths[i], 2000, 3, &len, &stride, &tw, &th, &type, &rw, &rh, &orientation);
+      break;
+    case 5:
+      data = DecodeRawFile (paths[i], 4, &len, &stride, &tw, &th, &rw, &rh);
+      break;
+  }
+  h = HASH (h, which);
+  if (!data) return h;
+  *got = 1;
+  h = hash (h, data, len);
+  h = HASH (h, stride);
+  h = HASH (h, tw);
+  h = HASH (h, th);
+  h = HASH (h, type);
+  h = HASH (h, rw);
+  h = HASH (h, rh);
+  h = HASH (h, orientation);
+  free (data);
+  return h;
+}
+
+static void *worker (void *arg)
+{
+  unsigned seed = (unsigned) (size_t) arg * 2654435761u + 1;
+  int n, i, which, got;
+
+  for (n=0; n < ROUNDS * NFILES * NCALLS; n++) {
+    seed = seed * 1103515245 + 12345;
+    i = (seed >> 8) % NFILES;
+    which = (seed >> 20) % NCALLS;
+    if (call (i, which, &got) != expect[i][which]) {
+      printf ("%s: call %d on thread %d differs\n", paths[i], which, (int) (size_t) arg);
+      failed = 1;
+    }
+  }
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  int nthreads = argc > 1 ? atoi (argv[1]) : 8, i, k, fd, got, results = 0;
+  pthread_t *tid;
+  FILE *fp;
+
+  if (nthreads < 1 || !(tid = (pthread_t *) calloc (nthreads, sizeof *tid))) {
+    fprintf (stderr, "usage: %s [threads]\n", argv[0]);
+    return 1;
+  }
+  dcraw_init();
+  for (i=0; i < NFILES; i++) {
+    strcpy (paths[i], "/tmp/thread_checkXXXXXX");
+    if ((fd = mkstemp (paths[i])) < 0 || close (fd) ||
+        !write_dng (paths[i], synths + (i < NFILES-2 ? i : 0), i+1)) {
+      perror (paths[i]);
+      return 1;
+    }
+  }
+  /* one cut off in the middle of its raw data, so decoding it fails partway */
+  if (truncate (paths[NFILES-2], 30000) ||
+      !(fp = fopen (paths[NFILES-1], "wb")) || fprintf (fp, "%0*d", 100000, 0) < 0 || fclose (fp)) {
+    perror (paths[NFILES-1]);
+    return 1;
+  }
+  for (i=0; i < NFILES; i++)
+    for (k=0; k < NCALLS; k++)
+      expect[i][k] = call (i, k, &got), results += got;
+  printf ("%d of %d calls return something\n", results, NFILES * NCALLS);
+  for (i=0; i < nthreads; i++)
+    pthread_create (tid+i, 0, worker, (void *) (size_t) i);
+  for (i=0; i < nthreads; i++)
+    pthread_join (tid[i], 0);
+  for (i=0; i < NFILES; i++)
+    unlink (paths[i]);
+  free (tid);
+  if (!failed) printf ("%d threads: ok\n", nthreads);
+  return failed;
+}
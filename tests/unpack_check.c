@@ -0,0 +1,207 @@
+/*
+   Checks packed_load_raw()'s whole-row path (packed_row() and
+   unpack_bits(), with the vector kernel on and off) against the
+   bit-buffer loop it replaced, on random data: every depth from 8 to
+   16 bits, chunks of 8, 16, 24 and 32 bits, the column swaps, padded
+   and interleaved rows, odd widths and files that end mid-row.  Then
+   checks sony_arw2_load_raw() against the sget2() loop it replaced, on
+   random blocks of which a quarter have imax == imin.
+
+   cc -std=gnu2x -O1 -DNO_JPEG -o unpack_check tests/unpack_check.c -lm -lpthread
+   ./unpack_check
+ */
+#include "../dcraw.c"
+
+#define FILE_SIZE 0x100000
+
+/* packed_load_raw() before the whole-row path */
+static void ref_packed_load_raw()
+{
+  int vbits=0, bwide, rbits, bite, half, irow, row, col, val, i;
+  UINT64 bitbuf=0;
+
+  bwide = raw_width * tiff_bps / 8;
+  bwide += bwide & load_flags >> 9;
+  rbits = bwide * 8 - raw_width * tiff_bps;
+  if (load_flags & 1) bwide = bwide * 16 / 15;
+  bite = 8 + (load_flags & 56);
+  half = (raw_height+1) >> 1;
+  for (irow=0; irow < raw_height; irow++) {
+    row = irow;
+    if (load_flags & 2 &&
+        (row = irow % half * 2 + irow / half) == 1 &&
+        load_flags & 4) {
+      if (vbits=0, tiff_compress)
+        fseek (ifp, data_offset - (-half*bwide & -2048), SEEK_SET);
+      else {
+        fseek (ifp, 0, SEEK_END);
+        fseek (ifp, ftell(ifp) >> 3 << 2, SEEK_SET);
+      }
+    }
+    for (col=0; col < raw_width; col++) {
+      for (vbits -= tiff_bps; vbits < 0; vbits += bite) {
+        bitbuf <<= bite;
+        for (i=0; i < bite; i+=8)
+          bitbuf |= ((UINT64) fgetc(ifp) << i);
+      }
+      val = bitbuf << (64-tiff_bps-vbits) >> (64-tiff_bps);
+      RAW(row,col ^ (load_flags >> 6 & 3)) = val;
+    }
+    vbits -= rbits;
+  }
+}
+
+/* sony_arw2_load_raw() before the 128-bit words, reading two spare bytes */
+static void ref_sony_arw2_load_raw()
+{
+  uchar *data, *dp;
+  ushort pix[16];
+  int row, col, val, max, min, imax, imin, sh, bit, i;
+
+  data = (uchar *) calloc (raw_width+2, 1);
+  merror (data, "ref_sony_arw2_load_raw()");
+  for (row=0; row < height; row++) {
+    fread (data, 1, raw_width, ifp);
+    for (dp=data, col=0; col < raw_width-30; dp+=16) {
+      max = 0x7ff & (val = sget4(dp));
+      min = 0x7ff & val >> 11;
+      imax = 0x0f & val >> 22;
+      imin = 0x0f & val >> 26;
+      for (sh=0; sh < 4 && 0x80 << sh <= max-min; sh++);
+      for (bit=30, i=0; i < 16; i++)
+        if      (i == imax) pix[i] = max;
+        else if (i == imin) pix[i] = min;
+        else {
+          pix[i] = ((sget2(dp+(bit >> 3)) >> (bit & 7) & 0x7f) << sh) + min;
+          if (pix[i] > 0x7ff) pix[i] = 0x7ff;
+          bit += 7;
+        }
+      for (i=0; i < 16; i++, col+=2)
+        RAW(row,col) = curve[pix[i] << 1] >> 2;
+      col -= col & 1 ? 1:31;
+    }
+  }
+  free (data);
+}
+
+/* runs fn from offset in the file, into a fresh raw_image; 0 if it failed */
+static ushort *load (const char *path, long offset, void (*fn)())
+{
+  size_t size = (size_t) raw_width * (raw_height+7);
+
+  if (!(raw_image = (ushort *) malloc (size * 2))) return 0;
+  memset (raw_image, 0x55, size * 2);
+  if (!(ifp = fopen (path, "rb"))) {
+    free (raw_image);
+    return 0;
+  }
+  ifname = path;
+  fseek (ifp, offset, SEEK_SET);
+  if (setjmp (failure)) {
+    fclose (ifp);
+    free (raw_image);
+    return 0;
+  }
+  (*fn)();
+  fclose (ifp);
+  return raw_image;
+}
+
+static int compare (const char *path, long offset, void (*fast)(), void (*ref)(), const char *what)
+{
+  size_t size = (size_t) raw_width * (raw_height+7) * 2;
+  ushort *got, *want;
+  int ok;
+
+  got = load (path, offset, fast);
+  want = load (path, offset, ref);
+  if (!(ok = got && want && !memcmp (got, want, size)))
+    printf ("%s: differs\n", what);
+  free (got);
+  free (want);
+  return ok;
+}
+
+int main()
+{
+  static const int widths[] = { 37, 640, 641, 1003 };
+  static const int bites[] = { 0, 8, 16, 24 };            /* load_flags & 56 */
+  static const int rows[] = { 0, 2, 2|4 };                /* interleaved */
+  char path[] = "/tmp/unpack_checkXXXXXX", what[160];
+  int fd, simd, w, bps, b, x, r, pad, cut, i, j, cases = 0, bad = 0, failed = 0;
+  unsigned seed = 1;
+  long need;
+  uchar *buf;
+
+  if ((fd = mkstemp (path)) < 0 || !(buf = (uchar *) malloc (FILE_SIZE))) {
+    perror (path);
+    return 1;
+  }
+  for (i=0; i < FILE_SIZE; i++)
+    buf[i] = (seed = seed * 1103515245 + 12345) >> 16;
+  if (write (fd, buf, FILE_SIZE) != FILE_SIZE || close (fd)) {
+    perror (path);
+    return 1;
+  }
+  dcraw_init();
+  simd = !!unpack_simd;
+  for (unpack_simd = 0; unpack_simd <= simd; unpack_simd++)
+    for (w=0; w < sizeof widths / sizeof *widths; w++)
+      for (bps=8; bps <= 16; bps++)
+        for (b=0; b < 4; b++)
+          for (x=0; x < 4; x++)
+            for (r=0; r < 3; r++)
+              for (pad=0; pad < 2; pad++)
+                for (cut=0; cut < 6; cut++) {
+                  raw_width = width = widths[w];
+                  raw_height = height = 23;
+                  top_margin = left_margin = 0;
+                  tiff_bps = bps;
+                  tiff_compress = pad;
+                  load_flags = bites[b] | x << 6 | rows[r] | pad << 9;
+                  need = (long) raw_height * raw_width * bps / 8 + raw_height * 8;
+                  /* the file ends part way through row 11, at any byte of a chunk */
+                  data_offset = cut ? FILE_SIZE - need / 2 - cut : w * 1001 + bps;
+                  snprintf (what, sizeof what, "width %d, %d bits, %d-bit chunks, swap %d, rows %d, pad %d, %s, %s",
+                            raw_width, bps, 8 + bites[b], x, rows[r], pad,
+                            cut ? "short read" : "whole file", unpack_simd ? "vector" : "scalar");
+                  bad += !compare (path, data_offset, packed_load_raw, ref_packed_load_raw, what);
+                  cases++;
+                }
+  unpack_simd = simd;
+  printf ("packed_load_raw: %d cases, %s kernel, %d differ\n", cases,
+          simd ? "scalar and vector" : "scalar", bad);
+  failed |= bad;
+
+  /* ARW2: random blocks, every fourth with imax == imin, and all four shifts */
+  for (i=0; i + 16 <= FILE_SIZE; i += 16) {
+    UINT64 lo = sget4 (buf+i) | (UINT64) sget4 (buf+i+4) << 32;
+    if (!(i & 48)) lo = (lo & ~(0xffULL << 22)) | (lo >> 22 & 15) * 0x11ULL << 22;
+    if ((i & 0x300) == 0x100) lo = (lo & ~0x3fffffULL) | (lo & 0x7ff) << 11 | 0x7ff;
+    for (j=0; j < 8; j++)
+      buf[i+j] = lo >> (j*8);
+  }
+  if ((fd = open (path, O_WRONLY)) < 0 || write (fd, buf, FILE_SIZE) != FILE_SIZE || close (fd)) {
+    perror (path);
+    return 1;
+  }
+  order = 0x4949;
+  for (i=0; i < 0x10000; i++)
+    curve[i] = (i * 37) ^ (i >> 3);
+  cases = bad = 0;
+  for (w=0; w < 4; w++)
+    for (cut=0; cut < 2; cut++) {
+      raw_width = width = 32 * (w+3) + w * 6;
+      raw_height = height = 31;
+      snprintf (what, sizeof what, "sony_arw2_load_raw, width %d, %s",
+                raw_width, cut ? "short read" : "whole file");
+      bad += !compare (path, cut ? FILE_SIZE - raw_width * 10 - 5 : w * 4096,
+                       sony_arw2_load_raw, ref_sony_arw2_load_raw, what);
+      cases++;
+    }
+  printf ("sony_arw2_load_raw: %d cases, %d differ\n", cases, bad);
+  failed |= bad;
+  unlink (path);
+  free (buf);
+  return failed;
+}